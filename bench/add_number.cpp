@@ -0,0 +1,109 @@
+// Integer formatting of TFJsonSerializer::addNumber compared to the vsnprintf path it replaced.
+// Build and run from this directory:
+//     g++ -std=gnu++11 -O2 -I../src add_number.cpp -o add_number && ./add_number
+
+#define TFJSON_IMPLEMENTATION
+#include "TFJson.h"
+
+#include <chrono>
+#include <inttypes.h>
+#include <random>
+#include <stdarg.h>
+#include <stdio.h>
+#include <vector>
+
+#define VALUE_COUNT (1 << 20)
+#define ROUNDS 10
+
+// The previous addNumber path: A comma if needed, then vsnprintf with a PRI* format into the remaining buffer.
+struct VsnprintfWriter {
+    char *buf;
+    size_t buf_size;
+    char *head;
+    bool in_empty_container = true;
+
+    VsnprintfWriter(char *buf, size_t buf_size) : buf(buf), buf_size(buf_size), head(buf) {}
+
+    [[gnu::format(__printf__, 2, 3)]] void writePlainF(const char *fmt, ...) {
+        va_list args;
+        va_start(args, fmt);
+        int w = vsnprintf(head, buf_size - (size_t)(head - buf), fmt, args);
+        va_end(args);
+
+        head += w;
+    }
+
+    void addNumber(uint64_t u) {
+        if (!in_empty_container)
+            *head++ = ',';
+
+        in_empty_container = false;
+        writePlainF("%" PRIu64, u);
+    }
+
+    void addNumber(int32_t i) {
+        if (!in_empty_container)
+            *head++ = ',';
+
+        in_empty_container = false;
+        writePlainF("%" PRIi32, i);
+    }
+};
+
+template<typename T, typename Writer>
+static double run(std::vector<char> &buf, const std::vector<T> &values, size_t *len) {
+    double best = 1e100;
+
+    for (int round = 0; round < ROUNDS; ++round) {
+        auto start = std::chrono::steady_clock::now();
+
+        Writer json(buf.data(), buf.size());
+
+        for (T value : values)
+            json.addNumber(value);
+
+        double ns = std::chrono::duration<double, std::nano>(std::chrono::steady_clock::now() - start).count();
+
+        *len = (size_t)(json.head - json.buf);
+
+        if (ns < best)
+            best = ns;
+    }
+
+    return best / (double)values.size();
+}
+
+template<typename T>
+static void compare(const char *name, const std::vector<T> &values) {
+    std::vector<char> buf(values.size() * 24);
+    size_t tfjson_len;
+    size_t vsnprintf_len;
+    double tfjson_ns = run<T, TFJsonSerializer>(buf, values, &tfjson_len);
+    double vsnprintf_ns = run<T, VsnprintfWriter>(buf, values, &vsnprintf_len);
+
+    if (tfjson_len != vsnprintf_len) {
+        printf("%s: length mismatch %zu vs %zu\n", name, tfjson_len, vsnprintf_len);
+        return;
+    }
+
+    printf("%-16s addNumber %6.1f ns, vsnprintf %6.1f ns per number (%.1fx)\n", name, tfjson_ns, vsnprintf_ns, vsnprintf_ns / tfjson_ns);
+}
+
+int main() {
+    std::mt19937_64 rng(1);
+    std::vector<uint64_t> u64(VALUE_COUNT);
+    std::vector<uint64_t> u64_small(VALUE_COUNT);
+    std::vector<int32_t> i32(VALUE_COUNT);
+
+    for (size_t i = 0; i < VALUE_COUNT; ++i) {
+        u64[i] = rng();
+        u64_small[i] = rng() % 10000;
+        i32[i] = (int32_t)rng();
+    }
+
+    compare("uint64 random", u64);
+    compare("uint64 < 10000", u64_small);
+    compare("int32 random", i32);
+
+    return 0;
+}
@@ -0,0 +1,85 @@
+// Base64 encoding throughput of TFJsonSerializer::addBase64 compared to the scalar table lookup per 6 bits.
+// Build and run from this directory:
+//     g++ -std=gnu++11 -O2 -I../src base64.cpp -o base64 && ./base64
+// Add -U__SSE2__ (x86) to measure the scalar fallback.
+
+#define TFJSON_IMPLEMENTATION
+#include "TFJson.h"
+
+#include <chrono>
+#include <random>
+#include <stdio.h>
+#include <vector>
+
+#define DATA_LEN (3 << 18)
+#define ROUNDS 20
+
+// The scalar encoder: One alphabet lookup per output char.
+struct ScalarWriter {
+    char *buf;
+    size_t buf_size;
+    char *head;
+
+    ScalarWriter(char *buf, size_t buf_size) : buf(buf), buf_size(buf_size), head(buf) {}
+
+    void addBase64(const uint8_t *data, size_t len) {
+        static const char alphabet[65] = "ABCDEFGHIJKLMNOPQRSTUVWXYZabcdefghijklmnopqrstuvwxyz0123456789+/";
+
+        *head++ = '"';
+
+        for (size_t i = 0; i + 3 <= len; i += 3) {
+            uint32_t v = ((uint32_t)data[i] << 16) | ((uint32_t)data[i + 1] << 8) | data[i + 2];
+
+            head[0] = alphabet[(v >> 18) & 0x3F];
+            head[1] = alphabet[(v >> 12) & 0x3F];
+            head[2] = alphabet[(v >>  6) & 0x3F];
+            head[3] = alphabet[(v >>  0) & 0x3F];
+            head += 4;
+        }
+
+        *head++ = '"';
+        *head = '\0';
+    }
+};
+
+template<typename Writer>
+static double run(std::vector<char> &buf, const std::vector<uint8_t> &data) {
+    double best = 1e100;
+
+    for (int round = 0; round < ROUNDS; ++round) {
+        auto start = std::chrono::steady_clock::now();
+
+        Writer json(buf.data(), buf.size());
+
+        json.addBase64(data.data(), data.size());
+
+        double s = std::chrono::duration<double>(std::chrono::steady_clock::now() - start).count();
+
+        if (s < best)
+            best = s;
+    }
+
+    return (double)data.size() / best / 1e9;
+}
+
+int main() {
+    std::mt19937 rng(1);
+    std::vector<uint8_t> data(DATA_LEN);
+
+    for (uint8_t &b : data)
+        b = (uint8_t)rng();
+
+    std::vector<char> tfjson_buf(DATA_LEN / 3 * 4 + 3);
+    std::vector<char> scalar_buf(tfjson_buf.size());
+    double tfjson_gbs = run<TFJsonSerializer>(tfjson_buf, data);
+    double scalar_gbs = run<ScalarWriter>(scalar_buf, data);
+
+    if (tfjson_buf != scalar_buf) {
+        printf("output mismatch\n");
+        return 1;
+    }
+
+    printf("%d bytes: addBase64 %.2f GB/s, scalar %.2f GB/s (%.1fx)\n", DATA_LEN, tfjson_gbs, scalar_gbs, tfjson_gbs / scalar_gbs);
+
+    return 0;
+}
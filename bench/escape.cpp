@@ -0,0 +1,131 @@
+// String escaping throughput of TFJsonSerializer::addString compared to the previous per-byte writeEscaped loop.
+// Build and run from this directory:
+//     g++ -std=gnu++11 -O2 -I../src escape.cpp -o escape && ./escape
+// Add -U__SSE2__ (x86) to measure the SWAR fallback.
+
+#define TFJSON_IMPLEMENTATION
+#include "TFJson.h"
+
+#include <chrono>
+#include <stdio.h>
+#include <string>
+#include <vector>
+
+#define STRING_LEN (1 << 20)
+#define ROUNDS 20
+
+// The previous writeEscaped: A switch per byte and a bounds checked writePlain(char) per output char.
+struct PerByteWriter {
+    char *buf;
+    size_t buf_size;
+    char *head;
+    size_t buf_required = 0;
+
+    PerByteWriter(char *buf, size_t buf_size) : buf(buf), buf_size(buf_size), head(buf) {}
+
+    void writePlain(char c) {
+        ++buf_required;
+
+        if (buf_size == 0 || (size_t)(head - buf) > (buf_size - 1))
+            return;
+
+        *head = c;
+        ++head;
+    }
+
+    void addString(const char *c, size_t len) {
+        const char *end = c + len;
+
+        writePlain('"');
+
+        while (c != end) {
+            switch (*c) {
+                case '\\': writePlain('\\'); writePlain('\\'); break;
+                case '"':  writePlain('\\'); writePlain('"');  break;
+                case '\b': writePlain('\\'); writePlain('b');  break;
+                case '\f': writePlain('\\'); writePlain('f');  break;
+                case '\n': writePlain('\\'); writePlain('n');  break;
+                case '\r': writePlain('\\'); writePlain('r');  break;
+                case '\t': writePlain('\\'); writePlain('t');  break;
+
+                default:
+                    if ((uint8_t)*c < 0x20) {
+                        char x = *c;
+
+                        writePlain('\\');
+                        writePlain('u');
+                        writePlain('0');
+                        writePlain('0');
+                        writePlain(x & 0x10 ? '1' : '0');
+
+                        x &= 0x0F;
+                        writePlain(x >= 10 ? 'A' + (x - 10) : '0' + x);
+                    }
+                    else {
+                        writePlain(*c);
+                    }
+
+                    break;
+            }
+
+            ++c;
+        }
+
+        writePlain('"');
+    }
+};
+
+template<typename Writer>
+static double run(std::vector<char> &buf, const std::string &input, size_t *len) {
+    double best = 1e100;
+
+    for (int round = 0; round < ROUNDS; ++round) {
+        auto start = std::chrono::steady_clock::now();
+
+        Writer json(buf.data(), buf.size());
+
+        json.addString(input.data(), input.size());
+
+        double s = std::chrono::duration<double>(std::chrono::steady_clock::now() - start).count();
+
+        *len = (size_t)(json.head - json.buf);
+
+        if (s < best)
+            best = s;
+    }
+
+    return (double)input.size() / best / 1e9;
+}
+
+static void compare(const char *name, const std::string &input) {
+    std::vector<char> buf(input.size() * 6 + 2);
+    size_t tfjson_len;
+    size_t per_byte_len;
+    double tfjson_gbs = run<TFJsonSerializer>(buf, input, &tfjson_len);
+    double per_byte_gbs = run<PerByteWriter>(buf, input, &per_byte_len);
+
+    if (tfjson_len != per_byte_len) {
+        printf("%s: length mismatch %zu vs %zu\n", name, tfjson_len, per_byte_len);
+        return;
+    }
+
+    printf("%-24s addString %6.2f GB/s, per byte %6.2f GB/s (%.1fx)\n", name, tfjson_gbs, per_byte_gbs, tfjson_gbs / per_byte_gbs);
+}
+
+int main() {
+    std::string clean(STRING_LEN, ' ');
+    std::string quotes(STRING_LEN, ' ');
+    std::string controls(STRING_LEN, ' ');
+
+    for (size_t i = 0; i < STRING_LEN; ++i) {
+        clean[i] = (char)('a' + i % 26);
+        quotes[i] = i % 8 == 7 ? '"' : clean[i];
+        controls[i] = i % 8 == 7 ? '\x01' : clean[i];
+    }
+
+    compare("clean", clean);
+    compare("every 8th byte a quote", quotes);
+    compare("every 8th byte \\u0001", controls);
+
+    return 0;
+}
@@ -0,0 +1,97 @@
+// Parsing with std::function handlers (TFJsonDeserializer) compared to member function handlers (TFJsonParser<Derived>).
+// Build and run from this directory:
+//     g++ -std=gnu++11 -O2 -I../src handler_dispatch.cpp -o handler_dispatch && ./handler_dispatch
+
+#define TFJSON_IMPLEMENTATION
+#include "TFJson.h"
+
+#include <chrono>
+#include <stdio.h>
+#include <string>
+
+#define ROUNDS 500
+
+struct Totals {
+    double doubles = 0;
+    uint64_t uint64s = 0;
+    size_t string_len = 0;
+    size_t members = 0;
+};
+
+struct StaticParser : TFJsonParser<StaticParser> {
+    Totals totals;
+
+    StaticParser() : TFJsonParser(32, 64) {}
+
+    bool onMember(char *, size_t) { ++totals.members; return true; }
+    bool onString(char *, size_t len) { totals.string_len += len; return true; }
+    bool onDouble(double d) { totals.doubles += d; return true; }
+    bool onUInt64(uint64_t u) { totals.uint64s += u; return true; }
+};
+
+static std::string make_document() {
+    std::string doc = "[";
+
+    for (int i = 0; i < 2000; ++i) {
+        if (i > 0)
+            doc += ",";
+
+        doc += "{\"voltage\":" + std::to_string(220 + i % 20) + ",\"power\":" + std::to_string(i) + ".25,\"name\":\"wallbox\",\"on\":true,\"x\":null}";
+    }
+
+    return doc + "]";
+}
+
+template<typename Parse>
+static double run(const std::string &doc, Parse parse) {
+    std::string copy;
+    double best = 1e100;
+
+    for (int round = 0; round < ROUNDS; ++round) {
+        // The parser modifies the buffer.
+        copy = doc;
+
+        auto start = std::chrono::steady_clock::now();
+
+        if (!parse(&copy[0], copy.size())) {
+            printf("parse failed\n");
+            return 0;
+        }
+
+        double ms = std::chrono::duration<double, std::milli>(std::chrono::steady_clock::now() - start).count();
+
+        if (ms < best)
+            best = ms;
+    }
+
+    return best;
+}
+
+int main() {
+    std::string doc = make_document();
+
+    Totals function_totals;
+    TFJsonDeserializer deserializer(32, 64);
+
+    deserializer.setMemberHandler([&](char *, size_t) { ++function_totals.members; return true; });
+    deserializer.setStringHandler([&](char *, size_t len) { function_totals.string_len += len; return true; });
+    deserializer.setDoubleHandler([&](double d) { function_totals.doubles += d; return true; });
+    deserializer.setUInt64Handler([&](uint64_t u) { function_totals.uint64s += u; return true; });
+
+    StaticParser parser;
+
+    double function_ms = run(doc, [&](char *buf, size_t len) { return deserializer.parse(buf, len); });
+    double static_ms = run(doc, [&](char *buf, size_t len) { return parser.parse(buf, len); });
+
+    if (function_totals.members != parser.totals.members || function_totals.string_len != parser.totals.string_len ||
+        function_totals.doubles != parser.totals.doubles || function_totals.uint64s != parser.totals.uint64s) {
+        printf("handler results differ\n");
+        return 1;
+    }
+
+    printf("%zu bytes: std::function %.3f ms (%.0f MB/s), TFJsonParser %.3f ms (%.0f MB/s), %.2fx\n",
+           doc.size(), function_ms, doc.size() / function_ms / 1000, static_ms, doc.size() / static_ms / 1000, function_ms / static_ms);
+    printf("sizeof: TFJsonDeserializer %zu bytes, StaticParser %zu bytes\n", sizeof(TFJsonDeserializer), sizeof(StaticParser));
+
+    return 0;
+}
@@ -6,44 +6,194 @@
 #include <stdint.h>
 #include <stdarg.h>
 #include <inttypes.h>
+#include <stdlib.h> // for malloc, strtoul
+#include <string.h> // for memmove
+#include <assert.h>
+#include <limits.h> // for CHAR_MIN
 #include <limits>
 #include <functional>
+#include <type_traits>
+#include <utility> // for std::move
+
+// Gather output (TFJsonSerializer::setGatherOutput) needs struct iovec from sys/uio.h.
+// Define TFJSON_GATHER as 0 to leave it out, e.g. on toolchains without sys/uio.h that don't support __has_include.
+#ifndef TFJSON_GATHER
+#if defined(__has_include)
+#if __has_include(<sys/uio.h>)
+#define TFJSON_GATHER 1
+#else
+#define TFJSON_GATHER 0
+#endif
+#elif defined(_WIN32)
+#define TFJSON_GATHER 0
+#else
+#define TFJSON_GATHER 1
+#endif
+#endif
+
+#if TFJSON_GATHER
+#include <sys/uio.h> // for struct iovec
+#endif
+
+#if defined(__SSE2__)
+#include <emmintrin.h>
+#elif defined(__ARM_NEON) && defined(__aarch64__)
+#include <arm_neon.h>
+#endif
 
 #define TFJSON_USE_STRLEN std::numeric_limits<size_t>::max()
 
+// Stack space used by addStringF and addMemberStringF. Longer formatted strings are formatted directly into the output buffer.
+// Only during sizing passes and with a flush handler, longer strings need a temporary heap buffer.
+#ifndef TFJSON_FORMAT_SCRATCH_SIZE
+#define TFJSON_FORMAT_SCRATCH_SIZE 128
+#endif
+
+// Minimum length of strings that are referenced instead of copied in gather output mode.
+#ifndef TFJSON_GATHER_MIN_LEN
+#define TFJSON_GATHER_MIN_LEN 64
+#endif
+
+constexpr bool tfjson_is_plain_key(const char *key, size_t len) {
+    return len == 0 || (key[0] != '"' && key[0] != '\\' && (uint8_t)key[0] >= 0x20 && tfjson_is_plain_key(key + 1, len - 1));
+}
+
+template<bool plain>
+constexpr const char *tfjson_check_plain_key(const char *key) {
+    static_assert(plain, "TFJSON_KEY only supports keys without chars that have to be escaped");
+    return key;
+}
+
+// Floats with up to this many integer digits are formatted in decimal notation by tfjson_format_float.
+#define TFJSON_FLOAT_DECIMAL_DIGITS_MAX 15
+
+constexpr size_t tfjson_decimal_len(uint64_t value) {
+    return value < 10 ? 1 : 1 + tfjson_decimal_len(value / 10);
+}
+
+constexpr size_t tfjson_max_len(size_t a, size_t b) {
+    return a > b ? a : b;
+}
+
+// Maximum length of a formatted number of type T: All digits plus sign for integers. For floats the longer one of the
+// decimal notation (sign, integer digits, ".0") and the exponential notation (sign, digits, point, "e-", exponent). The
+// exponent of the smallest subnormal is above min_exponent10 - max_digits10.
+template<typename T>
+constexpr size_t tfjson_number_max_len() {
+    return std::numeric_limits<T>::is_integer ? std::numeric_limits<T>::digits10 + 1 + std::numeric_limits<T>::is_signed
+                                              : tfjson_max_len(1 + TFJSON_FLOAT_DECIMAL_DIGITS_MAX + 2,
+                                                               1 + std::numeric_limits<T>::max_digits10 + 1 + 2 +
+                                                               tfjson_decimal_len(std::numeric_limits<T>::max_digits10 - std::numeric_limits<T>::min_exponent10));
+}
+
+// Key of an object member. Keys passed as const char * are escaped while serializing.
+struct TFJsonKey {
+    const char *key;
+    size_t len;
+    bool escaped; // key is "key": with quotes, colon and escape sequences already applied
+
+    // Pass len if known to avoid the strlen.
+    constexpr TFJsonKey(const char *key, size_t len = TFJSON_USE_STRLEN) : key(key), len(len), escaped(false) {}
+
+    static constexpr TFJsonKey preEscaped(const char *escaped_key, size_t escaped_len) {
+        return TFJsonKey(escaped_key, escaped_len, true);
+    }
+
+private:
+    constexpr TFJsonKey(const char *key, size_t len, bool escaped) : key(key), len(len), escaped(escaped) {}
+};
+
+// Creates a TFJsonKey from a string literal at compile time. The member is then written with a single memcpy.
+#define TFJSON_KEY(key) TFJsonKey::preEscaped(tfjson_check_plain_key<tfjson_is_plain_key(key, sizeof(key) - 1)>("\"" key "\":"), sizeof("\"" key "\":") - 1)
+
+// Specialized by TFJSON_FIELDS.
+template<typename T>
+struct TFJsonFields;
+
 struct TFJsonSerializer {
-    char * const buf;
-    const size_t buf_size;
+    char *buf;
+    size_t buf_size;
     char *head;
     size_t buf_required;
     bool in_empty_container = true;
+    size_t malloc_size_max = 0;
+    bool owns_buf = false;
+    std::function<bool(const char *, size_t)> flush_handler;
+#if TFJSON_GATHER
+    struct iovec *iov = nullptr;
+    size_t iov_max = 0;
+    size_t iov_count = 0;
+    char *iov_pending = nullptr; // start of the bytes in buf that are not in iov yet
+#endif
+    size_t gathered_len = 0;
 
     // To get the required buffer size, construct with buf = nullptr and buf_size = 0 and construct your JSON payload.
     // TFJsonSerializer::end() will return the required buffer size WITHOUT NULL TERMINATOR!
+    // Such a sizing pass only counts: Integers and literals are measured without formatting them, strings without escaping them.
     TFJsonSerializer(char *buf, size_t buf_size);
+    ~TFJsonSerializer();
 
     // Disallow copying the serializer, because why would you?
     TFJsonSerializer(const TFJsonSerializer&) = delete;
     TFJsonSerializer &operator=(const TFJsonSerializer&) = delete;
 
+    // Stream the payload instead of truncating it: If buf is full, the flush handler is called with the buffered bytes and buf is reused.
+    // TFJsonSerializer::end() flushes the remaining bytes, but does not pass a null terminator to the flush handler.
+    // Return false from the flush handler to abort. All further output is dropped then.
+    // Strings longer than buf are passed through to the flush handler.
+    void setFlushHandler(std::function<bool(const char *, size_t)> &&flush_handler);
+
+    // Construct the payload in a single pass instead of running a sizing pass first: Construct with buf = nullptr and buf_size = 0
+    // and call setGrowable() before adding anything. buf is then allocated and grown geometrically up to malloc_size_max bytes.
+    // After TFJsonSerializer::end(), buf contains the null terminated payload. It is freed by the destructor unless release() is called.
+    // If growing fails, the payload is truncated as with a fixed buffer, i.e. TFJsonSerializer::end() returns a size >= buf_size.
+    void setGrowable(size_t malloc_size_max, size_t initial_size = 256);
+    // Returns the heap allocated buf and hands its ownership to the caller.
+    char *release();
+
+    // Gather output for writev: Strings of at least TFJSON_GATHER_MIN_LEN chars that need no escaping are not copied into buf,
+    // but referenced by iov next to the serializer's own bytes in buf. After TFJsonSerializer::end(), the payload (without null terminator)
+    // is iov[0..iov_count). Referenced strings must stay valid until the payload is written. Strings are copied once iov is full.
+    // buf only has to hold the serializer's own bytes. If it is too small for them, iov_count is 0 after TFJsonSerializer::end().
+    // Can't be combined with a flush handler or a growable buffer. Only available if TFJSON_GATHER is set.
+#if TFJSON_GATHER
+    void setGatherOutput(struct iovec *iov, size_t iov_max);
+#endif
+
     // Object
-    void addMemberNumber(const char *key, uint64_t u);
-    void addMemberNumber(const char *key, int64_t i);
-    void addMemberNumber(const char *key, uint32_t u);
-    void addMemberNumber(const char *key, int32_t i);
-    void addMemberNumber(const char *key, uint16_t u);
-    void addMemberNumber(const char *key, int16_t i);
-    void addMemberNumber(const char *key, uint8_t u);
-    void addMemberNumber(const char *key, int8_t i);
-    void addMemberNumber(const char *key, double f);
-    void addMemberNumber(const char *key, float f);
-    void addMemberBoolean(const char *key, bool b);
-    void addMemberNull(const char *key);
-    void addMemberString(const char *key, const char *c);
-    [[gnu::format(__printf__, 3, 0)]] void addMemberStringVF(const char *key, const char *fmt, va_list args);
-    [[gnu::format(__printf__, 3, 4)]] void addMemberStringF(const char *key, const char *fmt, ...);
-    void addMemberArray(const char *key);
-    void addMemberObject(const char *key);
+    // Keys can be plain strings, TFJsonKey(key, len) to avoid the strlen or TFJSON_KEY("literal") to avoid escaping at runtime.
+    void addMemberNumber(TFJsonKey key, uint64_t u);
+    void addMemberNumber(TFJsonKey key, int64_t i);
+    void addMemberNumber(TFJsonKey key, uint32_t u);
+    void addMemberNumber(TFJsonKey key, int32_t i);
+    void addMemberNumber(TFJsonKey key, uint16_t u);
+    void addMemberNumber(TFJsonKey key, int16_t i);
+    void addMemberNumber(TFJsonKey key, uint8_t u);
+    void addMemberNumber(TFJsonKey key, int8_t i);
+    void addMemberNumber(TFJsonKey key, double f);
+    void addMemberNumber(TFJsonKey key, float f);
+    void addMemberBoolean(TFJsonKey key, bool b);
+    void addMemberNull(TFJsonKey key);
+    void addMemberString(TFJsonKey key, const char *c);
+    [[gnu::format(__printf__, 3, 0)]] void addMemberStringVF(TFJsonKey key, const char *fmt, va_list args);
+    [[gnu::format(__printf__, 3, 4)]] void addMemberStringF(TFJsonKey key, const char *fmt, ...);
+    void addMemberArray(TFJsonKey key);
+    void addMemberObject(TFJsonKey key);
+    void addMemberNumberArray(TFJsonKey key, const uint64_t *u, size_t count);
+    void addMemberNumberArray(TFJsonKey key, const int64_t *i, size_t count);
+    void addMemberNumberArray(TFJsonKey key, const uint32_t *u, size_t count);
+    void addMemberNumberArray(TFJsonKey key, const int32_t *i, size_t count);
+    void addMemberNumberArray(TFJsonKey key, const uint16_t *u, size_t count);
+    void addMemberNumberArray(TFJsonKey key, const int16_t *i, size_t count);
+    void addMemberNumberArray(TFJsonKey key, const uint8_t *u, size_t count);
+    void addMemberNumberArray(TFJsonKey key, const int8_t *i, size_t count);
+    void addMemberNumberArray(TFJsonKey key, const double *f, size_t count);
+    void addMemberNumberArray(TFJsonKey key, const float *f, size_t count);
+    void addMemberStringArray(TFJsonKey key, const char *const *c, size_t count);
+    template<typename T> void addMemberFields(TFJsonKey key, const T &value);
+    void addMemberBase64(TFJsonKey key, const uint8_t *data, size_t len);
+    void addMemberHex(TFJsonKey key, const uint8_t *data, size_t len);
+    bool addMemberRaw(TFJsonKey key, const char *c, size_t len = TFJSON_USE_STRLEN);
 
     // Array or top level
     void addNumber(uint64_t u, bool enquote = false);
@@ -63,6 +213,26 @@ struct TFJsonSerializer {
     [[gnu::format(__printf__, 2, 3)]] void addStringF(const char *fmt, ...);
     void addArray();
     void addObject();
+    void addNumberArray(const uint64_t *u, size_t count);
+    void addNumberArray(const int64_t *i, size_t count);
+    void addNumberArray(const uint32_t *u, size_t count);
+    void addNumberArray(const int32_t *i, size_t count);
+    void addNumberArray(const uint16_t *u, size_t count);
+    void addNumberArray(const int16_t *i, size_t count);
+    void addNumberArray(const uint8_t *u, size_t count);
+    void addNumberArray(const int8_t *i, size_t count);
+    void addNumberArray(const double *f, size_t count);
+    void addNumberArray(const float *f, size_t count);
+    void addStringArray(const char *const *c, size_t count);
+    // Adds the fields of a struct described with TFJSON_FIELDS as an object.
+    template<typename T> void addFields(const T &value);
+    // Binary data as string in standard Base64 encoding (with padding) or as lower case hex digits.
+    // Encoded directly into the output buffer without a temporary copy.
+    void addBase64(const uint8_t *data, size_t len);
+    void addHex(const uint8_t *data, size_t len);
+    // Splices in already serialized JSON, e.g. a fragment cached by TFJsonFragmentCache. c has to be exactly one valid JSON value;
+    // it is copied verbatim (or referenced with gather output). An empty c is not a value: Nothing is added and false is returned.
+    bool addRaw(const char *c, size_t len = TFJSON_USE_STRLEN);
 
     // Both
     void endArray();
@@ -70,516 +240,4268 @@ struct TFJsonSerializer {
     size_t end();
 
 private:
-    void addKey(const char *key);
-    void writeEscaped(const char *c, size_t len = TFJSON_USE_STRLEN);
+    friend struct TFJsonTemplate;
+
+    bool measuring() const;
+    bool flush();
+    void abortFlush();
+    bool grow(size_t len);
+    bool reserve(size_t len);
+    void truncate();
+    void addKey(TFJsonKey key);
+    void writeInteger(uint64_t u, bool negative);
+    template<typename T> void writeNumbers(const T *values, size_t count);
+    void writeEncoded(const uint8_t *data, size_t len, size_t block_len, size_t encoded_block_len, void (*encode)(char *out, const uint8_t *data, size_t blocks));
+#if TFJSON_GATHER
+    void gatherPending();
+    bool gatherReferenced(const char *c, size_t len);
+#endif
+    // With gather output, long clean strings are referenced unless may_reference is false, e.g. for temporary memory.
+    void writeEscaped(const char *c, size_t len = TFJSON_USE_STRLEN, bool may_reference = true);
+    void escapeInPlace(size_t len, size_t escaped_len);
     [[gnu::format(__printf__, 2, 0)]] void writeEscapedVF(const char *fmt, va_list args);
     [[gnu::format(__printf__, 2, 3)]] void writeEscapedF(const char *fmt, ...);
     void writePlain(char c);
     void writePlain(const char *c, size_t len);
-    [[gnu::format(__printf__, 2, 0)]] void writePlainVF(const char *fmt, va_list args);
-    [[gnu::format(__printf__, 2, 3)]] void writePlainF(const char *fmt, ...);
 };
 
-struct TFJsonDeserializer {
-    enum class Error {
-        Aborted,
-        ExpectingEndOfInput,
-        ExpectingValue,
-        ExpectingOpeningCurlyBracket,
-        ExpectingClosingCurlyBracket,
-        ExpectingColon,
-        ExpectingOpeningSquareBracket,
-        ExpectingClosingSquareBracket,
-        ExpectingOpeningQuote,
-        ExpectingClosingQuote,
-        ExpectingNumber,
-        ExpectingFractionDigits,
-        ExpectingExponentDigits,
-        ExpectingNull,
-        ExpectingTrue,
-        ExpectingFalse,
-        InvalidEscapeSequence,
-        UnescapedControlCharacter,
-        ForbiddenNullInString,
-        NestingTooDeep,
-        InlineNullByte,
-        InvalidUTF8StartByte,
-        InvalidUTF8ContinuationByte,
-        BufferTooShort,
-        OutOfMemory,
-        ElementTooLong,
-        RefillFailure,
+// Caches serialized sub-documents that rarely change, e.g. device descriptors or static config, so that they are copied
+// instead of being serialized again for every payload. Fragments are identified by an id and built on demand. Pass the version
+// counter of the data the fragment was built from: If it changes, the fragment is built again. Up to slot_count fragments are kept,
+// the least recently used one is replaced. Each fragment is allocated separately with at most malloc_size_max bytes.
+// With gather output, payloads reference the cached fragments: Don't use more distinct ids in one payload than there are slots
+// and don't invalidate fragments before the payload is written.
+struct TFJsonFragmentCache {
+    TFJsonFragmentCache(size_t slot_count, size_t malloc_size_max);
+    ~TFJsonFragmentCache();
+
+    TFJsonFragmentCache(const TFJsonFragmentCache&) = delete;
+    TFJsonFragmentCache &operator=(const TFJsonFragmentCache&) = delete;
+
+    // build gets an empty serializer and has to add exactly one top level value.
+    // If the fragment can't be built (too large, out of memory or empty), nothing is added to json and false is returned.
+    bool addRaw(TFJsonSerializer &json, uint32_t id, uint32_t version, const std::function<void(TFJsonSerializer &)> &build);
+    bool addMemberRaw(TFJsonSerializer &json, TFJsonKey key, uint32_t id, uint32_t version, const std::function<void(TFJsonSerializer &)> &build);
+    // Returns the null terminated fragment or nullptr. Valid until the fragment is built again, invalidated or evicted.
+    const char *get(uint32_t id, uint32_t version, const std::function<void(TFJsonSerializer &)> &build, size_t *len = nullptr);
+    void invalidate(uint32_t id);
+    void clear();
+
+private:
+    struct Slot {
+        char *fragment;
+        size_t len;
+        uint32_t id;
+        uint32_t version;
+        uint32_t last_use;
     };
 
-    const size_t nesting_depth_max;
-    const size_t malloc_size_max;
-    const bool allow_null_in_string;
-    size_t nesting_depth;
-    size_t utf8_count;
-    char *buf;
-    size_t buf_len;
-    ssize_t idx_nul;  // (virtual) nul-terminator
-    ssize_t idx_cur;  // current character
-    ssize_t idx_okay; // no parsing error until here [inclusive]
-    ssize_t idx_done; // data is not needed anymore until here [inclusive]
-    char cur;
-    std::function<void(Error, char *, size_t)> error_handler;
-    std::function<ssize_t(char *, size_t)> refill_handler;
-    std::function<bool(void)> begin_handler;
-    std::function<bool(void)> end_handler;
-    std::function<bool(void)> object_begin_handler;
-    std::function<bool(void)> object_end_handler;
-    std::function<bool(void)> array_begin_handler;
-    std::function<bool(void)> array_end_handler;
-    std::function<bool(char *, size_t)> member_handler;
-    std::function<bool(char *, size_t)> string_handler;
-    std::function<bool(double)> double_handler;
-    std::function<bool(int64_t)> int64_handler;
-    std::function<bool(uint64_t)> uint64_handler;
-    std::function<bool(char *, size_t)> number_handler;
-    std::function<bool(bool)> boolean_handler;
-    std::function<bool(void)> null_handler;
+    Slot *find(uint32_t id);
 
-    TFJsonDeserializer(size_t nesting_depth_max, size_t malloc_size_max, bool allow_null_in_string = true);
+    Slot *slots;
+    size_t slot_count;
+    size_t malloc_size_max;
+    uint32_t use_counter = 0;
+};
 
-    // Disallow copying the deserializer, because why would you?
-    TFJsonDeserializer(const TFJsonDeserializer&) = delete;
-    TFJsonDeserializer &operator=(const TFJsonDeserializer&) = delete;
+// Pre-compiled payload with typed slots for periodic messages that always have the same shape:
+// Build the shape once with the shape serializer and add slots where the values go. Then call compile().
+//     tmpl.shape.addObject();
+//     tmpl.addMemberSlot(TFJSON_KEY("voltage"), TFJsonTemplate::Type::Uint32);
+//     tmpl.addMemberSlot(TFJSON_KEY("power"), TFJsonTemplate::Type::Double);
+//     tmpl.shape.endObject();
+//     tmpl.compile();
+// Each fill then only copies the constant bytes and formats the values, passed in slot order with exactly the slot types.
+// If the output buffer has room for maxLength() bytes, no further checks are done. Otherwise, the values are added one by one.
+struct TFJsonTemplate {
+    enum class Type : uint8_t {
+        Uint64,
+        Int64,
+        Uint32,
+        Int32,
+        Uint16,
+        Int16,
+        Uint8,
+        Int8,
+        Double,
+        Float,
+        Boolean,
+        String,
+    };
 
-    static const char *getErrorName(Error error);
+    struct Value {
+        Type type;
+        union {
+            uint64_t u;
+            int64_t i;
+            double d;
+            float f;
+            bool b;
+            const char *s;
+        };
+        size_t len; // of s
+
+        Value() : type(Type::Boolean), b(false), len(0) {}
+        Value(uint64_t u) : type(Type::Uint64), u(u), len(0) {}
+        Value(int64_t i) : type(Type::Int64), i(i), len(0) {}
+        Value(uint32_t u) : type(Type::Uint32), u(u), len(0) {}
+        Value(int32_t i) : type(Type::Int32), i(i), len(0) {}
+        Value(uint16_t u) : type(Type::Uint16), u(u), len(0) {}
+        Value(int16_t i) : type(Type::Int16), i(i), len(0) {}
+        Value(uint8_t u) : type(Type::Uint8), u(u), len(0) {}
+        Value(int8_t i) : type(Type::Int8), i(i), len(0) {}
+        Value(double d) : type(Type::Double), d(d), len(0) {}
+        Value(float f) : type(Type::Float), f(f), len(0) {}
+        Value(bool b) : type(Type::Boolean), b(b), len(0) {}
+        Value(const char *s) : type(Type::String), s(s), len(TFJSON_USE_STRLEN) {}
+
+        // Integer types that are none of the above, e.g. int where int32_t is long. Otherwise, fill(json, 5) would be ambiguous.
+        template<typename T, typename std::enable_if<std::is_integral<T>::value && std::is_signed<T>::value, int>::type = 0>
+        Value(T i) : type(Type::Int64), i(i), len(0) {}
+        template<typename T, typename std::enable_if<std::is_integral<T>::value && std::is_unsigned<T>::value && !std::is_same<T, bool>::value, int>::type = 0>
+        Value(T u) : type(Type::Uint64), u(u), len(0) {}
+    };
 
-    void setErrorHandler(std::function<void(Error, char *, size_t)> &&error_handler);
-    void setRefillHandler(std::function<ssize_t(char *, size_t)> &&refill_handler);
-    void setBeginHandler(std::function<bool(void)> &&begin_handler);
-    void setEndHandler(std::function<bool(void)> &&end_handler);
-    void setObjectBeginHandler(std::function<bool(void)> &&object_begin_handler);
-    void setObjectEndHandler(std::function<bool(void)> &&object_end_handler);
-    void setArrayBeginHandler(std::function<bool(void)> &&array_begin_handler);
-    void setArrayEndHandler(std::function<bool(void)> &&array_end_handler);
-    void setMemberHandler(std::function<bool(char *, size_t)> &&member_handler);
-    void setStringHandler(std::function<bool(char *, size_t)> &&string_handler);
-    void setDoubleHandler(std::function<bool(double)> &&double_handler);
-    void setInt64Handler(std::function<bool(int64_t)> &&int64_handler);
-    void setUInt64Handler(std::function<bool(uint64_t)> &&uint64_handler);
-    void setNumberHandler(std::function<bool(char *, size_t)> &&number_handler);
-    void setBooleanHandler(std::function<bool(bool)> &&boolean_handler);
-    void setNullHandler(std::function<bool(void)> &&null_handler);
+    // The constant bytes are built in a growable buffer with at most malloc_size_max bytes.
+    TFJsonSerializer shape;
 
-    bool parse(char *buf, size_t len = TFJSON_USE_STRLEN);
+    TFJsonTemplate(size_t malloc_size_max = 1024);
+    ~TFJsonTemplate();
 
-private:
-    void reportError(Error error);
-    size_t shift();
-    bool next(size_t *offset = nullptr);
-    void okay(ssize_t offset = 0);
-    void done();
-    bool enterNesting();
-    void leaveNesting();
-    bool isWhitespace();
-    bool isDigit();
-    bool isHexDigit();
-    bool isControl();
-    bool skipWhitespace();
-    bool parseElements();
-    bool parseElement();
-    bool parseValue();
-    bool parseObject();
-    bool parseMembers();
-    bool parseMember();
-    bool parseArray();
-    bool parseString(bool report_as_member_name = false);
-    bool parseNumber();
-    bool parseNull();
-    bool parseTrue();
-    bool parseFalse();
-};
+    TFJsonTemplate(const TFJsonTemplate&) = delete;
+    TFJsonTemplate &operator=(const TFJsonTemplate&) = delete;
 
-#endif
+    // String slots only have a bounded length if string_len_max is passed. Longer strings then take the slow path.
+    void addSlot(Type type, size_t string_len_max = TFJSON_USE_STRLEN);
+    void addMemberSlot(TFJsonKey key, Type type, size_t string_len_max = TFJSON_USE_STRLEN);
+    // Returns false if the shape did not fit into malloc_size_max bytes, the slots could not be allocated or the template is empty.
+    bool compile();
 
-#ifdef TFJSON_IMPLEMENTATION
+    // Upper bound of the filled payload length without null terminator. TFJSON_LEN_UNBOUNDED if there are unbounded string slots.
+    size_t maxLength() const;
 
-#include <stdio.h>
-#include <string.h>
-#include <math.h>
-#include <errno.h>
-#include <inttypes.h>
-#include <assert.h>
-#include <limits.h> // for CHAR_MIN
+    // Adds the filled template as a value to json, like TFJsonSerializer::addRaw().
+    template<typename... Args> void fill(TFJsonSerializer &json, Args... values);
+    // Fills the template into buf. Returns the length as TFJsonSerializer::end() does.
+    template<typename... Args> size_t fill(char *buf, size_t buf_size, Args... values);
 
-static bool isctrl(char c) {
-    // JSON allows 0x7F unescaped
-#if CHAR_MIN == 0
-    return c <= 0x1F;
-#else
-    return c <= 0x1F && c >= 0; // UTF-8 compatibility
-#endif
-}
+    // Values are converted to the type of their slot, e.g. an int to a Uint8 slot, if they are in its range.
+    // Other values are added as they are. Missing values are added as null, surplus values are ignored.
+    void fillValues(TFJsonSerializer &json, Value *values, size_t count);
 
-#if 0
-#define debugf(...) printf("TFJsonDeserializer: " __VA_ARGS__)
-#else
-#define debugf(...) (void)0
-#endif
+private:
+    struct Slot {
+        size_t offset; // in the constant bytes
+        size_t max_len;
+        Type type;
+    };
 
-// Use this macro and pass length to writePlain so that the compiler can see (and create constants of) the string literal lengths.
-#define WRITE_PLAIN_LITERAL(x) this->writePlain((x), strlen((x)))
+    Slot *slots = nullptr;
+    size_t slot_count = 0;
+    size_t slot_capacity = 0;
+    bool slots_failed = false;
+    const char *constant = nullptr;
+    size_t constant_len = 0;
+    size_t max_len = 0;
+};
 
-TFJsonSerializer::TFJsonSerializer(char *buf, size_t buf_size) : buf(buf), buf_size(buf_size), head(buf), buf_required(0) {}
+template<typename... Args>
+void TFJsonTemplate::fill(TFJsonSerializer &json, Args... values) {
+    // + 1 to allow filling templates without slots.
+    Value value_array[sizeof...(Args) + 1] = {Value(values)...};
 
-void TFJsonSerializer::addMemberNumber(const char *key, uint64_t u) {
-    this->addKey(key);
-    this->addNumber(u);
+    this->fillValues(json, value_array, sizeof...(Args));
 }
 
-void TFJsonSerializer::addMemberNumber(const char *key, int64_t i) {
-    this->addKey(key);
-    this->addNumber(i);
-}
+template<typename... Args>
+size_t TFJsonTemplate::fill(char *buf, size_t buf_size, Args... values) {
+    TFJsonSerializer json{buf, buf_size};
 
-void TFJsonSerializer::addMemberNumber(const char *key, uint32_t u) {
-    this->addKey(key);
-    this->addNumber(u);
-}
+    this->fill(json, values...);
 
-void TFJsonSerializer::addMemberNumber(const char *key, int32_t i) {
-    this->addKey(key);
-    this->addNumber(i);
+    return json.end();
 }
 
-void TFJsonSerializer::addMemberNumber(const char *key, uint16_t u) {
-    this->addKey(key);
-    this->addNumber(u);
-}
+// Emits RFC 7386 merge patches that only contain the members that changed since the last patch, e.g. to push state updates to a client.
+// Hashes of the member paths and values of the previous patch are kept in a table with room for member_count_max members.
+// It is allocated once by the constructor. Members that don't fit into the table are always emitted.
+// Objects nested deeper than nesting_depth_max are not tracked either: They are emitted completely in every patch.
+// If the constructor can't allocate the table or the nesting levels, every patch contains the full state.
+// Add the full state every time between begin() and end(). Objects are only opened if any of their members changed.
+// The keys of objects have to stay valid until the matching endObject().
+// Arrays are replaced as a whole by a merge patch, so they are emitted completely if any element changed.
+// Members that are no longer added are not removed at the client. Add them with addMemberNull() to remove them.
+// Each client needs its own TFJsonDeltaSerializer. Call reset() if a patch could not be delivered to send the full state again.
+// Don't run sizing passes: Each pass updates the table.
+struct TFJsonDeltaSerializer {
+    TFJsonDeltaSerializer(size_t member_count_max, size_t nesting_depth_max = 8);
+    ~TFJsonDeltaSerializer();
+
+    TFJsonDeltaSerializer(const TFJsonDeltaSerializer&) = delete;
+    TFJsonDeltaSerializer &operator=(const TFJsonDeltaSerializer&) = delete;
+
+    // The patch is a top level object in json.
+    void begin(TFJsonSerializer &json);
+
+    void addMemberNumber(TFJsonKey key, uint64_t u);
+    void addMemberNumber(TFJsonKey key, int64_t i);
+    void addMemberNumber(TFJsonKey key, uint32_t u);
+    void addMemberNumber(TFJsonKey key, int32_t i);
+    void addMemberNumber(TFJsonKey key, uint16_t u);
+    void addMemberNumber(TFJsonKey key, int16_t i);
+    void addMemberNumber(TFJsonKey key, uint8_t u);
+    void addMemberNumber(TFJsonKey key, int8_t i);
+    void addMemberNumber(TFJsonKey key, double f);
+    void addMemberNumber(TFJsonKey key, float f);
+    void addMemberBoolean(TFJsonKey key, bool b);
+    void addMemberNull(TFJsonKey key);
+    void addMemberString(TFJsonKey key, const char *c);
+    void addMemberNumberArray(TFJsonKey key, const uint64_t *u, size_t count);
+    void addMemberNumberArray(TFJsonKey key, const int64_t *i, size_t count);
+    void addMemberNumberArray(TFJsonKey key, const uint32_t *u, size_t count);
+    void addMemberNumberArray(TFJsonKey key, const int32_t *i, size_t count);
+    void addMemberNumberArray(TFJsonKey key, const uint16_t *u, size_t count);
+    void addMemberNumberArray(TFJsonKey key, const int16_t *i, size_t count);
+    void addMemberNumberArray(TFJsonKey key, const uint8_t *u, size_t count);
+    void addMemberNumberArray(TFJsonKey key, const int8_t *i, size_t count);
+    void addMemberNumberArray(TFJsonKey key, const double *f, size_t count);
+    void addMemberNumberArray(TFJsonKey key, const float *f, size_t count);
+    void addMemberStringArray(TFJsonKey key, const char *const *c, size_t count);
+    // Any other array: add_elements adds the elements to the serializer. It is called once to hash them and again if they changed.
+    void addMemberArray(TFJsonKey key, const std::function<void(TFJsonSerializer &)> &add_elements);
+    void addMemberObject(TFJsonKey key);
+    void endObject();
 
-void TFJsonSerializer::addMemberNumber(const char *key, int16_t i) {
-    this->addKey(key);
-    this->addNumber(i);
-}
+    // Returns the patch length as TFJsonSerializer::end() does. If nothing changed, nothing is written and 0 is returned.
+    size_t end();
+    // Forgets the previous values. The next patch contains the full state.
+    void reset();
 
-void TFJsonSerializer::addMemberNumber(const char *key, uint8_t u) {
-    this->addKey(key);
-    this->addNumber(u);
-}
+private:
+    struct Entry {
+        uint64_t path; // 0 marks an empty entry
+        uint64_t value;
+    };
 
-void TFJsonSerializer::addMemberNumber(const char *key, int8_t i) {
-    this->addKey(key);
-    this->addNumber(i);
-}
+    struct Level {
+        uint64_t path;
+        TFJsonKey key;
+        bool opened;
+        bool emit_all; // the object is new or replaced a value: all members have to be emitted
+    };
 
-void TFJsonSerializer::addMemberNumber(const char *key, double f) {
-    this->addKey(key);
-    this->addNumber(f);
-}
+    uint64_t memberPath(TFJsonKey key) const;
+    bool changed(uint64_t path, uint64_t value);
+    bool enterMember(TFJsonKey key, uint64_t value);
+    void openLevels();
+    template<typename T> void addMemberScalar(TFJsonKey key, T value);
+    template<typename T> void addMemberArrayOf(TFJsonKey key, const T *values, size_t count);
+
+    TFJsonSerializer *json = nullptr;
+    Entry *entries;
+    size_t entry_mask;
+    Level *levels;
+    size_t nesting_depth_max;
+    size_t nesting_depth = 0;
+    size_t untracked_depth = 0; // objects opened past nesting_depth_max
+};
 
-void TFJsonSerializer::addMemberNumber(const char *key, float f) {
-    this->addKey(key);
-    this->addNumber(f);
-}
+#define TFJSON_LEN_UNBOUNDED std::numeric_limits<size_t>::max()
 
-void TFJsonSerializer::addMemberBoolean(const char *key, bool b) {
-    this->addKey(key);
-    this->addBoolean(b);
+constexpr size_t tfjson_add_len(size_t a, size_t b) {
+    return a == TFJSON_LEN_UNBOUNDED || b == TFJSON_LEN_UNBOUNDED ? TFJSON_LEN_UNBOUNDED : a + b;
 }
 
-void TFJsonSerializer::addMemberNull(const char *key) {
-    this->addKey(key);
-    this->addNull();
+constexpr size_t tfjson_sum_len() {
+    return 0;
 }
 
-void TFJsonSerializer::addMemberString(const char *key, const char *c) {
-    this->addKey(key);
-    this->addString(c);
+template<typename... Lens>
+constexpr size_t tfjson_sum_len(size_t len, Lens... lens) {
+    return tfjson_add_len(len, tfjson_sum_len(lens...));
 }
 
-void TFJsonSerializer::addMemberStringVF(const char *key, const char *fmt, va_list args) {
-    this->addKey(key);
-    this->addStringVF(fmt, args);
-}
+// How a struct field of type T is serialized and its maximum serialized length. Structs described with TFJSON_FIELDS become objects.
+template<typename T, typename Enable = void>
+struct TFJsonField {
+    static void addMember(TFJsonSerializer &json, TFJsonKey key, const T &value) { json.addMemberFields(key, value); }
+    static constexpr size_t max_len = TFJsonFields<T>::max_len;
+};
 
-void TFJsonSerializer::addMemberStringF(const char *key, const char *fmt, ...) {
-    va_list args;
-    va_start(args, fmt);
-    this->addMemberStringVF(key, fmt, args);
-    va_end(args);
-}
+template<typename T>
+struct TFJsonField<T, typename std::enable_if<std::is_arithmetic<T>::value>::type> {
+    static void addMember(TFJsonSerializer &json, TFJsonKey key, T value) { json.addMemberNumber(key, value); }
+    static constexpr size_t max_len = tfjson_number_max_len<T>();
+};
 
-void TFJsonSerializer::addMemberArray(const char *key) {
-    this->addKey(key);
-    this->writePlain('[');
-}
+template<>
+struct TFJsonField<bool> {
+    static void addMember(TFJsonSerializer &json, TFJsonKey key, bool value) { json.addMemberBoolean(key, value); }
+    static constexpr size_t max_len = 5;
+};
 
-void TFJsonSerializer::addMemberObject(const char *key) {
-    this->addKey(key);
-    this->writePlain('{');
-}
+template<>
+struct TFJsonField<const char *> {
+    static void addMember(TFJsonSerializer &json, TFJsonKey key, const char *value) { json.addMemberString(key, value); }
+    static constexpr size_t max_len = TFJSON_LEN_UNBOUNDED;
+};
 
-void TFJsonSerializer::addNumber(uint64_t u, bool enquote) {
-    if (!in_empty_container)
-        this->writePlain(',');
+// Null terminated string in a char array. Every char might need a six char escape sequence.
+template<size_t N>
+struct TFJsonField<char[N]> {
+    static void addMember(TFJsonSerializer &json, TFJsonKey key, const char *value) { json.addMemberString(key, value); }
+    static constexpr size_t max_len = 2 + 6 * (N - 1);
+};
 
-    in_empty_container = false;
+template<typename T, size_t N>
+struct TFJsonField<T[N], typename std::enable_if<std::is_arithmetic<T>::value && !std::is_same<T, bool>::value && !std::is_same<T, char>::value>::type> {
+    static void addMember(TFJsonSerializer &json, TFJsonKey key, const T *value) { json.addMemberNumberArray(key, value, N); }
+    static constexpr size_t max_len = 2 + N * (tfjson_number_max_len<T>() + 1) - 1;
+};
 
-    if (enquote)
-        this->writePlain('"');
+#define TFJSON_EXPAND(x) x
+#define TFJSON_FOR_EACH_1(m, t, x) m(t, x)
+#define TFJSON_FOR_EACH_2(m, t, x, ...) m(t, x) TFJSON_EXPAND(TFJSON_FOR_EACH_1(m, t, __VA_ARGS__))
+#define TFJSON_FOR_EACH_3(m, t, x, ...) m(t, x) TFJSON_EXPAND(TFJSON_FOR_EACH_2(m, t, __VA_ARGS__))
+#define TFJSON_FOR_EACH_4(m, t, x, ...) m(t, x) TFJSON_EXPAND(TFJSON_FOR_EACH_3(m, t, __VA_ARGS__))
+#define TFJSON_FOR_EACH_5(m, t, x, ...) m(t, x) TFJSON_EXPAND(TFJSON_FOR_EACH_4(m, t, __VA_ARGS__))
+#define TFJSON_FOR_EACH_6(m, t, x, ...) m(t, x) TFJSON_EXPAND(TFJSON_FOR_EACH_5(m, t, __VA_ARGS__))
+#define TFJSON_FOR_EACH_7(m, t, x, ...) m(t, x) TFJSON_EXPAND(TFJSON_FOR_EACH_6(m, t, __VA_ARGS__))
+#define TFJSON_FOR_EACH_8(m, t, x, ...) m(t, x) TFJSON_EXPAND(TFJSON_FOR_EACH_7(m, t, __VA_ARGS__))
+#define TFJSON_FOR_EACH_9(m, t, x, ...) m(t, x) TFJSON_EXPAND(TFJSON_FOR_EACH_8(m, t, __VA_ARGS__))
+#define TFJSON_FOR_EACH_10(m, t, x, ...) m(t, x) TFJSON_EXPAND(TFJSON_FOR_EACH_9(m, t, __VA_ARGS__))
+#define TFJSON_FOR_EACH_11(m, t, x, ...) m(t, x) TFJSON_EXPAND(TFJSON_FOR_EACH_10(m, t, __VA_ARGS__))
+#define TFJSON_FOR_EACH_12(m, t, x, ...) m(t, x) TFJSON_EXPAND(TFJSON_FOR_EACH_11(m, t, __VA_ARGS__))
+#define TFJSON_FOR_EACH_13(m, t, x, ...) m(t, x) TFJSON_EXPAND(TFJSON_FOR_EACH_12(m, t, __VA_ARGS__))
+#define TFJSON_FOR_EACH_14(m, t, x, ...) m(t, x) TFJSON_EXPAND(TFJSON_FOR_EACH_13(m, t, __VA_ARGS__))
+#define TFJSON_FOR_EACH_15(m, t, x, ...) m(t, x) TFJSON_EXPAND(TFJSON_FOR_EACH_14(m, t, __VA_ARGS__))
+#define TFJSON_FOR_EACH_16(m, t, x, ...) m(t, x) TFJSON_EXPAND(TFJSON_FOR_EACH_15(m, t, __VA_ARGS__))
+#define TFJSON_FOR_EACH_17(m, t, x, ...) m(t, x) TFJSON_EXPAND(TFJSON_FOR_EACH_16(m, t, __VA_ARGS__))
+#define TFJSON_FOR_EACH_18(m, t, x, ...) m(t, x) TFJSON_EXPAND(TFJSON_FOR_EACH_17(m, t, __VA_ARGS__))
+#define TFJSON_FOR_EACH_19(m, t, x, ...) m(t, x) TFJSON_EXPAND(TFJSON_FOR_EACH_18(m, t, __VA_ARGS__))
+#define TFJSON_FOR_EACH_20(m, t, x, ...) m(t, x) TFJSON_EXPAND(TFJSON_FOR_EACH_19(m, t, __VA_ARGS__))
+#define TFJSON_FOR_EACH_21(m, t, x, ...) m(t, x) TFJSON_EXPAND(TFJSON_FOR_EACH_20(m, t, __VA_ARGS__))
+#define TFJSON_FOR_EACH_22(m, t, x, ...) m(t, x) TFJSON_EXPAND(TFJSON_FOR_EACH_21(m, t, __VA_ARGS__))
+#define TFJSON_FOR_EACH_23(m, t, x, ...) m(t, x) TFJSON_EXPAND(TFJSON_FOR_EACH_22(m, t, __VA_ARGS__))
+#define TFJSON_FOR_EACH_24(m, t, x, ...) m(t, x) TFJSON_EXPAND(TFJSON_FOR_EACH_23(m, t, __VA_ARGS__))
+#define TFJSON_FOR_EACH_25(m, t, x, ...) m(t, x) TFJSON_EXPAND(TFJSON_FOR_EACH_24(m, t, __VA_ARGS__))
+#define TFJSON_FOR_EACH_26(m, t, x, ...) m(t, x) TFJSON_EXPAND(TFJSON_FOR_EACH_25(m, t, __VA_ARGS__))
+#define TFJSON_FOR_EACH_27(m, t, x, ...) m(t, x) TFJSON_EXPAND(TFJSON_FOR_EACH_26(m, t, __VA_ARGS__))
+#define TFJSON_FOR_EACH_28(m, t, x, ...) m(t, x) TFJSON_EXPAND(TFJSON_FOR_EACH_27(m, t, __VA_ARGS__))
+#define TFJSON_FOR_EACH_29(m, t, x, ...) m(t, x) TFJSON_EXPAND(TFJSON_FOR_EACH_28(m, t, __VA_ARGS__))
+#define TFJSON_FOR_EACH_30(m, t, x, ...) m(t, x) TFJSON_EXPAND(TFJSON_FOR_EACH_29(m, t, __VA_ARGS__))
+#define TFJSON_FOR_EACH_31(m, t, x, ...) m(t, x) TFJSON_EXPAND(TFJSON_FOR_EACH_30(m, t, __VA_ARGS__))
+#define TFJSON_FOR_EACH_32(m, t, x, ...) m(t, x) TFJSON_EXPAND(TFJSON_FOR_EACH_31(m, t, __VA_ARGS__))
+#define TFJSON_FOR_EACH_SELECT(_1, _2, _3, _4, _5, _6, _7, _8, _9, _10, _11, _12, _13, _14, _15, _16, _17, _18, _19, _20, _21, _22, _23, _24, _25, _26, _27, _28, _29, _30, _31, _32, name, ...) name
+#define TFJSON_FOR_EACH(m, t, ...) TFJSON_EXPAND(TFJSON_FOR_EACH_SELECT(__VA_ARGS__, TFJSON_FOR_EACH_32, TFJSON_FOR_EACH_31, TFJSON_FOR_EACH_30, TFJSON_FOR_EACH_29, TFJSON_FOR_EACH_28, TFJSON_FOR_EACH_27, TFJSON_FOR_EACH_26, TFJSON_FOR_EACH_25, TFJSON_FOR_EACH_24, TFJSON_FOR_EACH_23, TFJSON_FOR_EACH_22, TFJSON_FOR_EACH_21, TFJSON_FOR_EACH_20, TFJSON_FOR_EACH_19, TFJSON_FOR_EACH_18, TFJSON_FOR_EACH_17, TFJSON_FOR_EACH_16, TFJSON_FOR_EACH_15, TFJSON_FOR_EACH_14, TFJSON_FOR_EACH_13, TFJSON_FOR_EACH_12, TFJSON_FOR_EACH_11, TFJSON_FOR_EACH_10, TFJSON_FOR_EACH_9, TFJSON_FOR_EACH_8, TFJSON_FOR_EACH_7, TFJSON_FOR_EACH_6, TFJSON_FOR_EACH_5, TFJSON_FOR_EACH_4, TFJSON_FOR_EACH_3, TFJSON_FOR_EACH_2, TFJSON_FOR_EACH_1)(m, t, __VA_ARGS__))
+
+#define TFJSON_FIELD_ADD_MEMBER(type, field) TFJsonField<decltype(type::field)>::addMember(json, TFJSON_KEY(#field), value.field);
+#define TFJSON_FIELD_MAX_LEN(type, field) tfjson_add_len(sizeof("\"" #field "\":") - 1 + 1, TFJsonField<decltype(type::field)>::max_len),
+
+// Describes the fields of a struct for TFJsonSerializer::addFields and TFJsonSerializer::addMemberFields.
+// This generates the serializer code for the struct at compile time with pre-escaped keys and the matching addMember* overloads.
+// TFJsonFields<Type>::max_len is an upper bound of the serialized length (without null terminator)
+// or TFJSON_LEN_UNBOUNDED if the struct contains const char * fields. Use at global scope:
+//     struct Meter { float voltage; float current; uint32_t energy; };
+//     TFJSON_FIELDS(Meter, voltage, current, energy);
+#define TFJSON_FIELDS(Type, ...) \
+    template<> \
+    struct TFJsonFields<Type> { \
+        static void serialize(TFJsonSerializer &json, const Type &value) { \
+            TFJSON_FOR_EACH(TFJSON_FIELD_ADD_MEMBER, Type, __VA_ARGS__) \
+        } \
+        /* { and } minus the comma counted for the last field */ \
+        static constexpr size_t max_len = tfjson_sum_len(TFJSON_FOR_EACH(TFJSON_FIELD_MAX_LEN, Type, __VA_ARGS__) 1); \
+    }
 
-    this->writePlainF("%" PRIu64, u);
+template<typename T>
+void TFJsonSerializer::addFields(const T &value) {
+    this->addObject();
+    TFJsonFields<T>::serialize(*this, value);
+    this->endObject();
+}
 
-    if (enquote)
-        this->writePlain('"');
+template<typename T>
+void TFJsonSerializer::addMemberFields(TFJsonKey key, const T &value) {
+    this->addMemberObject(key);
+    TFJsonFields<T>::serialize(*this, value);
+    this->endObject();
 }
 
-void TFJsonSerializer::addNumber(int64_t i) {
-    if (!in_empty_container)
-        this->writePlain(',');
+// Compile-time checked nesting on top of TFJsonSerializer: The builder types encode the currently open containers,
+// e.g. TFJsonObjectBuilder<TFJsonArrayBuilder<TFJsonDoneBuilder>> is an object in a top level array. Only calls valid in the current
+// container exist, so adding a value without key to an object or closing the wrong container does not compile. TFJsonDoneBuilder::end()
+// only exists once all containers are closed. All builders only hold a reference to the serializer and compile to the plain serializer calls.
+//     TFJsonRootBuilder(json).addObject()
+//         .addMemberNumber(TFJSON_KEY("voltage"), voltage)
+//         .addMemberArray(TFJSON_KEY("history")).addNumberArray(history, count).endArray()
+//     .endObject().end();
+// Opening and closing containers consumes the builder and returns a new one. Builders can't be copied and transitions only work on
+// temporaries, so a named builder has to be moved explicitly: auto arr = std::move(obj).addMemberArray("x"); ...; auto obj2 = std::move(arr).endArray();
+// Continuing to use a moved-from builder (e.g. to skip endArray) still compiles, but is a use-after-move that e.g. clang-tidy reports.
+// A TFJsonRootBuilder adds exactly one top level value and has to be constructed before anything else is added.
+
+template<typename Parent>
+struct TFJsonObjectBuilder;
+
+template<typename Parent>
+struct TFJsonArrayBuilder;
+
+// Adding a value keeps the builder: A named builder returns itself, a temporary stays a temporary to continue the chain.
+#define TFJSON_BUILDER_ADD(Builder, name, params, ...) \
+    Builder &name params & { json.__VA_ARGS__; return *this; } \
+    Builder &&name params && { json.__VA_ARGS__; return std::move(*this); }
+
+#define TFJSON_BUILDER_ADD_TEMPLATE(Builder, name, params, ...) \
+    template<typename T> Builder &name params & { json.__VA_ARGS__; return *this; } \
+    template<typename T> Builder &&name params && { json.__VA_ARGS__; return std::move(*this); }
+
+struct TFJsonDoneBuilder {
+    TFJsonSerializer &json;
+
+    explicit TFJsonDoneBuilder(TFJsonSerializer &json) : json(json) {}
+    TFJsonDoneBuilder(const TFJsonDoneBuilder&) = delete;
+    TFJsonDoneBuilder(TFJsonDoneBuilder&&) = default;
+
+    size_t end() && { return json.end(); }
+};
 
-    in_empty_container = false;
+template<typename Parent>
+struct TFJsonObjectBuilder {
+    TFJsonSerializer &json;
+
+    explicit TFJsonObjectBuilder(TFJsonSerializer &json) : json(json) {}
+    TFJsonObjectBuilder(const TFJsonObjectBuilder&) = delete;
+    TFJsonObjectBuilder(TFJsonObjectBuilder&&) = default;
+
+    TFJSON_BUILDER_ADD_TEMPLATE(TFJsonObjectBuilder, addMemberNumber, (TFJsonKey key, T value), addMemberNumber(key, value))
+    TFJSON_BUILDER_ADD(TFJsonObjectBuilder, addMemberBoolean, (TFJsonKey key, bool b), addMemberBoolean(key, b))
+    TFJSON_BUILDER_ADD(TFJsonObjectBuilder, addMemberNull, (TFJsonKey key), addMemberNull(key))
+    TFJSON_BUILDER_ADD(TFJsonObjectBuilder, addMemberString, (TFJsonKey key, const char *c), addMemberString(key, c))
+    TFJSON_BUILDER_ADD_TEMPLATE(TFJsonObjectBuilder, addMemberNumberArray, (TFJsonKey key, const T *values, size_t count), addMemberNumberArray(key, values, count))
+    TFJSON_BUILDER_ADD(TFJsonObjectBuilder, addMemberStringArray, (TFJsonKey key, const char *const *c, size_t count), addMemberStringArray(key, c, count))
+    TFJSON_BUILDER_ADD(TFJsonObjectBuilder, addMemberBase64, (TFJsonKey key, const uint8_t *data, size_t len), addMemberBase64(key, data, len))
+    TFJSON_BUILDER_ADD(TFJsonObjectBuilder, addMemberHex, (TFJsonKey key, const uint8_t *data, size_t len), addMemberHex(key, data, len))
+    TFJSON_BUILDER_ADD(TFJsonObjectBuilder, addMemberRaw, (TFJsonKey key, const char *c, size_t len = TFJSON_USE_STRLEN), addMemberRaw(key, c, len))
+    TFJSON_BUILDER_ADD_TEMPLATE(TFJsonObjectBuilder, addMemberFields, (TFJsonKey key, const T &value), addMemberFields(key, value))
+
+    [[gnu::format(__printf__, 3, 4)]] TFJsonObjectBuilder &addMemberStringF(TFJsonKey key, const char *fmt, ...) & {
+        va_list args;
+        va_start(args, fmt);
+        json.addMemberStringVF(key, fmt, args);
+        va_end(args);
+        return *this;
+    }
 
-    this->writePlainF("%" PRIi64, i);
-}
+    [[gnu::format(__printf__, 3, 4)]] TFJsonObjectBuilder &&addMemberStringF(TFJsonKey key, const char *fmt, ...) && {
+        va_list args;
+        va_start(args, fmt);
+        json.addMemberStringVF(key, fmt, args);
+        va_end(args);
+        return std::move(*this);
+    }
 
-void TFJsonSerializer::addNumber(uint32_t u) {
-    if (!in_empty_container)
-        this->writePlain(',');
+    [[gnu::warn_unused_result]] TFJsonObjectBuilder<TFJsonObjectBuilder> addMemberObject(TFJsonKey key) && { json.addMemberObject(key); return TFJsonObjectBuilder<TFJsonObjectBuilder>(json); }
+    [[gnu::warn_unused_result]] TFJsonArrayBuilder<TFJsonObjectBuilder> addMemberArray(TFJsonKey key) && { json.addMemberArray(key); return TFJsonArrayBuilder<TFJsonObjectBuilder>(json); }
+    [[gnu::warn_unused_result]] Parent endObject() && { json.endObject(); return Parent(json); }
+};
 
-    in_empty_container = false;
+template<typename Parent>
+struct TFJsonArrayBuilder {
+    TFJsonSerializer &json;
+
+    explicit TFJsonArrayBuilder(TFJsonSerializer &json) : json(json) {}
+    TFJsonArrayBuilder(const TFJsonArrayBuilder&) = delete;
+    TFJsonArrayBuilder(TFJsonArrayBuilder&&) = default;
+
+    TFJSON_BUILDER_ADD_TEMPLATE(TFJsonArrayBuilder, addNumber, (T value), addNumber(value))
+    TFJSON_BUILDER_ADD(TFJsonArrayBuilder, addBoolean, (bool b), addBoolean(b))
+    TFJSON_BUILDER_ADD(TFJsonArrayBuilder, addNull, (), addNull())
+    TFJSON_BUILDER_ADD(TFJsonArrayBuilder, addString, (const char *c, size_t len = TFJSON_USE_STRLEN), addString(c, len))
+    TFJSON_BUILDER_ADD_TEMPLATE(TFJsonArrayBuilder, addNumberArray, (const T *values, size_t count), addNumberArray(values, count))
+    TFJSON_BUILDER_ADD(TFJsonArrayBuilder, addStringArray, (const char *const *c, size_t count), addStringArray(c, count))
+    TFJSON_BUILDER_ADD(TFJsonArrayBuilder, addBase64, (const uint8_t *data, size_t len), addBase64(data, len))
+    TFJSON_BUILDER_ADD(TFJsonArrayBuilder, addHex, (const uint8_t *data, size_t len), addHex(data, len))
+    TFJSON_BUILDER_ADD(TFJsonArrayBuilder, addRaw, (const char *c, size_t len = TFJSON_USE_STRLEN), addRaw(c, len))
+    TFJSON_BUILDER_ADD_TEMPLATE(TFJsonArrayBuilder, addFields, (const T &value), addFields(value))
+
+    [[gnu::format(__printf__, 2, 3)]] TFJsonArrayBuilder &addStringF(const char *fmt, ...) & {
+        va_list args;
+        va_start(args, fmt);
+        json.addStringVF(fmt, args);
+        va_end(args);
+        return *this;
+    }
 
-    this->writePlainF("%" PRIu32, u);
-}
+    [[gnu::format(__printf__, 2, 3)]] TFJsonArrayBuilder &&addStringF(const char *fmt, ...) && {
+        va_list args;
+        va_start(args, fmt);
+        json.addStringVF(fmt, args);
+        va_end(args);
+        return std::move(*this);
+    }
 
-void TFJsonSerializer::addNumber(int32_t i) {
-    if (!in_empty_container)
-        this->writePlain(',');
+    [[gnu::warn_unused_result]] TFJsonObjectBuilder<TFJsonArrayBuilder> addObject() && { json.addObject(); return TFJsonObjectBuilder<TFJsonArrayBuilder>(json); }
+    [[gnu::warn_unused_result]] TFJsonArrayBuilder<TFJsonArrayBuilder> addArray() && { json.addArray(); return TFJsonArrayBuilder<TFJsonArrayBuilder>(json); }
+    [[gnu::warn_unused_result]] Parent endArray() && { json.endArray(); return Parent(json); }
+};
 
-    in_empty_container = false;
+#undef TFJSON_BUILDER_ADD
+#undef TFJSON_BUILDER_ADD_TEMPLATE
+
+// Top level: Exactly one value.
+struct TFJsonRootBuilder {
+    TFJsonSerializer &json;
+
+    explicit TFJsonRootBuilder(TFJsonSerializer &json) : json(json) { assert(json.buf_required == 0); }
+    TFJsonRootBuilder(const TFJsonRootBuilder&) = delete;
+    TFJsonRootBuilder(TFJsonRootBuilder&&) = default;
+
+    template<typename T> [[gnu::warn_unused_result]] TFJsonDoneBuilder addNumber(T value) && { json.addNumber(value); return TFJsonDoneBuilder(json); }
+    [[gnu::warn_unused_result]] TFJsonDoneBuilder addBoolean(bool b) && { json.addBoolean(b); return TFJsonDoneBuilder(json); }
+    [[gnu::warn_unused_result]] TFJsonDoneBuilder addNull() && { json.addNull(); return TFJsonDoneBuilder(json); }
+    [[gnu::warn_unused_result]] TFJsonDoneBuilder addString(const char *c, size_t len = TFJSON_USE_STRLEN) && { json.addString(c, len); return TFJsonDoneBuilder(json); }
+    [[gnu::warn_unused_result]] TFJsonDoneBuilder addRaw(const char *c, size_t len = TFJSON_USE_STRLEN) && { json.addRaw(c, len); return TFJsonDoneBuilder(json); }
+    template<typename T> [[gnu::warn_unused_result]] TFJsonDoneBuilder addFields(const T &value) && { json.addFields(value); return TFJsonDoneBuilder(json); }
+
+    [[gnu::format(__printf__, 2, 3)]] [[gnu::warn_unused_result]] TFJsonDoneBuilder addStringF(const char *fmt, ...) && {
+        va_list args;
+        va_start(args, fmt);
+        json.addStringVF(fmt, args);
+        va_end(args);
+        return TFJsonDoneBuilder(json);
+    }
 
-    this->writePlainF("%" PRIi32, i);
-}
+    [[gnu::warn_unused_result]] TFJsonObjectBuilder<TFJsonDoneBuilder> addObject() && { json.addObject(); return TFJsonObjectBuilder<TFJsonDoneBuilder>(json); }
+    [[gnu::warn_unused_result]] TFJsonArrayBuilder<TFJsonDoneBuilder> addArray() && { json.addArray(); return TFJsonArrayBuilder<TFJsonDoneBuilder>(json); }
+};
+
+#if 0
+#include <stdio.h>
+#define TFJSON_DEBUGF(...) printf("TFJsonParser: " __VA_ARGS__)
+#else
+#define TFJSON_DEBUGF(...) (void)0
+#endif
+
+inline bool tfjson_is_control(char c) {
+    // JSON allows 0x7F unescaped
+#if CHAR_MIN == 0
+    return c <= 0x1F;
+#else
+    return c <= 0x1F && c >= 0; // UTF-8 compatibility
+#endif
+}
+
+inline bool tfjson_is_whitespace(char c) {
+    return c == ' ' || c == '\n' || c == '\r' || c == '\t';
+}
+
+// Converts the valid JSON number from c up to c + len to the nearest double. Doesn't need a null terminator and doesn't depend
+// on the locale. Returns false if the number is out of range, like strtod reporting ERANGE: result is then infinity or a
+// subnormal number or zero.
+bool tfjson_parse_double(const char *c, size_t len, double *result);
+
+// Set in the index entries of closing quotes of strings that contain backslashes or control chars.
+#define TFJSON_INDEX_ESCAPED 0x80000000u
+
+// Writes the positions of all structural chars {}[]:, of all value starts outside of strings and of all closing quotes in buf
+// to index in ascending order. Returns the number of entries or SIZE_MAX if there are more than index_max.
+// len has to be less than TFJSON_INDEX_ESCAPED.
+size_t tfjson_index_structurals(const char *buf, size_t len, uint32_t *index, size_t index_max);
+
+// Appends the decimal digits from c up to end to value. Returns false if the result doesn't fit into 64 bits.
+inline bool tfjson_accumulate_digits(const char *c, const char *end, uint64_t *value) {
+    uint64_t result = *value;
+
+    for (; c < end; ++c) {
+        if (__builtin_mul_overflow(result, 10u, &result) || __builtin_add_overflow(result, (uint64_t)(*c - '0'), &result)) {
+            return false;
+        }
+    }
+
+    *value = result;
+
+    return true;
+}
+
+/*
+    All code points may
+    be placed within the quotation marks except for the code points that must be escaped: quotation mark
+    (U+0022), reverse solidus (U+005C), and the control characters U+0000 to U+001F.
+*/
+inline bool tfjson_needs_escape(char c) {
+    return c == '"' || c == '\\' || (uint8_t)c < 0x20;
+}
+
+// Returns a pointer to the first char in [c, end) that has to be escaped or end.
+inline const char *tfjson_find_escape(const char *c, const char *end) {
+#if defined(__SSE2__)
+    const __m128i quote = _mm_set1_epi8('"');
+    const __m128i backslash = _mm_set1_epi8('\\');
+    const __m128i control_max = _mm_set1_epi8(0x1F);
+
+    while (end - c >= 16) {
+        __m128i x = _mm_loadu_si128((const __m128i *)c);
+        // x <= 0x1F (unsigned) if max(x, 0x1F) == 0x1F
+        __m128i hits = _mm_or_si128(_mm_or_si128(_mm_cmpeq_epi8(x, quote), _mm_cmpeq_epi8(x, backslash)),
+                                    _mm_cmpeq_epi8(_mm_max_epu8(x, control_max), control_max));
+        int mask = _mm_movemask_epi8(hits);
+
+        if (mask != 0)
+            return c + __builtin_ctz((unsigned)mask);
+
+        c += 16;
+    }
+#elif defined(__ARM_NEON) && defined(__aarch64__)
+    const uint8x16_t quote = vdupq_n_u8('"');
+    const uint8x16_t backslash = vdupq_n_u8('\\');
+    const uint8x16_t control_end = vdupq_n_u8(0x20);
+
+    while (end - c >= 16) {
+        uint8x16_t x = vld1q_u8((const uint8_t *)c);
+        uint8x16_t hits = vorrq_u8(vorrq_u8(vceqq_u8(x, quote), vceqq_u8(x, backslash)), vcltq_u8(x, control_end));
+
+        if (vmaxvq_u8(hits) != 0)
+            break; // the scalar loop below finds the exact position
+
+        c += 16;
+    }
+#else
+    // SWAR: test a machine word at a time. A byte of x is zero if (x - 0x01..) & ~x & 0x80.. has its top bit set.
+    // This can report false positives only above a real hit, so a non-zero result is resolved by the scalar loop below.
+    const size_t ones = (size_t)-1 / 0xFF;
+    const size_t highs = ones * 0x80;
+
+    while ((size_t)(end - c) >= sizeof(size_t)) {
+        size_t x;
+        memcpy(&x, c, sizeof(x));
+
+        size_t q = x ^ (ones * '"');
+        size_t b = x ^ (ones * '\\');
+        size_t hits = ((q - ones) & ~q) | ((b - ones) & ~b) | ((x - ones * 0x20) & ~x);
+
+        if ((hits & highs) != 0)
+            break;
+
+        c += sizeof(size_t);
+    }
+#endif
+
+    while (c != end && !tfjson_needs_escape(*c))
+        ++c;
+
+    return c;
+}
+
+inline int tfjson_hex_value(char c) {
+    if (c >= '0' && c <= '9') {
+        return c - '0';
+    }
+
+    if (c >= 'a' && c <= 'f') {
+        return c - 'a' + 10;
+    }
+
+    if (c >= 'A' && c <= 'F') {
+        return c - 'A' + 10;
+    }
+
+    return -1;
+}
+
+// Writes code_point as UTF-8 to out. Returns the char after it or nullptr if code_point is out of range.
+inline char *tfjson_encode_utf8(uint32_t code_point, char *out) {
+    if (code_point <= 0x7F) {
+        *out++ = (char)code_point;
+    }
+    else if (code_point <= 0x07FF) {
+        *out++ = (char)(((code_point >> 6) & 0x1F) | 0xC0);
+        *out++ = (char)(((code_point >> 0) & 0x3F) | 0x80);
+    }
+    else if (code_point <= 0xFFFF) {
+        *out++ = (char)(((code_point >> 12) & 0x0F) | 0xE0);
+        *out++ = (char)(((code_point >>  6) & 0x3F) | 0x80);
+        *out++ = (char)(((code_point >>  0) & 0x3F) | 0x80);
+    }
+    else if (code_point <= 0x10FFFF) {
+        *out++ = (char)(((code_point >> 18) & 0x07) | 0xF0);
+        *out++ = (char)(((code_point >> 12) & 0x3F) | 0x80);
+        *out++ = (char)(((code_point >>  6) & 0x3F) | 0x80);
+        *out++ = (char)(((code_point >>  0) & 0x3F) | 0x80);
+    }
+    else {
+        return nullptr;
+    }
+
+    return out;
+}
+
+// Unescapes the escape sequence at c to *out, which may point into the same buffer up to c. Returns the char after
+// the sequence or nullptr if it is invalid, not completely before end or an escaped null char that is not allowed.
+inline const char *tfjson_unescape(const char *c, const char *end, bool allow_null, char **out) {
+    if (end - c < 2) {
+        return nullptr;
+    }
+
+    char unescaped;
+
+    switch (c[1]) {
+        case '"':  unescaped = '"';  break;
+        case '\\': unescaped = '\\'; break;
+        case '/':  unescaped = '/';  break;
+        case 'b':  unescaped = '\b'; break;
+        case 'f':  unescaped = '\f'; break;
+        case 'n':  unescaped = '\n'; break;
+        case 'r':  unescaped = '\r'; break;
+        case 't':  unescaped = '\t'; break;
+
+        case 'u': {
+            if (end - c < 6) {
+                return nullptr;
+            }
+
+            uint32_t code_point = 0;
+
+            for (int i = 2; i < 6; ++i) {
+                int value = tfjson_hex_value(c[i]);
+
+                if (value < 0) {
+                    return nullptr;
+                }
+
+                code_point = (code_point << 4) | (uint32_t)value;
+            }
+
+            if (!allow_null && code_point == 0) {
+                return nullptr;
+            }
+
+            *out = tfjson_encode_utf8(code_point, *out);
+
+            return c + 6;
+        }
+
+        default:
+            return nullptr;
+    }
+
+    *(*out)++ = unescaped;
+
+    return c + 2;
+}
+
+inline const char *tfjson_skip_ascii(const char *c, const char *end) {
+#if defined(__SSE2__)
+    while (end - c >= 16) {
+        int mask = _mm_movemask_epi8(_mm_loadu_si128((const __m128i *)c));
+
+        if (mask != 0) {
+            return c + __builtin_ctz(mask);
+        }
+
+        c += 16;
+    }
+#elif defined(__ARM_NEON) && defined(__aarch64__)
+    while (end - c >= 16 && vmaxvq_u8(vld1q_u8((const uint8_t *)c)) < 0x80) {
+        c += 16;
+    }
+#else
+    while (end - c >= 8) {
+        uint64_t word;
+
+        memcpy(&word, c, sizeof(word));
+
+        if ((word & 0x8080808080808080ull) != 0) {
+            break;
+        }
+
+        c += 8;
+    }
+#endif
+
+    while (c < end && (uint8_t)*c < 0x80) {
+        ++c;
+    }
+
+    return c;
+}
+
+// Multibyte sequence that continues after the validated chars.
+struct TFJsonUTF8State {
+    uint8_t pending = 0; // continuation bytes still missing
+    uint8_t min = 0x80;  // range of the next continuation byte, narrower after some start bytes
+    uint8_t max = 0xBF;  // to reject overlong sequences, surrogates and code points > U+10FFFF
+};
+
+// Start of the sequence that ends at or continues past c, searching back to begin at most. begin has to be a sequence boundary.
+inline const char *tfjson_utf8_sequence_start(const char *begin, const char *c) {
+    for (int i = 1; i <= 3 && c - i >= begin; ++i) {
+        uint8_t u = (uint8_t)c[-i];
+
+        if (u < 0x80) {
+            break;
+        }
+
+        if (u >= 0xC0) {
+            int len = u >= 0xF0 ? 4 : (u >= 0xE0 ? 3 : 2);
+
+            return len > i ? c - i : c;
+        }
+    }
+
+    return c;
+}
+
+#if defined(__SSE2__) || (defined(__ARM_NEON) && defined(__aarch64__))
+// Validates 16 bytes per step. Each block is checked together with the last three bytes of the previous one:
+// Continuation bytes have to follow exactly the lead bytes that need them and some lead bytes narrow the range of the next byte.
+// Returns the start of the first sequence that still has to be checked by the caller: At the end or before an invalid block.
+inline const char *tfjson_validate_utf8_blocks(const char *begin, const char *end) {
+    const char *c = begin;
+
+#if defined(__SSE2__)
+    // SSE2 has no unsigned compare: x >= k is max(x, k) == x, x <= k is min(x, k) == x.
+    #define TFJSON_GE(x, k) _mm_cmpeq_epi8(_mm_max_epu8((x), _mm_set1_epi8((char)(k))), (x))
+    #define TFJSON_LE(x, k) _mm_cmpeq_epi8(_mm_min_epu8((x), _mm_set1_epi8((char)(k))), (x))
+    #define TFJSON_EQ(x, k) _mm_cmpeq_epi8((x), _mm_set1_epi8((char)(k)))
+
+    __m128i prev = _mm_setzero_si128();
+
+    while (end - c >= 16) {
+        __m128i v = _mm_loadu_si128((const __m128i *)c);
+
+        if (_mm_movemask_epi8(_mm_or_si128(v, prev)) == 0) {
+            prev = v;
+            c += 16;
+            continue;
+        }
+
+        __m128i prev1 = _mm_or_si128(_mm_slli_si128(v, 1), _mm_srli_si128(prev, 15));
+        __m128i prev2 = _mm_or_si128(_mm_slli_si128(v, 2), _mm_srli_si128(prev, 14));
+        __m128i prev3 = _mm_or_si128(_mm_slli_si128(v, 3), _mm_srli_si128(prev, 13));
+
+        __m128i is_cont = _mm_and_si128(TFJSON_GE(v, 0x80), TFJSON_LE(v, 0xBF));
+        __m128i want_cont = _mm_or_si128(_mm_or_si128(TFJSON_GE(prev1, 0xC0), TFJSON_GE(prev2, 0xE0)), TFJSON_GE(prev3, 0xF0));
+        __m128i error = _mm_xor_si128(is_cont, want_cont);
+
+        error = _mm_or_si128(error, _mm_or_si128(TFJSON_EQ(v, 0xC0), TFJSON_EQ(v, 0xC1)));
+        error = _mm_or_si128(error, TFJSON_GE(v, 0xF5));
+        error = _mm_or_si128(error, _mm_and_si128(TFJSON_EQ(prev1, 0xE0), TFJSON_LE(v, 0x9F)));
+        error = _mm_or_si128(error, _mm_and_si128(TFJSON_EQ(prev1, 0xED), TFJSON_GE(v, 0xA0)));
+        error = _mm_or_si128(error, _mm_and_si128(TFJSON_EQ(prev1, 0xF0), TFJSON_LE(v, 0x8F)));
+        error = _mm_or_si128(error, _mm_and_si128(TFJSON_EQ(prev1, 0xF4), TFJSON_GE(v, 0x90)));
+
+        if (_mm_movemask_epi8(error) != 0) {
+            break;
+        }
+
+        prev = v;
+        c += 16;
+    }
+
+    #undef TFJSON_GE
+    #undef TFJSON_LE
+    #undef TFJSON_EQ
+#else
+    uint8x16_t prev = vdupq_n_u8(0);
+
+    while (end - c >= 16) {
+        uint8x16_t v = vld1q_u8((const uint8_t *)c);
+
+        if (vmaxvq_u8(vorrq_u8(v, prev)) < 0x80) {
+            prev = v;
+            c += 16;
+            continue;
+        }
+
+        uint8x16_t prev1 = vextq_u8(prev, v, 15);
+        uint8x16_t prev2 = vextq_u8(prev, v, 14);
+        uint8x16_t prev3 = vextq_u8(prev, v, 13);
+
+        uint8x16_t is_cont = vandq_u8(vcgeq_u8(v, vdupq_n_u8(0x80)), vcleq_u8(v, vdupq_n_u8(0xBF)));
+        uint8x16_t want_cont = vorrq_u8(vorrq_u8(vcgeq_u8(prev1, vdupq_n_u8(0xC0)), vcgeq_u8(prev2, vdupq_n_u8(0xE0))), vcgeq_u8(prev3, vdupq_n_u8(0xF0)));
+        uint8x16_t error = veorq_u8(is_cont, want_cont);
+
+        error = vorrq_u8(error, vorrq_u8(vceqq_u8(v, vdupq_n_u8(0xC0)), vceqq_u8(v, vdupq_n_u8(0xC1))));
+        error = vorrq_u8(error, vcgeq_u8(v, vdupq_n_u8(0xF5)));
+        error = vorrq_u8(error, vandq_u8(vceqq_u8(prev1, vdupq_n_u8(0xE0)), vcleq_u8(v, vdupq_n_u8(0x9F))));
+        error = vorrq_u8(error, vandq_u8(vceqq_u8(prev1, vdupq_n_u8(0xED)), vcgeq_u8(v, vdupq_n_u8(0xA0))));
+        error = vorrq_u8(error, vandq_u8(vceqq_u8(prev1, vdupq_n_u8(0xF0)), vcleq_u8(v, vdupq_n_u8(0x8F))));
+        error = vorrq_u8(error, vandq_u8(vceqq_u8(prev1, vdupq_n_u8(0xF4)), vcgeq_u8(v, vdupq_n_u8(0x90))));
+
+        if (vmaxvq_u8(error) != 0) {
+            break;
+        }
+
+        prev = v;
+        c += 16;
+    }
+#endif
+
+    // Sequences at the end of the last valid block are not complete yet or were only checked partially.
+    return tfjson_utf8_sequence_start(begin, c);
+}
+#endif
+
+// Validates UTF-8 from c up to end, continuing a sequence from the previous call. Returns the first invalid byte or end.
+// For an invalid byte, invalid_start_byte tells whether it can't start a sequence or doesn't continue the pending one.
+inline const char *tfjson_validate_utf8(const char *c, const char *end, TFJsonUTF8State *state, bool *invalid_start_byte) {
+    uint8_t pending = state->pending;
+    uint8_t min = state->min;
+    uint8_t max = state->max;
+
+    while (c < end) {
+        uint8_t u = (uint8_t)*c;
+
+        if (pending > 0) {
+            if (u < min || u > max) {
+                *invalid_start_byte = false;
+                return c;
+            }
+
+            --pending;
+            min = 0x80;
+            max = 0xBF;
+            ++c;
+            continue;
+        }
+
+#if defined(__SSE2__) || (defined(__ARM_NEON) && defined(__aarch64__))
+        if (end - c >= 32) {
+            const char *checked_end = tfjson_validate_utf8_blocks(c, end);
+
+            if (checked_end != c) {
+                c = checked_end;
+                continue;
+            }
+        }
+#endif
+
+        if (u < 0x80) {
+            c = tfjson_skip_ascii(c + 1, end);
+            continue;
+        }
+
+        if (u >= 0xC2 && u <= 0xDF) {
+            pending = 1;
+        }
+        else if (u >= 0xE0 && u <= 0xEF) {
+            pending = 2;
+            min = u == 0xE0 ? 0xA0 : 0x80;
+            max = u == 0xED ? 0x9F : 0xBF;
+        }
+        else if (u >= 0xF0 && u <= 0xF4) {
+            pending = 3;
+            min = u == 0xF0 ? 0x90 : 0x80;
+            max = u == 0xF4 ? 0x8F : 0xBF;
+        }
+        else {
+            *invalid_start_byte = true;
+            return c;
+        }
+
+        ++c;
+
+        // Check complete sequences at once instead of byte by byte.
+        if (end - c < pending) {
+            continue;
+        }
+
+        if ((uint8_t)c[0] < min || (uint8_t)c[0] > max) {
+            *invalid_start_byte = false;
+            return c;
+        }
+
+        for (uint8_t i = 1; i < pending; ++i) {
+            if (((uint8_t)c[i] & 0xC0) != 0x80) {
+                *invalid_start_byte = false;
+                return c + i;
+            }
+        }
+
+        c += pending;
+        pending = 0;
+        min = 0x80;
+        max = 0xBF;
+    }
+
+    state->pending = pending;
+    state->min = min;
+    state->max = max;
+
+    return end;
+}
+
+struct TFJsonParserBase {
+    enum class Error {
+        Aborted,
+        ExpectingEndOfInput,
+        ExpectingValue,
+        ExpectingOpeningCurlyBracket,
+        ExpectingClosingCurlyBracket,
+        ExpectingColon,
+        ExpectingOpeningSquareBracket,
+        ExpectingClosingSquareBracket,
+        ExpectingOpeningQuote,
+        ExpectingClosingQuote,
+        ExpectingNumber,
+        ExpectingFractionDigits,
+        ExpectingExponentDigits,
+        ExpectingNull,
+        ExpectingTrue,
+        ExpectingFalse,
+        InvalidEscapeSequence,
+        UnescapedControlCharacter,
+        ForbiddenNullInString,
+        NestingTooDeep,
+        InlineNullByte,
+        InvalidUTF8StartByte,
+        InvalidUTF8ContinuationByte,
+        BufferTooShort,
+        OutOfMemory,
+        ElementTooLong,
+        RefillFailure,
+    };
+
+    enum class FeedResult {
+        NeedMoreData,
+        Done,
+        Error,
+    };
+
+    static const char *getErrorName(Error error);
+};
+
+// Number of uint32_t in a nesting stack for nesting_depth_max levels, see TFJsonParser.
+#define TFJSON_NESTING_STACK_LEN(nesting_depth_max) ((nesting_depth_max) / 32 + 1)
+
+// Detects whether Derived implements the handler on<Name> and calls it. Missing handlers are replaced by returning the fallback.
+// wants<Name>() can be hidden by Derived to decide at runtime whether a handler is present.
+#define TFJSON_PARSER_HANDLER(Result, Fallback, Name, ...) \
+    template<typename T> static auto detect##Name(int) -> decltype(std::declval<T &>().on##Name(__VA_ARGS__), std::true_type()); \
+    template<typename T> static std::false_type detect##Name(...); \
+    constexpr bool wants##Name() const { return decltype(detect##Name<Derived>(0))::value; } \
+    template<typename... Args> Result call##Name(Args... args) { return this->dispatch##Name(decltype(detect##Name<Derived>(0))(), args...); } \
+    template<typename... Args> Result dispatch##Name(std::true_type, Args... args) { return this->derived().on##Name(args...); } \
+    template<typename... Args> Result dispatch##Name(std::false_type, Args...) { return Fallback; }
+
+// Parser with static handler dispatch: Derive YourType from TFJsonParser<YourType> and implement the handlers you need as member functions:
+//     void onError(Error error, char *buf, size_t len)
+//     ssize_t onRefill(char *buf, size_t len)
+//     bool onBegin(), onEnd(), onObjectBegin(), onObjectEnd(), onArrayBegin(), onArrayEnd(), onNull()
+//     bool onMember(char *c, size_t len), onString(char *c, size_t len), onNumber(char *c, size_t len)
+//     bool onDouble(double d), onInt64(int64_t i), onUInt64(uint64_t u), onBoolean(bool b)
+// Handlers are detected at compile time and can be inlined. Work for missing handlers, e.g. converting numbers, is compiled out.
+// They have to be public or TFJsonParser<YourType> has to be a friend. Return false from a handler to abort with Error::Aborted.
+// TFJsonDeserializer is a TFJsonParser with std::function handlers that can be set at runtime.
+// Containers are parsed without recursion, the stack use doesn't depend on the nesting depth.
+template<typename Derived>
+struct TFJsonParser : TFJsonParserBase {
+    const size_t nesting_depth_max;
+    const size_t malloc_size_max;
+    const bool allow_null_in_string;
+    size_t nesting_depth;
+    uint32_t *nesting_stack;  // one bit per nesting level, set for objects and cleared for arrays
+    size_t nesting_stack_len; // in uint32_t
+    bool nesting_stack_owned;
+    uint32_t nesting_stack_inline[2];
+    TFJsonUTF8State utf8_state; // at idx_nul
+    ssize_t idx_utf8_invalid;   // first invalid UTF-8 byte, reported when reached
+    bool utf8_invalid_start_byte;
+    char *buf;
+    size_t buf_len;
+    ssize_t idx_nul;  // (virtual) nul-terminator
+    ssize_t idx_cur;  // current character
+    ssize_t idx_okay; // no parsing error until here [inclusive]
+    ssize_t idx_done; // data is not needed anymore until here [inclusive]
+    char cur;
+    bool in_memory;             // the whole input is in buf, don't refill
+    const uint32_t *index_next; // next entry of the structural index after idx_cur, see parseIndexed
+    bool feeding;               // the input is passed to feed(), see beginFeed
+    bool feed_finished;         // finish() was called, there is no more input
+    bool feed_suspended;        // parsing stopped to wait for the next feed() call
+    size_t leaf_scan_len;       // chars of the leaf value at idx_cur that isLeafLoaded() already checked
+    FeedResult feed_result;
+
+    // Where parseValue() continues: First move on from the current char, then parse according to the state.
+    enum class WalkMove : uint8_t {
+        None,
+        Next,           // next() and skipWhitespace()
+        SkipWhitespace, // skipWhitespace() only
+    };
+
+    enum class WalkState : uint8_t {
+        Value,      // at the first char of a value
+        Member,     // at the opening quote of a member name
+        Colon,      // at the colon after a member name
+        Opened,     // after the opening bracket of a container
+        AfterValue, // after a value, at a comma, a closing bracket or the end of the input
+    };
+
+    WalkMove walk_move;
+    WalkState walk_state;
+
+    // The kind of each open container is kept as one bit per nesting level in nesting_stack. It has to hold
+    // TFJSON_NESTING_STACK_LEN(nesting_depth_max) uint32_t. Without it, the parser has room for 64 levels and allocates
+    // room for deeper documents up to nesting_depth_max. This is not limited by malloc_size_max.
+    TFJsonParser(size_t nesting_depth_max, size_t malloc_size_max, bool allow_null_in_string = true, uint32_t *nesting_stack = nullptr) :
+        nesting_depth_max(nesting_depth_max),
+        malloc_size_max(malloc_size_max),
+        allow_null_in_string(allow_null_in_string),
+        nesting_stack(nesting_stack != nullptr ? nesting_stack : nesting_stack_inline),
+        nesting_stack_len(nesting_stack != nullptr ? TFJSON_NESTING_STACK_LEN(nesting_depth_max) : sizeof(nesting_stack_inline) / sizeof(uint32_t)),
+        nesting_stack_owned(false) {
+    }
+
+    ~TFJsonParser() {
+        if (nesting_stack_owned) {
+            free(nesting_stack);
+        }
+    }
+
+    // Disallow copying the parser, because why would you?
+    TFJsonParser(const TFJsonParser&) = delete;
+    TFJsonParser &operator=(const TFJsonParser&) = delete;
+
+    bool parse(char *buf, size_t len = TFJSON_USE_STRLEN);
+
+    // Alternative to parse() for large documents that are completely in buf, which ignores the refill handler and reports
+    // the same events and errors. A first pass indexes the positions of all structural chars, value starts and string ends
+    // 64 bytes at a time. The second pass jumps from one to the next instead of visiting whitespace char by char and takes
+    // strings without escape sequences from the index as they are. This pays off for documents with a lot of whitespace,
+    // e.g. pretty-printed ones. Compact documents with long strings are parsed faster by parse().
+    // The index is allocated with up to four bytes per char of buf, but at most malloc_size_max bytes. If that is not enough
+    // or buf is 2 GiB or longer, the document is parsed as by parse().
+    bool parseIndexed(char *buf, size_t len = TFJSON_USE_STRLEN);
+
+    // Push-style alternative to parse() with a refill handler, for input that arrives in chunks, e.g. in an event loop.
+    // beginFeed() starts a document with buf as working memory. Then pass each chunk to feed() as it arrives and call finish()
+    // at the end of the input. Both parse as far as possible and return instead of waiting for more input. All state is kept
+    // in the parser, parsing continues where it stopped with the next chunk. The chunks are copied to buf, that has to hold
+    // the longest element plus one char, as with a refill handler. The refill handler is not used.
+    // feed() returns FeedResult::NeedMoreData until an error occurs, finish() returns FeedResult::Done or FeedResult::Error.
+    bool beginFeed(char *buf, size_t buf_len);
+    FeedResult feed(const char *chunk, size_t len);
+    FeedResult finish();
+
+private:
+    Derived &derived() { return static_cast<Derived &>(*this); }
+
+    TFJSON_PARSER_HANDLER(void, void(), Error, std::declval<Error>(), std::declval<char *>(), std::declval<size_t>())
+    TFJSON_PARSER_HANDLER(ssize_t, 0, Refill, std::declval<char *>(), std::declval<size_t>())
+    TFJSON_PARSER_HANDLER(bool, true, Begin, )
+    TFJSON_PARSER_HANDLER(bool, true, End, )
+    TFJSON_PARSER_HANDLER(bool, true, ObjectBegin, )
+    TFJSON_PARSER_HANDLER(bool, true, ObjectEnd, )
+    TFJSON_PARSER_HANDLER(bool, true, ArrayBegin, )
+    TFJSON_PARSER_HANDLER(bool, true, ArrayEnd, )
+    TFJSON_PARSER_HANDLER(bool, true, Member, std::declval<char *>(), std::declval<size_t>())
+    TFJSON_PARSER_HANDLER(bool, true, String, std::declval<char *>(), std::declval<size_t>())
+    TFJSON_PARSER_HANDLER(bool, true, Double, std::declval<double>())
+    TFJSON_PARSER_HANDLER(bool, true, Int64, std::declval<int64_t>())
+    TFJSON_PARSER_HANDLER(bool, true, UInt64, std::declval<uint64_t>())
+    TFJSON_PARSER_HANDLER(bool, true, Number, std::declval<char *>(), std::declval<size_t>())
+    TFJSON_PARSER_HANDLER(bool, true, Boolean, std::declval<bool>())
+    TFJSON_PARSER_HANDLER(bool, true, Null, )
+
+    void reset(char *buf, size_t len);
+    bool parseDocument();
+    bool resumeDocument();
+    FeedResult resumeFeed();
+    void reportError(Error error);
+    size_t shift();
+    bool refill(size_t *offset);
+    void validateUTF8(ssize_t idx_begin);
+    bool next(size_t *offset = nullptr);
+    bool land(ssize_t idx);
+    bool nextToken();
+    bool skipToToken();
+    void okay(ssize_t offset = 0);
+    void done();
+    bool enterNesting(bool object);
+    bool growNestingStack();
+    void leaveNesting();
+    bool isInObject();
+    bool isWhitespace();
+    bool isDigit();
+    bool isHexDigit();
+    bool isControl();
+    bool skipWhitespace();
+    void skipLoadedDigits();
+    bool parseValue();
+    bool isLeafLoaded();
+    bool isLiteralLoaded(const char *literal, size_t literal_len);
+    bool parseString(bool report_as_member_name = false);
+    bool parseStringToken(bool report_as_member_name);
+    bool parseNumber();
+    bool parseNull();
+    bool parseTrue();
+    bool parseFalse();
+};
+
+template<typename Derived>
+void TFJsonParser<Derived>::reset(char *buf_, size_t buf_len_) {
+    nesting_depth = 0;
+    utf8_state = TFJsonUTF8State();
+    idx_utf8_invalid = std::numeric_limits<ssize_t>::max();
+    buf = buf_;
+
+    if (buf_len_ == TFJSON_USE_STRLEN) {
+        idx_nul = strlen(buf);
+        buf_len = idx_nul + 1;
+    }
+    else {
+        idx_nul = buf_len_;
+        buf_len = buf_len_;
+    }
+
+    idx_cur = -1;
+    idx_okay = -1;
+    idx_done = -1;
+    cur = '\0';
+    in_memory = false;
+    index_next = nullptr;
+    feeding = false;
+    feed_finished = false;
+    feed_suspended = false;
+    leaf_scan_len = 1;
+    feed_result = FeedResult::NeedMoreData;
+
+    validateUTF8(0);
+}
+
+template<typename Derived>
+bool TFJsonParser<Derived>::parse(char *buf_, size_t buf_len_) {
+    reset(buf_, buf_len_);
+
+    return parseDocument();
+}
+
+template<typename Derived>
+bool TFJsonParser<Derived>::parseIndexed(char *buf_, size_t buf_len_) {
+    reset(buf_, buf_len_);
+
+    in_memory = true;
+
+    // The index has at most one entry per char plus the end of input. tfjson_index_structurals is faster with room for
+    // 64 more entries.
+    size_t index_max = idx_nul + 1 + 64;
+
+    if (index_max > malloc_size_max / sizeof(uint32_t)) {
+        index_max = malloc_size_max / sizeof(uint32_t);
+    }
+
+    uint32_t *index = nullptr;
+
+    if ((size_t)idx_nul < TFJSON_INDEX_ESCAPED && index_max > 1) {
+        index = (uint32_t *)malloc(index_max * sizeof(uint32_t));
+    }
+
+    if (index == nullptr) {
+        return parseDocument();
+    }
+
+    size_t index_len = tfjson_index_structurals(buf, idx_nul, index, index_max - 1);
+
+    if (index_len == SIZE_MAX) {
+        free(index);
+        return parseDocument();
+    }
+
+    index[index_len] = (uint32_t)idx_nul;
+    index_next = index;
+
+    bool result = parseDocument();
+
+    index_next = nullptr;
+    free(index);
+
+    return result;
+}
+
+template<typename Derived>
+bool TFJsonParser<Derived>::beginFeed(char *buf_, size_t buf_len_) {
+    reset(buf_, 0);
+
+    buf_len = buf_len_;
+    feeding = true;
+
+    TFJSON_DEBUGF("beginFeed(%p, %zu)\n", buf, buf_len);
+
+    if (!this->callBegin()) {
+        reportError(Error::Aborted);
+        feed_result = FeedResult::Error;
+        return false;
+    }
+
+    walk_move = WalkMove::Next;
+    walk_state = WalkState::Value;
+
+    return true;
+}
+
+template<typename Derived>
+typename TFJsonParser<Derived>::FeedResult TFJsonParser<Derived>::feed(const char *chunk, size_t len) {
+    if (feed_result != FeedResult::NeedMoreData || feed_finished) {
+        return feed_result;
+    }
+
+    do {
+        shift();
+
+        size_t copy_len = buf_len - idx_nul;
+
+        if (copy_len == 0 && len > 0) {
+            // The buffer is full with the current element, see refill().
+            reportError(Error::ElementTooLong);
+            feed_result = FeedResult::Error;
+            return feed_result;
+        }
+
+        if (copy_len > len) {
+            copy_len = len;
+        }
+
+        TFJSON_DEBUGF("feed() -> \"%.*s\"\n", (int)copy_len, chunk);
+
+        memcpy(buf + idx_nul, chunk, copy_len);
+
+        idx_nul += copy_len;
+        chunk += copy_len;
+        len -= copy_len;
+
+        validateUTF8(idx_nul - copy_len);
+
+        if (resumeFeed() != FeedResult::NeedMoreData) {
+            return feed_result;
+        }
+    } while (len > 0);
+
+    return feed_result;
+}
+
+template<typename Derived>
+typename TFJsonParser<Derived>::FeedResult TFJsonParser<Derived>::finish() {
+    if (feed_result != FeedResult::NeedMoreData || feed_finished) {
+        return feed_result;
+    }
+
+    feed_finished = true;
+
+    return resumeFeed();
+}
+
+template<typename Derived>
+typename TFJsonParser<Derived>::FeedResult TFJsonParser<Derived>::resumeFeed() {
+    feed_suspended = false;
+
+    if (resumeDocument()) {
+        feed_result = FeedResult::Done;
+    }
+    else if (!feed_suspended) {
+        feed_result = FeedResult::Error;
+    }
+
+    return feed_result;
+}
+
+template<typename Derived>
+bool TFJsonParser<Derived>::parseDocument() {
+    TFJSON_DEBUGF("parse(%p, %zu) -> \"%.*s\"\n", buf, buf_len, (int)idx_nul, buf);
+
+    if (!this->callBegin()) {
+        reportError(Error::Aborted);
+        return false;
+    }
+
+    walk_move = WalkMove::Next;
+    walk_state = WalkState::Value;
+
+    return resumeDocument();
+}
+
+template<typename Derived>
+bool TFJsonParser<Derived>::resumeDocument() {
+    if (!parseValue()) {
+        return false;
+    }
+
+    if (idx_done + 1 < idx_nul) {
+        reportError(Error::ExpectingEndOfInput);
+        return false;
+    }
+
+    if (!this->callEnd()) {
+        reportError(Error::Aborted);
+        return false;
+    }
+
+    TFJSON_DEBUGF("parse(...) -> buf_len: %zu, idx_nul: %zd, idx_cur: %zd, idx_okay: %zd, idx_done: %zd\n", buf_len, idx_nul, idx_cur, idx_okay, idx_done);
+
+    return true;
+}
+
+// Parses from walk_state on after finishing walk_move, until the top-level value and the whitespace after it are complete.
+// Instead of recursing into containers, the kind of each open container is kept as one bit per nesting level, so the stack
+// use doesn't depend on the nesting depth. While feeding, every step can be repeated after running out of input.
+template<typename Derived>
+bool TFJsonParser<Derived>::parseValue() {
+    // Walk on copies that can stay in registers. They are stored before each step that can run out of input.
+    WalkMove move = walk_move;
+    WalkState state = walk_state;
+
+    for (;;) {
+        if (move != WalkMove::None) {
+            walk_move = move;
+            walk_state = state;
+
+            // On Next, cur is only whitespace if skipWhitespace() ran out of input before.
+            if (!(move == WalkMove::Next && !isWhitespace() ? nextToken() : skipToToken())) {
+                return false;
+            }
+        }
+
+        move = WalkMove::None;
+
+        switch (state) {
+            case WalkState::Member:
+                if (cur == '"' && feeding && !isLeafLoaded()) {
+                    walk_move = move;
+                    walk_state = state;
+                    return false;
+                }
+
+                if (!parseStringToken(true)) {
+                    return false;
+                }
+
+                move = WalkMove::SkipWhitespace;
+                state = WalkState::Colon;
+                break;
+
+            case WalkState::Colon:
+                if (cur != ':') {
+                    reportError(Error::ExpectingColon);
+                    return false;
+                }
+
+                okay();
+                done();
+
+                move = WalkMove::Next;
+                state = WalkState::Value;
+                break;
+
+            case WalkState::Value:
+                if (cur == '{' || cur == '[') {
+                    bool object = cur == '{';
+
+                    okay();
+                    done();
+
+                    if (!enterNesting(object)) {
+                        return false;
+                    }
+
+                    if (!(object ? this->callObjectBegin() : this->callArrayBegin())) {
+                        reportError(Error::Aborted);
+                        return false;
+                    }
+
+                    move = WalkMove::Next;
+                    state = WalkState::Opened;
+                    break;
+                }
+
+                if (feeding && !isLeafLoaded()) {
+                    walk_move = move;
+                    walk_state = state;
+                    return false;
+                }
+
+                switch (cur) {
+                    case '"':
+                        if (!parseStringToken(false)) {
+                            return false;
+                        }
+
+                        break;
+
+                    case '-':
+                    case '0':
+                    case '1':
+                    case '2':
+                    case '3':
+                    case '4':
+                    case '5':
+                    case '6':
+                    case '7':
+                    case '8':
+                    case '9':
+                        if (!parseNumber()) {
+                            return false;
+                        }
+
+                        break;
+
+                    case 'n':
+                        if (!parseNull()) {
+                            return false;
+                        }
+
+                        break;
+
+                    case 't':
+                        if (!parseTrue()) {
+                            return false;
+                        }
+
+                        break;
+
+                    case 'f':
+                        if (!parseFalse()) {
+                            return false;
+                        }
+
+                        break;
+
+                    default:
+                        reportError(Error::ExpectingValue);
+                        return false;
+                }
+
+                move = WalkMove::SkipWhitespace;
+                state = WalkState::AfterValue;
+                break;
+
+            case WalkState::Opened:
+                // An empty container is closed like after its last value.
+                if (cur == (isInObject() ? '}' : ']')) {
+                    state = WalkState::AfterValue;
+                }
+                else {
+                    state = isInObject() ? WalkState::Member : WalkState::Value;
+                }
+
+                break;
+
+            case WalkState::AfterValue: {
+                if (nesting_depth == 0) {
+                    return true;
+                }
+
+                bool object = isInObject();
+
+                if (cur == ',') {
+                    okay();
+                    done();
+
+                    move = WalkMove::Next;
+                    state = object ? WalkState::Member : WalkState::Value;
+                    break;
+                }
+
+                if (cur != (object ? '}' : ']')) {
+                    reportError(object ? Error::ExpectingClosingCurlyBracket : Error::ExpectingClosingSquareBracket);
+                    return false;
+                }
+
+                okay();
+                done();
+
+                if (!(object ? this->callObjectEnd() : this->callArrayEnd())) {
+                    reportError(Error::Aborted);
+                    return false;
+                }
+
+                leaveNesting();
+
+                move = WalkMove::Next;
+                break;
+            }
+        }
+    }
+}
+
+template<typename Derived>
+void TFJsonParser<Derived>::reportError(Error error) {
+    TFJSON_DEBUGF("reportError(%s, idx_cur: %zd, idx_okay: %zd) -> \"%.*s\"\n", getErrorName(error), idx_cur, idx_okay, (int)(idx_nul - (idx_okay + 1)), buf + idx_okay + 1);
+
+    this->callError(error, buf + idx_okay + 1, idx_nul - (idx_okay + 1));
+}
+
+template<typename Derived>
+size_t TFJsonParser<Derived>::shift() {
+    size_t done_len = (size_t)idx_done + 1;
+
+    TFJSON_DEBUGF("shift() -> idx_nul: %zd, done_len: %zu\n", idx_nul, done_len);
+
+    memmove(buf, buf + done_len, idx_nul - done_len);
+
+    idx_nul -= done_len;
+    idx_cur -= done_len;
+
+    if (idx_utf8_invalid != std::numeric_limits<ssize_t>::max()) {
+        idx_utf8_invalid -= done_len;
+    }
+
+    idx_okay -= done_len;
+    idx_done -= done_len;
+
+    return done_len;
+}
+
+// Reached the end of the current input, try to refill. First move remaining
+// input to the front of the buffer to avoid having to deal with wrapping.
+template<typename Derived>
+bool TFJsonParser<Derived>::refill(size_t *offset) {
+    size_t shift_len = shift();
+
+    if (offset != nullptr) {
+        *offset = shift_len;
+    }
+
+    size_t unused_len = buf_len - idx_nul;
+
+    if (unused_len > 0) {
+        ssize_t refilled_len = this->callRefill(buf + idx_nul, unused_len);
+
+        if (refilled_len < 0) {
+            reportError(Error::RefillFailure);
+            return false;
+        }
+
+        TFJSON_DEBUGF("refill() -> \"%.*s\"\n", (int)refilled_len, buf + idx_nul);
+
+        idx_nul += refilled_len;
+
+        validateUTF8(idx_nul - refilled_len);
+    }
+    else if (this->callRefill(nullptr, 0) > 0) {
+        // the buffer is full with undone input and there is more input. the current
+        // element has to fit into the buffer. if there is more input after the
+        // current element then there has to be at least one char more than the current
+        // element in the buffer for the parser to be able to tell that the current
+        // element has ended
+        reportError(Error::ElementTooLong);
+        return false;
+    }
+
+    return true;
+}
+
+// Validates the chars loaded from idx_begin on.
+template<typename Derived>
+void TFJsonParser<Derived>::validateUTF8(ssize_t idx_begin) {
+    // Only the first error is reported.
+    if (idx_utf8_invalid != std::numeric_limits<ssize_t>::max()) {
+        return;
+    }
+
+    const char *end = buf + idx_nul;
+    const char *invalid = tfjson_validate_utf8(buf + idx_begin, end, &utf8_state, &utf8_invalid_start_byte);
+
+    if (invalid != end) {
+        idx_utf8_invalid = invalid - buf;
+    }
+}
+
+template<typename Derived>
+bool TFJsonParser<Derived>::next(size_t *offset) {
+    if (offset != nullptr) {
+        *offset = 0;
+    }
+
+    if (idx_cur + 1 >= idx_nul && !in_memory && derived().wantsRefill() && !feeding && !refill(offset)) {
+        return false;
+    }
+
+    return land(idx_cur + 1);
+}
+
+// Moves to the char at idx or to the end of the input. Reports a null byte or invalid UTF-8 there.
+template<typename Derived>
+bool TFJsonParser<Derived>::land(ssize_t idx) {
+    if (idx >= idx_nul) {
+        // While feeding, wait for the next feed() or finish() call.
+        if (feeding && !feed_finished) {
+            feed_suspended = true;
+            return false;
+        }
+
+        idx_cur = idx_nul;
+        cur = '\0';
+    }
+    else {
+        idx_cur = idx;
+        cur = buf[idx_cur];
+
+        if (cur == '\0') {
+            okay(-1);
+
+            reportError(Error::InlineNullByte);
+            return false;
+        }
+    }
+
+    TFJSON_DEBUGF("next() -> idx_cur: %zd, cur: '%c' [0x%02x]\n", idx_cur, cur, (uint8_t)cur);
+
+    // The input was validated when it was loaded. Report errors in order with the other errors when reaching them.
+    if (idx_cur == idx_utf8_invalid) {
+        okay(-1);
+
+        reportError(utf8_invalid_start_byte ? Error::InvalidUTF8StartByte : Error::InvalidUTF8ContinuationByte);
+        return false;
+    }
+
+    if (idx_cur == idx_nul && utf8_state.pending > 0) {
+        okay(-1);
+
+        reportError(Error::InvalidUTF8ContinuationByte);
+        return false;
+    }
+
+    return true;
+}
+
+// Moves to the next char that is not whitespace like next() followed by skipWhitespace(). If there is an index, everything
+// between the current char and the next index entry is whitespace, unless the input is invalid before it.
+template<typename Derived>
+bool TFJsonParser<Derived>::nextToken() {
+    if (index_next == nullptr) {
+        return next() && skipWhitespace();
+    }
+
+    while ((ssize_t)(*index_next & ~TFJSON_INDEX_ESCAPED) <= idx_cur) {
+        ++index_next;
+    }
+
+    ssize_t idx = (ssize_t)(*index_next & ~TFJSON_INDEX_ESCAPED);
+
+    // Whitespace is never invalid UTF-8, but let next() find the invalid char.
+    if (idx > idx_utf8_invalid) {
+        return next() && skipWhitespace();
+    }
+
+    if (idx > idx_cur + 1) {
+        idx_cur = idx - 1;
+
+        okay();
+        done();
+    }
+
+    return land(idx);
+}
+
+// Like parseString(), but strings without escape sequences are taken from the index as they are, if there is one.
+template<typename Derived>
+bool TFJsonParser<Derived>::parseStringToken(bool report_as_member) {
+    if (index_next == nullptr) {
+        return parseString(report_as_member);
+    }
+
+    while ((ssize_t)(*index_next & ~TFJSON_INDEX_ESCAPED) < idx_cur) {
+        ++index_next;
+    }
+
+    // The entry after an opening quote is its closing quote or the end of input.
+    if (cur != '"' || (ssize_t)*index_next != idx_cur) {
+        return parseString(report_as_member);
+    }
+
+    ssize_t idx_closing = (ssize_t)index_next[1];
+
+    if (idx_closing >= idx_nul || idx_closing >= idx_utf8_invalid) { // also true if TFJSON_INDEX_ESCAPED is set
+        return parseString(report_as_member);
+    }
+
+    char *str = buf + idx_cur + 1;
+    size_t str_len = idx_closing - (idx_cur + 1);
+
+    idx_cur = idx_closing;
+
+    okay();
+
+    TFJSON_DEBUGF("parseStringToken(report_as_member: %s) -> \"%.*s\"\n", report_as_member ? "true" : "false", (int)str_len, str);
+
+    if (report_as_member) {
+        if (!this->callMember(str, str_len)) {
+            reportError(Error::Aborted);
+            return false;
+        }
+    }
+    else {
+        if (!this->callString(str, str_len)) {
+            reportError(Error::Aborted);
+            return false;
+        }
+    }
+
+    done();
+
+    return land(idx_cur + 1);
+}
+
+// Like skipWhitespace(), but jumps to the next index entry if there is an index.
+template<typename Derived>
+bool TFJsonParser<Derived>::skipToToken() {
+    if (!isWhitespace()) {
+        return true;
+    }
+
+    if (index_next == nullptr) {
+        return skipWhitespace();
+    }
+
+    // The current char is whitespace too: Skip from the char before it.
+    --idx_cur;
+
+    return nextToken();
+}
+
+template<typename Derived>
+void TFJsonParser<Derived>::okay(ssize_t offset) {
+    idx_okay = idx_cur + offset;
+
+    TFJSON_DEBUGF("okay(offset: %zd) -> idx_okay: %zd\n", offset, idx_okay);
+}
+
+template<typename Derived>
+void TFJsonParser<Derived>::done() {
+    idx_done = idx_okay;
+
+    TFJSON_DEBUGF("done() -> idx_done: %zd\n", idx_done);
+}
+
+template<typename Derived>
+bool TFJsonParser<Derived>::enterNesting(bool object) {
+    if (nesting_depth >= nesting_depth_max) {
+        reportError(Error::NestingTooDeep);
+        return false;
+    }
+
+    if (nesting_depth / 32 >= nesting_stack_len && !growNestingStack()) {
+        return false;
+    }
+
+    uint32_t bit = 1u << (nesting_depth % 32);
+
+    if (object) {
+        nesting_stack[nesting_depth / 32] |= bit;
+    }
+    else {
+        nesting_stack[nesting_depth / 32] &= ~bit;
+    }
+
+    ++nesting_depth;
+
+    return true;
+}
+
+// Doubles the size of the nesting stack, up to the size needed for nesting_depth_max. A nesting stack passed to the
+// constructor is large enough already.
+template<typename Derived>
+bool TFJsonParser<Derived>::growNestingStack() {
+    size_t len = nesting_stack_len * 2;
+
+    if (len > TFJSON_NESTING_STACK_LEN(nesting_depth_max)) {
+        len = TFJSON_NESTING_STACK_LEN(nesting_depth_max);
+    }
+
+    uint32_t *stack = (uint32_t *)malloc(len * sizeof(uint32_t));
+
+    if (stack == nullptr) {
+        reportError(Error::OutOfMemory);
+        return false;
+    }
+
+    memcpy(stack, nesting_stack, nesting_stack_len * sizeof(uint32_t));
+
+    if (nesting_stack_owned) {
+        free(nesting_stack);
+    }
+
+    nesting_stack = stack;
+    nesting_stack_len = len;
+    nesting_stack_owned = true;
+
+    return true;
+}
+
+template<typename Derived>
+void TFJsonParser<Derived>::leaveNesting() {
+    assert(nesting_depth > 0);
+
+    --nesting_depth;
+}
+
+template<typename Derived>
+bool TFJsonParser<Derived>::isInObject() {
+    assert(nesting_depth > 0);
+
+    size_t level = nesting_depth - 1;
+
+    return (nesting_stack[level / 32] & (1u << (level % 32))) != 0;
+}
+
+template<typename Derived>
+bool TFJsonParser<Derived>::isWhitespace() {
+    return tfjson_is_whitespace(cur);
+}
+
+template<typename Derived>
+bool TFJsonParser<Derived>::isDigit() {
+    return cur >= '0' && cur <= '9';
+}
+
+template<typename Derived>
+bool TFJsonParser<Derived>::isHexDigit() {
+    return isDigit() || (cur >= 'a' && cur <= 'f') || (cur >= 'A' && cur <= 'F');
+}
+
+template<typename Derived>
+bool TFJsonParser<Derived>::isControl() {
+    return tfjson_is_control(cur);
+}
+
+template<typename Derived>
+bool TFJsonParser<Derived>::skipWhitespace() {
+    while (isWhitespace()) {
+        TFJSON_DEBUGF("skipWhitespace(cur: '%c' [0x%02x])\n", cur, (uint8_t)cur);
+
+        // Whitespace is ASCII: Skip the loaded whitespace at once, next() only has to check the char after it.
+        ssize_t idx = idx_cur + 1;
+
+        while (idx < idx_nul && tfjson_is_whitespace(buf[idx])) {
+            ++idx;
+        }
+
+        idx_cur = idx - 1;
+
+        okay();
+        done();
+
+        if (!next()) {
+            return false;
+        }
+    }
+
+    return true;
+}
+
+// Moves idx_cur to the last of the loaded digits following the current char, so that next() loads the char after them.
+template<typename Derived>
+void TFJsonParser<Derived>::skipLoadedDigits() {
+    ssize_t idx = idx_cur + 1;
+
+    while (idx < idx_nul && buf[idx] >= '0' && buf[idx] <= '9') {
+        ++idx;
+    }
+
+    idx_cur = idx - 1;
+}
+
+// While feeding, the leaf value at the current char is only parsed if it and the char after it are loaded completely or if
+// enough of it is loaded to report an error. The leaf parsers can't be continued halfway. The check continues where it
+// stopped on the previous call, so a long leaf split into many chunks is only scanned once.
+template<typename Derived>
+bool TFJsonParser<Derived>::isLeafLoaded() {
+    if (!feeding || feed_finished) {
+        return true;
+    }
+
+    bool loaded = true;
+    size_t scan_len = idx_nul - idx_cur;
+
+    switch (cur) {
+        case '"': {
+            const char *c = buf + idx_cur + leaf_scan_len;
+            const char *end = buf + idx_nul;
+
+            loaded = false;
+
+            while ((c = tfjson_find_escape(c, end)) != end) {
+                if (*c == '"') {
+                    loaded = end - c > 1;
+                    break;
+                }
+
+                if (*c != '\\') {
+                    // An unescaped control char is an error.
+                    loaded = true;
+                    break;
+                }
+
+                if (end - c < 2) {
+                    break;
+                }
+
+                c += 2;
+            }
+
+            // Continue at the closing quote or at the backslash if the char after it is missing.
+            if (c < end) {
+                scan_len = (size_t)(c - (buf + idx_cur));
+            }
+
+            break;
+        }
+
+        case '-':
+        case '0':
+        case '1':
+        case '2':
+        case '3':
+        case '4':
+        case '5':
+        case '6':
+        case '7':
+        case '8':
+        case '9': {
+            ssize_t idx = idx_cur + leaf_scan_len;
+
+            while (idx < idx_nul && ((buf[idx] >= '0' && buf[idx] <= '9') || buf[idx] == '.' || buf[idx] == 'e' || buf[idx] == 'E' || buf[idx] == '-' || buf[idx] == '+')) {
+                ++idx;
+            }
+
+            loaded = idx < idx_nul;
+            break;
+        }
+
+        case 'n':
+            loaded = isLiteralLoaded("null", 4);
+            break;
+
+        case 't':
+            loaded = isLiteralLoaded("true", 4);
+            break;
+
+        case 'f':
+            loaded = isLiteralLoaded("false", 5);
+            break;
+    }
+
+    if (!loaded) {
+        TFJSON_DEBUGF("isLeafLoaded() -> false, idx_cur: %zd, idx_nul: %zd\n", idx_cur, idx_nul);
+
+        leaf_scan_len = scan_len;
+        feed_suspended = true;
+    }
+    else {
+        leaf_scan_len = 1;
+    }
+
+    return loaded;
+}
+
+template<typename Derived>
+bool TFJsonParser<Derived>::isLiteralLoaded(const char *literal, size_t literal_len) {
+    size_t loaded_len = idx_nul - idx_cur;
+
+    // A mismatch in the loaded chars is an error.
+    return loaded_len > literal_len || memcmp(buf + idx_cur + leaf_scan_len, literal + leaf_scan_len, loaded_len - leaf_scan_len) != 0;
+}
+
+template<typename Derived>
+bool TFJsonParser<Derived>::parseString(bool report_as_member) {
+    if (cur != '"') {
+        reportError(Error::ExpectingOpeningQuote);
+        return false;
+    }
+
+    okay();
+    done();
+
+    if (!next()) {
+        return false;
+    }
+
+    char *str = buf + idx_cur;
+    char *end = str;
+    size_t offset;
+
+    while (cur != '"') {
+        if (cur == '\0') {
+            reportError(Error::ExpectingClosingQuote);
+            return false;
+        }
+
+        if (cur != '\\' && isControl()) {
+            reportError(Error::UnescapedControlCharacter);
+            return false;
+        }
+
+        // Unescape all loaded chars up to the next quote, control char, invalid UTF-8 or escape sequence that is not
+        // loaded completely at once. next() then checks the char after them as usual. The char by char path below
+        // handles what is left, with errors reported at the same positions.
+        const char *c = buf + idx_cur;
+        const char *bound = buf + (idx_utf8_invalid < idx_nul ? idx_utf8_invalid : idx_nul);
+        ssize_t idx_okay_before = idx_okay; // okay() is only called after next() for \u escapes
+        ssize_t idx_okay_at = idx_okay;
+        bool unicode_last = false;
+
+        while (c < bound) {
+            const char *plain_end = tfjson_find_escape(c, bound);
+
+            if (plain_end != c) {
+                // Nothing has to be moved until the first escape sequence.
+                if (end != c) {
+                    memmove(end, c, plain_end - c);
+                }
+
+                end += plain_end - c;
+                c = plain_end;
+                idx_okay_at = c - buf - 1;
+                unicode_last = false;
+                continue;
+            }
+
+            if (*c != '\\') {
+                break;
+            }
+
+            // The unescaped chars can overwrite the sequence.
+            bool unicode = bound - c >= 2 && c[1] == 'u';
+
+            // A refill error in the next() call after a \u escape reports the escape as it was loaded.
+            if (unicode && bound - c <= 6 && bound == buf + idx_nul) {
+                break;
+            }
+
+            const char *escape_end = tfjson_unescape(c, bound, allow_null_in_string, &end);
+
+            if (escape_end == nullptr) {
+                break;
+            }
+
+            if (unicode) {
+                idx_okay_before = unicode_last ? c - buf : idx_okay_at;
+                unicode_last = true;
+            }
+            else {
+                idx_okay_at = escape_end - buf - 1;
+                unicode_last = false;
+            }
+
+            c = escape_end;
+        }
+
+        if (c != buf + idx_cur) {
+            idx_cur = c - buf - 1;
+            idx_okay = unicode_last ? idx_okay_before : idx_okay_at;
+
+            if (!next(&offset)) {
+                return false;
+            }
+
+            str -= offset;
+            end -= offset;
+
+            if (unicode_last) {
+                okay();
+            }
+
+            continue;
+        }
+
+        if (!next(&offset)) {
+            return false;
+        }
+
+        str -= offset;
+        end -= offset;
+
+        char unescaped = '\0';
+
+        switch (cur) {
+            case '"':
+                unescaped = '"';
+                break;
+
+            case '\\':
+                unescaped = '\\';
+                break;
+
+            case '/':
+                unescaped = '/';
+                break;
+
+            case 'b':
+                unescaped = '\b';
+                break;
+
+            case 'f':
+                unescaped = '\f';
+                break;
+
+            case 'n':
+                unescaped = '\n';
+                break;
+
+            case 'r':
+                unescaped = '\r';
+                break;
+
+            case 't':
+                unescaped = '\t';
+                break;
+        }
+
+        if (unescaped != '\0') {
+            *end++ = unescaped;
+
+            okay();
+
+            if (!next(&offset)) {
+                return false;
+            }
+
+            str -= offset;
+            end -= offset;
+
+            continue;
+        }
+
+        if (cur == 'u') {
+            if (!next(&offset)) {
+                return false;
+            }
+
+            str -= offset;
+            end -= offset;
+
+            char hex[5] = {0};
+
+            for (int i = 0; i < 4; ++i) {
+                if (!isHexDigit()) {
+                    reportError(Error::InvalidEscapeSequence);
+                    return false;
+                }
+
+                hex[i] = cur;
+
+                if (!next(&offset)) {
+                    return false;
+                }
+
+                str -= offset;
+                end -= offset;
+            }
+
+            // Four hex digits can't encode a value > UINT32_MAX.
+            uint32_t code_point = (uint32_t) strtoul(hex, nullptr, 16);
+
+            if (!allow_null_in_string && code_point == 0) {
+                reportError(Error::ForbiddenNullInString);
+                return false;
+            }
+
+            char *encoded_end = tfjson_encode_utf8(code_point, end);
+
+            if (encoded_end == nullptr) {
+                reportError(Error::InvalidEscapeSequence);
+                return false;
+            }
+
+            end = encoded_end;
+
+            okay();
+
+            continue;
+        }
+
+        reportError(Error::InvalidEscapeSequence);
+        return false;
+    }
+
+    okay();
+
+    size_t str_len = end - str;
+
+    TFJSON_DEBUGF("parseString(report_as_member: %s) -> \"%.*s\"\n", report_as_member ? "true" : "false", (int)str_len, str);
+
+    if (report_as_member) {
+        if (!this->callMember(str, str_len)) {
+            reportError(Error::Aborted);
+            return false;
+        }
+    }
+    else {
+        if (!this->callString(str, str_len)) {
+            reportError(Error::Aborted);
+            return false;
+        }
+    }
+
+    done();
+
+    if (!next()) {
+        return false;
+    }
+
+    return true;
+}
+
+template<typename Derived>
+bool TFJsonParser<Derived>::parseNumber() {
+    char *number = buf + idx_cur;
+    size_t offset;
+
+    if (cur == '-') {
+        if (!next(&offset)) {
+            return false;
+        }
+
+        number -= offset;
+    }
+
+    if (!isDigit()) {
+        reportError(Error::ExpectingNumber);
+        return false;
+    }
+
+    char first_digit = cur;
+
+    // The integer part is decoded while scanning it. Values that don't fit into 64 bits are reported as number.
+    uint64_t magnitude = (uint64_t)(first_digit - '0');
+    bool magnitude_overflow = false;
+
+    if (!next(&offset)) {
+        return false;
+    }
+
+    number -= offset;
+
+    if (first_digit != '0') {
+        while (isDigit()) {
+            ssize_t idx_digits = idx_cur;
+
+            skipLoadedDigits();
+
+            if (!magnitude_overflow && !tfjson_accumulate_digits(buf + idx_digits, buf + idx_cur + 1, &magnitude)) {
+                magnitude_overflow = true;
+            }
+
+            if (!next(&offset)) {
+                return false;
+            }
+
+            number -= offset;
+        }
+    }
+
+    bool has_fraction_or_exponent = false;
+
+    if (cur == '.') {
+        if (!next(&offset)) {
+            return false;
+        }
+
+        number -= offset;
+
+        has_fraction_or_exponent = true;
+
+        if (!isDigit()) {
+            okay(-1);
+
+            reportError(Error::ExpectingFractionDigits);
+            return false;
+        }
+
+        while (isDigit()) {
+            skipLoadedDigits();
+
+            if (!next(&offset)) {
+                return false;
+            }
+
+            number -= offset;
+        }
+    }
+
+    if (cur == 'e' || cur == 'E') {
+        if (!next(&offset)) {
+            return false;
+        }
+
+        number -= offset;
+        has_fraction_or_exponent = true;
+
+        if (cur == '-' || cur == '+') {
+            if (!next(&offset)) {
+                return false;
+            }
+
+            number -= offset;
+        }
+
+        if (!isDigit()) {
+            okay(-1);
+
+            reportError(Error::ExpectingExponentDigits);
+            return false;
+        }
+
+        while (isDigit()) {
+            skipLoadedDigits();
+
+            if (!next(&offset)) {
+                return false;
+            }
+
+            number -= offset;
+        }
+    }
+
+    size_t number_len = buf + idx_cur - number;
+
+    TFJSON_DEBUGF("parseNumber() -> \"%.*s\"\n", (int)number_len, number);
+
+    if (has_fraction_or_exponent) {
+        if (derived().wantsDouble()) {
+            double result;
+
+            okay(-1);
+
+            if (!tfjson_parse_double(number, number_len, &result)) {
+                TFJSON_DEBUGF("parseNumber() -> \"%.*s\", out of range\n", (int)number_len, number);
+
+                if (!this->callNumber(number, number_len)) {
+                    reportError(Error::Aborted);
+                    return false;
+                }
+            }
+            else {
+                TFJSON_DEBUGF("parseNumber() -> \"%.*s\" = %f\n", (int)number_len, number, result);
+
+                if (!this->callDouble(result)) {
+                    reportError(Error::Aborted);
+                    return false;
+                }
+            }
+        }
+        else if (derived().wantsNumber()) {
+            if (!this->callNumber(number, number_len)) {
+                reportError(Error::Aborted);
+                return false;
+            }
+        }
+    }
+    else if (*number == '-') {
+        if (derived().wantsInt64()) {
+            okay(-1);
+
+            // -INT64_MIN is INT64_MAX + 1
+            if (!magnitude_overflow && magnitude <= (uint64_t)INT64_MAX + 1) {
+                int64_t result = magnitude == (uint64_t)INT64_MAX + 1 ? INT64_MIN : -(int64_t)magnitude;
+
+                TFJSON_DEBUGF("parseNumber() -> \"%.*s\" = %" PRIi64 "\n", (int)number_len, number, result);
+
+                if (!this->callInt64(result)) {
+                    reportError(Error::Aborted);
+                    return false;
+                }
+            }
+            else {
+                TFJSON_DEBUGF("parseNumber() -> \"%.*s\", out of range\n", (int)number_len, number);
+
+                if (!this->callNumber(number, number_len)) {
+                    reportError(Error::Aborted);
+                    return false;
+                }
+            }
+        }
+        else if (derived().wantsNumber()) {
+            if (!this->callNumber(number, number_len)) {
+                reportError(Error::Aborted);
+                return false;
+            }
+        }
+    }
+    else {
+        if (derived().wantsUInt64()) {
+            okay(-1);
+
+            if (!magnitude_overflow) {
+                TFJSON_DEBUGF("parseNumber() -> \"%.*s\" = %" PRIu64 "\n", (int)number_len, number, magnitude);
+
+                if (!this->callUInt64(magnitude)) {
+                    reportError(Error::Aborted);
+                    return false;
+                }
+            }
+            else {
+                TFJSON_DEBUGF("parseNumber() -> \"%.*s\", out of range\n", (int)number_len, number);
+
+                if (!this->callNumber(number, number_len)) {
+                    reportError(Error::Aborted);
+                    return false;
+                }
+            }
+        }
+        else if (derived().wantsNumber()) {
+            if (!this->callNumber(number, number_len)) {
+                reportError(Error::Aborted);
+                return false;
+            }
+        }
+    }
+
+    done();
+
+    return true;
+}
+
+template<typename Derived>
+bool TFJsonParser<Derived>::parseNull() {
+    if (cur != 'n') {
+        reportError(Error::ExpectingNull);
+        return false;
+    }
+
+    // All chars of the literal are ASCII: If it is loaded completely, compare it at once.
+    if (idx_nul - idx_cur >= 4 && memcmp(buf + idx_cur, "null", 4) == 0) {
+        idx_cur += 3;
+        cur = 'l';
+    }
+    else {
+        if (!next()) {
+            return false;
+        }
+
+        if (cur != 'u') {
+            reportError(Error::ExpectingNull);
+            return false;
+        }
+
+        if (!next()) {
+            return false;
+        }
+
+        if (cur != 'l') {
+            reportError(Error::ExpectingNull);
+            return false;
+        }
+
+        if (!next()) {
+            return false;
+        }
+
+        if (cur != 'l') {
+            reportError(Error::ExpectingNull);
+            return false;
+        }
+    }
+
+    okay();
+
+    if (!this->callNull()) {
+        reportError(Error::Aborted);
+        return false;
+    }
+
+    done();
+
+    if (!next()) {
+        return false;
+    }
+
+    return true;
+}
+
+template<typename Derived>
+bool TFJsonParser<Derived>::parseTrue() {
+    if (cur != 't') {
+        reportError(Error::ExpectingTrue);
+        return false;
+    }
+
+    // All chars of the literal are ASCII: If it is loaded completely, compare it at once.
+    if (idx_nul - idx_cur >= 4 && memcmp(buf + idx_cur, "true", 4) == 0) {
+        idx_cur += 3;
+        cur = 'e';
+    }
+    else {
+        if (!next()) {
+            return false;
+        }
+
+        if (cur != 'r') {
+            reportError(Error::ExpectingTrue);
+            return false;
+        }
+
+        if (!next()) {
+            return false;
+        }
+
+        if (cur != 'u') {
+            reportError(Error::ExpectingTrue);
+            return false;
+        }
+
+        if (!next()) {
+            return false;
+        }
+
+        if (cur != 'e') {
+            reportError(Error::ExpectingTrue);
+            return false;
+        }
+    }
+
+    okay();
+
+    if (!this->callBoolean(true)) {
+        reportError(Error::Aborted);
+        return false;
+    }
+
+    done();
+
+    if (!next()) {
+        return false;
+    }
+
+    return true;
+}
+
+template<typename Derived>
+bool TFJsonParser<Derived>::parseFalse() {
+    if (cur != 'f') {
+        reportError(Error::ExpectingFalse);
+        return false;
+    }
+
+    // All chars of the literal are ASCII: If it is loaded completely, compare it at once.
+    if (idx_nul - idx_cur >= 5 && memcmp(buf + idx_cur, "false", 5) == 0) {
+        idx_cur += 4;
+        cur = 'e';
+    }
+    else {
+        if (!next()) {
+            return false;
+        }
+
+        if (cur != 'a') {
+            reportError(Error::ExpectingFalse);
+            return false;
+        }
+
+        if (!next()) {
+            return false;
+        }
+
+        if (cur != 'l') {
+            reportError(Error::ExpectingFalse);
+            return false;
+        }
+
+        if (!next()) {
+            return false;
+        }
+
+        if (cur != 's') {
+            reportError(Error::ExpectingFalse);
+            return false;
+        }
+
+        if (!next()) {
+            return false;
+        }
+
+        if (cur != 'e') {
+            reportError(Error::ExpectingFalse);
+            return false;
+        }
+    }
+
+    okay();
+
+    if (!this->callBoolean(false)) {
+        reportError(Error::Aborted);
+        return false;
+    }
+
+    done();
+
+    if (!next()) {
+        return false;
+    }
+
+    return true;
+}
+
+// Parser with handlers that can be set at runtime.
+struct TFJsonDeserializer : TFJsonParser<TFJsonDeserializer> {
+    std::function<void(Error, char *, size_t)> error_handler;
+    std::function<ssize_t(char *, size_t)> refill_handler;
+    std::function<bool(void)> begin_handler;
+    std::function<bool(void)> end_handler;
+    std::function<bool(void)> object_begin_handler;
+    std::function<bool(void)> object_end_handler;
+    std::function<bool(void)> array_begin_handler;
+    std::function<bool(void)> array_end_handler;
+    std::function<bool(char *, size_t)> member_handler;
+    std::function<bool(char *, size_t)> string_handler;
+    std::function<bool(double)> double_handler;
+    std::function<bool(int64_t)> int64_handler;
+    std::function<bool(uint64_t)> uint64_handler;
+    std::function<bool(char *, size_t)> number_handler;
+    std::function<bool(bool)> boolean_handler;
+    std::function<bool(void)> null_handler;
+
+    TFJsonDeserializer(size_t nesting_depth_max, size_t malloc_size_max, bool allow_null_in_string = true, uint32_t *nesting_stack = nullptr);
+
+    void setErrorHandler(std::function<void(Error, char *, size_t)> &&error_handler);
+    void setRefillHandler(std::function<ssize_t(char *, size_t)> &&refill_handler);
+    void setBeginHandler(std::function<bool(void)> &&begin_handler);
+    void setEndHandler(std::function<bool(void)> &&end_handler);
+    void setObjectBeginHandler(std::function<bool(void)> &&object_begin_handler);
+    void setObjectEndHandler(std::function<bool(void)> &&object_end_handler);
+    void setArrayBeginHandler(std::function<bool(void)> &&array_begin_handler);
+    void setArrayEndHandler(std::function<bool(void)> &&array_end_handler);
+    void setMemberHandler(std::function<bool(char *, size_t)> &&member_handler);
+    void setStringHandler(std::function<bool(char *, size_t)> &&string_handler);
+    void setDoubleHandler(std::function<bool(double)> &&double_handler);
+    void setInt64Handler(std::function<bool(int64_t)> &&int64_handler);
+    void setUInt64Handler(std::function<bool(uint64_t)> &&uint64_handler);
+    void setNumberHandler(std::function<bool(char *, size_t)> &&number_handler);
+    void setBooleanHandler(std::function<bool(bool)> &&boolean_handler);
+    void setNullHandler(std::function<bool(void)> &&null_handler);
+
+private:
+    friend struct TFJsonParser<TFJsonDeserializer>;
+
+    // Handlers that are not set are skipped, like missing handlers of a TFJsonParser.
+    bool wantsRefill() const { return (bool)refill_handler; }
+    bool wantsDouble() const { return (bool)double_handler; }
+    bool wantsInt64() const { return (bool)int64_handler; }
+    bool wantsUInt64() const { return (bool)uint64_handler; }
+    bool wantsNumber() const { return (bool)number_handler; }
+
+    void onError(Error error, char *c, size_t len) { if (error_handler) error_handler(error, c, len); }
+    ssize_t onRefill(char *c, size_t len) { return refill_handler(c, len); }
+    bool onBegin() { return !begin_handler || begin_handler(); }
+    bool onEnd() { return !end_handler || end_handler(); }
+    bool onObjectBegin() { return !object_begin_handler || object_begin_handler(); }
+    bool onObjectEnd() { return !object_end_handler || object_end_handler(); }
+    bool onArrayBegin() { return !array_begin_handler || array_begin_handler(); }
+    bool onArrayEnd() { return !array_end_handler || array_end_handler(); }
+    bool onMember(char *c, size_t len) { return !member_handler || member_handler(c, len); }
+    bool onString(char *c, size_t len) { return !string_handler || string_handler(c, len); }
+    bool onDouble(double d) { return double_handler(d); }
+    bool onInt64(int64_t i) { return int64_handler(i); }
+    bool onUInt64(uint64_t u) { return uint64_handler(u); }
+    bool onNumber(char *c, size_t len) { return !number_handler || number_handler(c, len); }
+    bool onBoolean(bool b) { return !boolean_handler || boolean_handler(b); }
+    bool onNull() { return !null_handler || null_handler(); }
+};
+
+#endif
+
+#ifdef TFJSON_IMPLEMENTATION
+
+#include <stdio.h>
+#include <stdlib.h>
+#include <string.h>
+#include <math.h>
+#include <errno.h>
+#include <inttypes.h>
+#include <assert.h>
+#include <limits.h> // for CHAR_MIN
+#include <float.h> // for FLT_EVAL_METHOD
+
+
+static const uint64_t tfjson_pow10_u64[20] = {
+    1ull, 10ull, 100ull, 1000ull, 10000ull, 100000ull, 1000000ull, 10000000ull, 100000000ull, 1000000000ull,
+    10000000000ull, 100000000000ull, 1000000000000ull, 10000000000000ull, 100000000000000ull, 1000000000000000ull,
+    10000000000000000ull, 100000000000000000ull, 1000000000000000000ull, 10000000000000000000ull,
+};
+
+static const char tfjson_digit_pairs[201] =
+    "00010203040506070809"
+    "10111213141516171819"
+    "20212223242526272829"
+    "30313233343536373839"
+    "40414243444546474849"
+    "50515253545556575859"
+    "60616263646566676869"
+    "70717273747576777879"
+    "80818283848586878889"
+    "90919293949596979899";
+
+// Number of decimal digits of u. bit_length * log10(2) is either exact or one too high.
+static size_t tfjson_u64_len(uint64_t u) {
+    size_t t = (size_t)((64 - __builtin_clzll(u | 1)) * 1233) >> 12;
+
+    return t + 1 - ((u | 1) < tfjson_pow10_u64[t]);
+}
+
+// Writes the len = tfjson_u64_len(u) decimal digits of u to out, two digits at a time from the back.
+static void tfjson_u64_format(char *out, uint64_t u, size_t len) {
+    char *p = out + len;
+
+    // Avoid 64 bit divisions (slow on 32 bit platforms) for everything but the top digits.
+    while (u > UINT32_MAX) {
+        uint32_t low = (uint32_t)(u % 100000000u);
+
+        u /= 100000000u;
+
+        for (int i = 0; i < 4; ++i) {
+            p -= 2;
+            memcpy(p, tfjson_digit_pairs + (low % 100) * 2, 2);
+            low /= 100;
+        }
+    }
+
+    uint32_t v = (uint32_t)u;
+
+    while (v >= 100) {
+        p -= 2;
+        memcpy(p, tfjson_digit_pairs + (v % 100) * 2, 2);
+        v /= 100;
+    }
+
+    if (v >= 10) {
+        p -= 2;
+        memcpy(p, tfjson_digit_pairs + v * 2, 2);
+    }
+    else {
+        *--p = (char)('0' + v);
+    }
+}
+
+// Shortest round-trip formatting of doubles and floats, based on the Grisu2 algorithm by Florian Loitsch:
+// "Printing Floating-Point Numbers Quickly and Accurately with Integers" (PLDI 2010).
+// The generated digits always parse back to the identical value. In rare cases they are not the shortest possible.
+
+struct tfjson_diyfp {
+    uint64_t f;
+    int e;
+};
+
+struct tfjson_cached_power {
+    uint64_t f;
+    int16_t e;
+    int16_t k;
+};
+
+// Normalized 64 bit approximations of 10^k for k = -300, -292, ..., 324.
+static const tfjson_cached_power tfjson_cached_powers[79] = {
+    { 0xAB70FE17C79AC6CAULL, -1060, -300 },
+    { 0xFF77B1FCBEBCDC4FULL, -1034, -292 },
+    { 0xBE5691EF416BD60CULL, -1007, -284 },
+    { 0x8DD01FAD907FFC3CULL,  -980, -276 },
+    { 0xD3515C2831559A83ULL,  -954, -268 },
+    { 0x9D71AC8FADA6C9B5ULL,  -927, -260 },
+    { 0xEA9C227723EE8BCBULL,  -901, -252 },
+    { 0xAECC49914078536DULL,  -874, -244 },
+    { 0x823C12795DB6CE57ULL,  -847, -236 },
+    { 0xC21094364DFB5637ULL,  -821, -228 },
+    { 0x9096EA6F3848984FULL,  -794, -220 },
+    { 0xD77485CB25823AC7ULL,  -768, -212 },
+    { 0xA086CFCD97BF97F4ULL,  -741, -204 },
+    { 0xEF340A98172AACE5ULL,  -715, -196 },
+    { 0xB23867FB2A35B28EULL,  -688, -188 },
+    { 0x84C8D4DFD2C63F3BULL,  -661, -180 },
+    { 0xC5DD44271AD3CDBAULL,  -635, -172 },
+    { 0x936B9FCEBB25C996ULL,  -608, -164 },
+    { 0xDBAC6C247D62A584ULL,  -582, -156 },
+    { 0xA3AB66580D5FDAF6ULL,  -555, -148 },
+    { 0xF3E2F893DEC3F126ULL,  -529, -140 },
+    { 0xB5B5ADA8AAFF80B8ULL,  -502, -132 },
+    { 0x87625F056C7C4A8BULL,  -475, -124 },
+    { 0xC9BCFF6034C13053ULL,  -449, -116 },
+    { 0x964E858C91BA2655ULL,  -422, -108 },
+    { 0xDFF9772470297EBDULL,  -396, -100 },
+    { 0xA6DFBD9FB8E5B88FULL,  -369,  -92 },
+    { 0xF8A95FCF88747D94ULL,  -343,  -84 },
+    { 0xB94470938FA89BCFULL,  -316,  -76 },
+    { 0x8A08F0F8BF0F156BULL,  -289,  -68 },
+    { 0xCDB02555653131B6ULL,  -263,  -60 },
+    { 0x993FE2C6D07B7FACULL,  -236,  -52 },
+    { 0xE45C10C42A2B3B06ULL,  -210,  -44 },
+    { 0xAA242499697392D3ULL,  -183,  -36 },
+    { 0xFD87B5F28300CA0EULL,  -157,  -28 },
+    { 0xBCE5086492111AEBULL,  -130,  -20 },
+    { 0x8CBCCC096F5088CCULL,  -103,  -12 },
+    { 0xD1B71758E219652CULL,   -77,   -4 },
+    { 0x9C40000000000000ULL,   -50,    4 },
+    { 0xE8D4A51000000000ULL,   -24,   12 },
+    { 0xAD78EBC5AC620000ULL,     3,   20 },
+    { 0x813F3978F8940984ULL,    30,   28 },
+    { 0xC097CE7BC90715B3ULL,    56,   36 },
+    { 0x8F7E32CE7BEA5C70ULL,    83,   44 },
+    { 0xD5D238A4ABE98068ULL,   109,   52 },
+    { 0x9F4F2726179A2245ULL,   136,   60 },
+    { 0xED63A231D4C4FB27ULL,   162,   68 },
+    { 0xB0DE65388CC8ADA8ULL,   189,   76 },
+    { 0x83C7088E1AAB65DBULL,   216,   84 },
+    { 0xC45D1DF942711D9AULL,   242,   92 },
+    { 0x924D692CA61BE758ULL,   269,  100 },
+    { 0xDA01EE641A708DEAULL,   295,  108 },
+    { 0xA26DA3999AEF774AULL,   322,  116 },
+    { 0xF209787BB47D6B85ULL,   348,  124 },
+    { 0xB454E4A179DD1877ULL,   375,  132 },
+    { 0x865B86925B9BC5C2ULL,   402,  140 },
+    { 0xC83553C5C8965D3DULL,   428,  148 },
+    { 0x952AB45CFA97A0B3ULL,   455,  156 },
+    { 0xDE469FBD99A05FE3ULL,   481,  164 },
+    { 0xA59BC234DB398C25ULL,   508,  172 },
+    { 0xF6C69A72A3989F5CULL,   534,  180 },
+    { 0xB7DCBF5354E9BECEULL,   561,  188 },
+    { 0x88FCF317F22241E2ULL,   588,  196 },
+    { 0xCC20CE9BD35C78A5ULL,   614,  204 },
+    { 0x98165AF37B2153DFULL,   641,  212 },
+    { 0xE2A0B5DC971F303AULL,   667,  220 },
+    { 0xA8D9D1535CE3B396ULL,   694,  228 },
+    { 0xFB9B7CD9A4A7443CULL,   720,  236 },
+    { 0xBB764C4CA7A44410ULL,   747,  244 },
+    { 0x8BAB8EEFB6409C1AULL,   774,  252 },
+    { 0xD01FEF10A657842CULL,   800,  260 },
+    { 0x9B10A4E5E9913129ULL,   827,  268 },
+    { 0xE7109BFBA19C0C9DULL,   853,  276 },
+    { 0xAC2820D9623BF429ULL,   880,  284 },
+    { 0x80444B5E7AA7CF85ULL,   907,  292 },
+    { 0xBF21E44003ACDD2DULL,   933,  300 },
+    { 0x8E679C2F5E44FF8FULL,   960,  308 },
+    { 0xD433179D9C8CB841ULL,   986,  316 },
+    { 0x9E19DB92B4E31BA9ULL,  1013,  324 },
+};
+
+static tfjson_diyfp tfjson_diyfp_mul(tfjson_diyfp x, tfjson_diyfp y) {
+    // 64 x 64 -> 128 bit multiplication from 32 bit halves, keeping the rounded upper half.
+    uint64_t x_lo = x.f & 0xFFFFFFFFu;
+    uint64_t x_hi = x.f >> 32;
+    uint64_t y_lo = y.f & 0xFFFFFFFFu;
+    uint64_t y_hi = y.f >> 32;
+
+    uint64_t p0 = x_lo * y_lo;
+    uint64_t p1 = x_lo * y_hi;
+    uint64_t p2 = x_hi * y_lo;
+    uint64_t p3 = x_hi * y_hi;
+
+    uint64_t q = (p0 >> 32) + (p1 & 0xFFFFFFFFu) + (p2 & 0xFFFFFFFFu) + (1u << 31);
+
+    return {p3 + (p1 >> 32) + (p2 >> 32) + (q >> 32), x.e + y.e + 64};
+}
+
+static tfjson_diyfp tfjson_diyfp_normalize(tfjson_diyfp x) {
+    int shift = __builtin_clzll(x.f);
+
+    return {x.f << shift, x.e - shift};
+}
+
+// Computes the normalized value and its normalized rounding boundaries m- and m+ with the precision of FloatType.
+template<typename FloatType, typename BitsType>
+static void tfjson_compute_boundaries(FloatType value, tfjson_diyfp *v, tfjson_diyfp *m_minus, tfjson_diyfp *m_plus) {
+    const int precision = std::numeric_limits<FloatType>::digits; // including the hidden bit
+    const int bias = std::numeric_limits<FloatType>::max_exponent - 1 + (precision - 1);
+    const uint64_t hidden_bit = (uint64_t)1 << (precision - 1);
+
+    BitsType bits;
+    memcpy(&bits, &value, sizeof(bits));
+
+    uint64_t exponent = bits >> (precision - 1);
+    uint64_t fraction = bits & (hidden_bit - 1);
+
+    tfjson_diyfp w = exponent == 0 ? tfjson_diyfp{fraction, 1 - bias} : tfjson_diyfp{fraction + hidden_bit, (int)exponent - bias};
+
+    // The lower boundary is closer if the fraction is zero, because the exponent then decreases below the value.
+    bool lower_boundary_is_closer = fraction == 0 && exponent > 1;
+
+    tfjson_diyfp plus = {2 * w.f + 1, w.e - 1};
+    tfjson_diyfp minus = lower_boundary_is_closer ? tfjson_diyfp{4 * w.f - 1, w.e - 2} : tfjson_diyfp{2 * w.f - 1, w.e - 1};
+
+    *m_plus = tfjson_diyfp_normalize(plus);
+    *m_minus = {minus.f << (minus.e - m_plus->e), m_plus->e};
+    *v = tfjson_diyfp_normalize(w);
+}
+
+static void tfjson_grisu2_round(char *digits, size_t len, uint64_t dist, uint64_t delta, uint64_t rest, uint64_t ten_k) {
+    // Move the last digit towards w as long as the result stays in the rounding interval.
+    while (rest < dist && delta - rest >= ten_k && (rest + ten_k < dist || dist - rest > rest + ten_k - dist)) {
+        --digits[len - 1];
+        rest += ten_k;
+    }
+}
+
+// Writes the shortest digits of the normalized value v with boundaries m_minus and m_plus to digits.
+// Returns the number of digits, the value is digits * 10^(*exponent).
+static size_t tfjson_grisu2(char *digits, int *exponent, tfjson_diyfp m_minus, tfjson_diyfp v, tfjson_diyfp m_plus) {
+    // Select a cached power c = 10^-k, so that the binary exponent of m_plus * c is in [-60, -32].
+    // Then the integral part of the product fits into 32 bits.
+    const int alpha = -60;
+    int f = alpha - m_plus.e - 1;
+    int k = (f * 78913) / (1 << 18) + (f > 0);
+    const tfjson_cached_power &cached = tfjson_cached_powers[(300 + k + 7) / 8];
+    tfjson_diyfp c = {cached.f, cached.e};
+
+    tfjson_diyfp w = tfjson_diyfp_mul(v, c);
+    tfjson_diyfp w_minus = tfjson_diyfp_mul(m_minus, c);
+    tfjson_diyfp w_plus = tfjson_diyfp_mul(m_plus, c);
+
+    // Shrink the interval by one unit on each side to account for the imprecision of the multiplication.
+    uint64_t upper = w_plus.f - 1;
+    uint64_t delta = upper - (w_minus.f + 1);
+    uint64_t dist = upper - w.f;
+
+    int shift = -w_plus.e;
+    uint64_t one = (uint64_t)1 << shift;
+    uint32_t p1 = (uint32_t)(upper >> shift);
+    uint64_t p2 = upper & (one - 1);
+
+    *exponent = -cached.k;
+
+    size_t n = tfjson_u64_len(p1);
+    uint32_t pow10 = (uint32_t)tfjson_pow10_u64[n - 1];
+    size_t len = 0;
+
+    // Integral digits
+    while (n > 0) {
+        digits[len++] = (char)('0' + p1 / pow10);
+        p1 %= pow10;
+        --n;
+
+        uint64_t rest = ((uint64_t)p1 << shift) + p2;
+
+        if (rest <= delta) {
+            *exponent += (int)n;
+            tfjson_grisu2_round(digits, len, dist, delta, rest, (uint64_t)pow10 << shift);
+            return len;
+        }
+
+        pow10 /= 10;
+    }
+
+    // Fractional digits
+    int m = 0;
+
+    for (;;) {
+        p2 *= 10;
+        digits[len++] = (char)('0' + (p2 >> shift));
+        p2 &= one - 1;
+        ++m;
+
+        delta *= 10;
+        dist *= 10;
+
+        if (p2 <= delta)
+            break;
+    }
+
+    *exponent -= m;
+    tfjson_grisu2_round(digits, len, dist, delta, p2, one);
+
+    return len;
+}
+
+// Formats the finite value into out (at least tfjson_number_max_len<FloatType>() bytes, nothing is written past the returned
+// length) and returns the length.
+// Output is decimal (with at least one fractional digit, so that it is parsed back as a double) for exponents in [-4, TFJSON_FLOAT_DECIMAL_DIGITS_MAX), otherwise in exponential notation.
+template<typename FloatType, typename BitsType>
+static size_t tfjson_format_float(char *out, FloatType value) {
+    static_assert(tfjson_number_max_len<FloatType>() >= 1 + TFJSON_FLOAT_DECIMAL_DIGITS_MAX + 2, "tfjson_number_max_len doesn't cover the decimal notation");
+
+    char *p = out;
+
+    if (signbit(value)) {
+        *p++ = '-';
+        value = -value;
+    }
+
+    if (value == 0) {
+        memcpy(p, "0.0", 3);
+        return (size_t)(p - out) + 3;
+    }
+
+    tfjson_diyfp v;
+    tfjson_diyfp m_minus;
+    tfjson_diyfp m_plus;
+
+    tfjson_compute_boundaries<FloatType, BitsType>(value, &v, &m_minus, &m_plus);
+
+    int exponent;
+    int k = (int)tfjson_grisu2(p, &exponent, m_minus, v, m_plus);
+
+    // Position of the decimal point relative to the start of the digits.
+    int n = k + exponent;
+
+    if (k <= n && n <= TFJSON_FLOAT_DECIMAL_DIGITS_MAX) {
+        // digits[000].0
+        memset(p + k, '0', (size_t)(n - k));
+        memcpy(p + n, ".0", 2);
+        return (size_t)(p - out) + (size_t)n + 2;
+    }
+
+    if (0 < n && n <= TFJSON_FLOAT_DECIMAL_DIGITS_MAX) {
+        // dig.its
+        memmove(p + n + 1, p + n, (size_t)(k - n));
+        p[n] = '.';
+        return (size_t)(p - out) + (size_t)k + 1;
+    }
+
+    if (-4 < n && n <= 0) {
+        // 0.[000]digits
+        memmove(p + 2 - n, p, (size_t)k);
+        p[0] = '0';
+        p[1] = '.';
+        memset(p + 2, '0', (size_t)-n);
+        return (size_t)(p - out) + 2 + (size_t)-n + (size_t)k;
+    }
+
+    // d[.igits]e[-]x
+    if (k > 1) {
+        memmove(p + 2, p + 1, (size_t)(k - 1));
+        p[1] = '.';
+        p += k + 1;
+    }
+    else {
+        p += 1;
+    }
+
+    *p++ = 'e';
+
+    int e = n - 1;
+
+    if (e < 0) {
+        *p++ = '-';
+        e = -e;
+    }
+
+    size_t e_len = tfjson_u64_len((uint64_t)e);
+
+    tfjson_u64_format(p, (uint64_t)e, e_len);
+
+    return (size_t)(p - out) + e_len;
+}
+
+// Returns the char of the two char escape sequence for c or '\0' if c has to be escaped as \u00XX.
+static char tfjson_short_escape(char c) {
+    switch (c) {
+        case '\\': return '\\';
+        case '"':  return '"';
+        case '\b': return 'b';
+        case '\f': return 'f';
+        case '\n': return 'n';
+        case '\r': return 'r';
+        case '\t': return 't';
+        default:   return '\0';
+    }
+}
+
+// Writes the escape sequence for c to out (at least 6 bytes) and returns its length.
+static size_t tfjson_write_escape(char *out, char c) {
+    char e = tfjson_short_escape(c);
+
+    out[0] = '\\';
+
+    if (e != '\0') {
+        out[1] = e;
+        return 2;
+    }
+
+    char x = c & 0x0F;
+
+    out[1] = 'u';
+    out[2] = '0';
+    out[3] = '0';
+    out[4] = c & 0x10 ? '1' : '0';
+    out[5] = x >= 10 ? 'A' + (x - 10) : '0' + x;
+
+    return 6;
+}
+
+static size_t tfjson_escaped_len(const char *c, const char *end) {
+    size_t len = (size_t)(end - c);
+
+#if defined(__SSE2__)
+    // Count the extra chars per block: 1 for quotes, backslashes and control chars with a two char escape sequence, 5 for other control chars.
+    const __m128i quote = _mm_set1_epi8('"');
+    const __m128i backslash = _mm_set1_epi8('\\');
+    const __m128i control_max = _mm_set1_epi8(0x1F);
+    const __m128i b = _mm_set1_epi8('\b');
+    const __m128i t = _mm_set1_epi8('\t');
+    const __m128i n = _mm_set1_epi8('\n');
+    const __m128i f = _mm_set1_epi8('\f');
+    const __m128i r = _mm_set1_epi8('\r');
+    const __m128i one = _mm_set1_epi8(1);
+    const __m128i five = _mm_set1_epi8(5);
+
+    while (end - c >= 16) {
+        __m128i x = _mm_loadu_si128((const __m128i *)c);
+        __m128i short_escapes = _mm_or_si128(_mm_or_si128(_mm_cmpeq_epi8(x, quote), _mm_cmpeq_epi8(x, backslash)),
+                                             _mm_or_si128(_mm_or_si128(_mm_cmpeq_epi8(x, b), _mm_cmpeq_epi8(x, t)),
+                                                          _mm_or_si128(_mm_or_si128(_mm_cmpeq_epi8(x, n), _mm_cmpeq_epi8(x, f)), _mm_cmpeq_epi8(x, r))));
+        __m128i control = _mm_cmpeq_epi8(_mm_max_epu8(x, control_max), control_max);
+
+        // Control chars with a two char escape sequence are in both masks. Count them only once.
+        __m128i extra = _mm_or_si128(_mm_and_si128(short_escapes, one), _mm_and_si128(_mm_andnot_si128(short_escapes, control), five));
+
+        // Horizontal sum of the extra bytes
+        extra = _mm_sad_epu8(extra, _mm_setzero_si128());
+        len += (size_t)_mm_cvtsi128_si32(extra) + (size_t)_mm_extract_epi16(extra, 4);
+        c += 16;
+    }
+#endif
+
+    while ((c = tfjson_find_escape(c, end)) != end) {
+        len += tfjson_short_escape(*c) != '\0' ? 1 : 5;
+        ++c;
+    }
+
+    return len;
+}
+
+static size_t tfjson_format_integer(char *out, uint64_t u, bool negative) {
+    size_t digits = tfjson_u64_len(u);
+
+    if (negative)
+        *out++ = '-';
+
+    tfjson_u64_format(out, u, digits);
+
+    return digits + (negative ? 1 : 0);
+}
+
+// Formatting for TFJsonSerializer::writeNumbers. The narrow overloads are explicit, because int32_t is long on some targets
+// (e.g. ESP32), which makes promoting e.g. uint16_t ambiguous.
+static size_t tfjson_format_number(char *out, uint64_t u) { return tfjson_format_integer(out, u, false); }
+static size_t tfjson_format_number(char *out, int64_t i)  { return tfjson_format_integer(out, i < 0 ? 0 - (uint64_t)i : (uint64_t)i, i < 0); }
+static size_t tfjson_format_number(char *out, uint32_t u) { return tfjson_format_integer(out, u, false); }
+static size_t tfjson_format_number(char *out, int32_t i)  { return tfjson_format_integer(out, i < 0 ? 0 - (uint64_t)i : (uint64_t)i, i < 0); }
+static size_t tfjson_format_number(char *out, uint16_t u) { return tfjson_format_number(out, (uint32_t)u); }
+static size_t tfjson_format_number(char *out, int16_t i)  { return tfjson_format_number(out, (int32_t)i); }
+static size_t tfjson_format_number(char *out, uint8_t u)  { return tfjson_format_number(out, (uint32_t)u); }
+static size_t tfjson_format_number(char *out, int8_t i)   { return tfjson_format_number(out, (int32_t)i); }
+static size_t tfjson_format_number(char *out, double f)   { return isfinite(f) ? tfjson_format_float<double, uint64_t>(out, f) : (memcpy(out, "null", 4), 4); }
+static size_t tfjson_format_number(char *out, float f)    { return isfinite(f) ? tfjson_format_float<float, uint32_t>(out, f) : (memcpy(out, "null", 4), 4); }
+
+// Length tfjson_format_number would write, without formatting integers.
+static size_t tfjson_number_len(uint64_t u) { return tfjson_u64_len(u); }
+static size_t tfjson_number_len(int64_t i)  { return tfjson_u64_len(i < 0 ? 0 - (uint64_t)i : (uint64_t)i) + (i < 0 ? 1 : 0); }
+static size_t tfjson_number_len(uint32_t u) { return tfjson_u64_len(u); }
+static size_t tfjson_number_len(int32_t i)  { return tfjson_u64_len(i < 0 ? 0 - (uint64_t)i : (uint64_t)i) + (i < 0 ? 1 : 0); }
+static size_t tfjson_number_len(uint16_t u) { return tfjson_number_len((uint32_t)u); }
+static size_t tfjson_number_len(int16_t i)  { return tfjson_number_len((int32_t)i); }
+static size_t tfjson_number_len(uint8_t u)  { return tfjson_number_len((uint32_t)u); }
+static size_t tfjson_number_len(int8_t i)   { return tfjson_number_len((int32_t)i); }
+static size_t tfjson_number_len(double f)   { char tmp[32]; return tfjson_format_number(tmp, f); }
+static size_t tfjson_number_len(float f)    { char tmp[32]; return tfjson_format_number(tmp, f); }
+
+static const char tfjson_base64_alphabet[65] = "ABCDEFGHIJKLMNOPQRSTUVWXYZabcdefghijklmnopqrstuvwxyz0123456789+/";
+
+static void tfjson_base64_encode(char *out, const uint8_t *data, size_t blocks) {
+#if defined(__SSE2__)
+    // 4 blocks per step. SSE2 has no byte shuffle: Spread the blocks over the 32 bit lanes with byte shifts,
+    // move the 6 bit groups into the lanes' bytes and map them to the alphabet with compares instead of a table.
+    // Each step loads 16 bytes, so stop while there are less than 6 blocks.
+    const __m128i mask_i0 = _mm_set1_epi32(0x0000003F);
+    const __m128i mask_i1_high = _mm_set1_epi32(0x00003000);
+    const __m128i mask_i1_low = _mm_set1_epi32(0x00000F00);
+    const __m128i mask_i2_high = _mm_set1_epi32(0x003C0000);
+    const __m128i mask_i2_low = _mm_set1_epi32(0x00030000);
+    const __m128i mask_i3 = _mm_set1_epi32(0x3F000000);
+
+    while (blocks >= 6) {
+        __m128i x = _mm_loadu_si128((const __m128i *)data);
+
+        // Lane k holds the bytes data[3k..3k+3], i.e. block k in its lower three bytes.
+        __m128i lanes = _mm_unpacklo_epi64(_mm_unpacklo_epi32(x, _mm_srli_si128(x, 3)),
+                                           _mm_unpacklo_epi32(_mm_srli_si128(x, 6), _mm_srli_si128(x, 9)));
+
+        // Block bytes a, b, c in a lane: a >> 2 | (a & 3) << 4 | b >> 4 | (b & 15) << 2 | c >> 6 | c & 63, one index per byte.
+        __m128i indices = _mm_or_si128(_mm_or_si128(_mm_and_si128(_mm_srli_epi32(lanes, 2), mask_i0),
+                                                    _mm_or_si128(_mm_and_si128(_mm_slli_epi32(lanes, 12), mask_i1_high),
+                                                                 _mm_and_si128(_mm_srli_epi32(lanes, 4), mask_i1_low))),
+                                       _mm_or_si128(_mm_or_si128(_mm_and_si128(_mm_slli_epi32(lanes, 10), mask_i2_high),
+                                                                 _mm_and_si128(_mm_srli_epi32(lanes, 6), mask_i2_low)),
+                                                    _mm_and_si128(_mm_slli_epi32(lanes, 8), mask_i3)));
+
+        // 'A' + i for 0..25, 'a' - 26 + i for 26..51, '0' - 52 + i for 52..61, '+' for 62, '/' for 63
+        __m128i offset = _mm_set1_epi8('A');
+
+        offset = _mm_add_epi8(offset, _mm_and_si128(_mm_cmpgt_epi8(indices, _mm_set1_epi8(25)), _mm_set1_epi8('a' - 26 - 'A')));
+        offset = _mm_add_epi8(offset, _mm_and_si128(_mm_cmpgt_epi8(indices, _mm_set1_epi8(51)), _mm_set1_epi8('0' - 52 - ('a' - 26))));
+        offset = _mm_add_epi8(offset, _mm_and_si128(_mm_cmpeq_epi8(indices, _mm_set1_epi8(62)), _mm_set1_epi8('+' - 62 - ('0' - 52))));
+        offset = _mm_add_epi8(offset, _mm_and_si128(_mm_cmpeq_epi8(indices, _mm_set1_epi8(63)), _mm_set1_epi8('/' - 63 - ('0' - 52))));
+
+        _mm_storeu_si128((__m128i *)out, _mm_add_epi8(indices, offset));
+
+        data += 12;
+        out += 16;
+        blocks -= 4;
+    }
+#elif defined(__ARM_NEON) && defined(__aarch64__)
+    // 16 blocks per step: De-interleave the block bytes, split them into the four 6 bit groups and look those up in the alphabet.
+    uint8x16x4_t alphabet;
+
+    alphabet.val[0] = vld1q_u8((const uint8_t *)tfjson_base64_alphabet);
+    alphabet.val[1] = vld1q_u8((const uint8_t *)tfjson_base64_alphabet + 16);
+    alphabet.val[2] = vld1q_u8((const uint8_t *)tfjson_base64_alphabet + 32);
+    alphabet.val[3] = vld1q_u8((const uint8_t *)tfjson_base64_alphabet + 48);
+
+    while (blocks >= 16) {
+        uint8x16x3_t x = vld3q_u8(data);
+        uint8x16x4_t encoded;
+
+        encoded.val[0] = vshrq_n_u8(x.val[0], 2);
+        encoded.val[1] = vorrq_u8(vshlq_n_u8(vandq_u8(x.val[0], vdupq_n_u8(0x03)), 4), vshrq_n_u8(x.val[1], 4));
+        encoded.val[2] = vorrq_u8(vshlq_n_u8(vandq_u8(x.val[1], vdupq_n_u8(0x0F)), 2), vshrq_n_u8(x.val[2], 6));
+        encoded.val[3] = vandq_u8(x.val[2], vdupq_n_u8(0x3F));
+
+        encoded.val[0] = vqtbl4q_u8(alphabet, encoded.val[0]);
+        encoded.val[1] = vqtbl4q_u8(alphabet, encoded.val[1]);
+        encoded.val[2] = vqtbl4q_u8(alphabet, encoded.val[2]);
+        encoded.val[3] = vqtbl4q_u8(alphabet, encoded.val[3]);
+
+        vst4q_u8((uint8_t *)out, encoded);
+
+        data += 48;
+        out += 64;
+        blocks -= 16;
+    }
+#endif
+
+    for (size_t i = 0; i < blocks; ++i) {
+        uint32_t v = ((uint32_t)data[0] << 16) | ((uint32_t)data[1] << 8) | data[2];
+
+        out[0] = tfjson_base64_alphabet[(v >> 18) & 0x3F];
+        out[1] = tfjson_base64_alphabet[(v >> 12) & 0x3F];
+        out[2] = tfjson_base64_alphabet[(v >>  6) & 0x3F];
+        out[3] = tfjson_base64_alphabet[(v >>  0) & 0x3F];
+
+        data += 3;
+        out += 4;
+    }
+}
+
+static void tfjson_hex_encode(char *out, const uint8_t *data, size_t blocks) {
+    static const char digits[17] = "0123456789abcdef";
+
+    for (size_t i = 0; i < blocks; ++i) {
+        out[0] = digits[data[i] >> 4];
+        out[1] = digits[data[i] & 0x0F];
+
+        out += 2;
+    }
+}
+
+// Use this macro and pass length to writePlain so that the compiler can see (and create constants of) the string literal lengths.
+#define WRITE_PLAIN_LITERAL(x) this->writePlain((x), strlen((x)))
+
+TFJsonSerializer::TFJsonSerializer(char *buf, size_t buf_size) : buf(buf), buf_size(buf_size), head(buf), buf_required(0) {}
+
+TFJsonSerializer::~TFJsonSerializer() {
+    if (owns_buf)
+        free(buf);
+}
+
+void TFJsonSerializer::setFlushHandler(std::function<bool(const char *, size_t)> &&flush_handler_) { flush_handler = std::move(flush_handler_); }
+
+void TFJsonSerializer::setGrowable(size_t malloc_size_max_, size_t initial_size) {
+    assert(buf == nullptr && buf_required == 0);
+
+    if (initial_size > malloc_size_max_)
+        initial_size = malloc_size_max_;
+
+    malloc_size_max = malloc_size_max_;
+    buf = (char *)malloc(initial_size);
+
+    if (buf == nullptr)
+        return; // grow() retries on first use
+
+    owns_buf = true;
+    buf_size = initial_size;
+    head = buf;
+}
+
+#if TFJSON_GATHER
+void TFJsonSerializer::setGatherOutput(struct iovec *iov_, size_t iov_max_) {
+    assert(buf != nullptr && iov_max_ > 0 && !flush_handler && malloc_size_max == 0);
+
+    iov = iov_;
+    iov_max = iov_max_;
+    iov_count = 0;
+    iov_pending = head;
+}
+#endif
+
+char *TFJsonSerializer::release() {
+    char *result = owns_buf ? buf : nullptr;
+
+    owns_buf = false;
+    buf = nullptr;
+    buf_size = 0;
+    head = nullptr;
+
+    return result;
+}
+
+void TFJsonSerializer::addMemberNumber(TFJsonKey key, uint64_t u) {
+    this->addKey(key);
+    this->addNumber(u);
+}
+
+void TFJsonSerializer::addMemberNumber(TFJsonKey key, int64_t i) {
+    this->addKey(key);
+    this->addNumber(i);
+}
+
+void TFJsonSerializer::addMemberNumber(TFJsonKey key, uint32_t u) {
+    this->addKey(key);
+    this->addNumber(u);
+}
+
+void TFJsonSerializer::addMemberNumber(TFJsonKey key, int32_t i) {
+    this->addKey(key);
+    this->addNumber(i);
+}
+
+void TFJsonSerializer::addMemberNumber(TFJsonKey key, uint16_t u) {
+    this->addKey(key);
+    this->addNumber(u);
+}
+
+void TFJsonSerializer::addMemberNumber(TFJsonKey key, int16_t i) {
+    this->addKey(key);
+    this->addNumber(i);
+}
+
+void TFJsonSerializer::addMemberNumber(TFJsonKey key, uint8_t u) {
+    this->addKey(key);
+    this->addNumber(u);
+}
+
+void TFJsonSerializer::addMemberNumber(TFJsonKey key, int8_t i) {
+    this->addKey(key);
+    this->addNumber(i);
+}
+
+void TFJsonSerializer::addMemberNumber(TFJsonKey key, double f) {
+    this->addKey(key);
+    this->addNumber(f);
+}
+
+void TFJsonSerializer::addMemberNumber(TFJsonKey key, float f) {
+    this->addKey(key);
+    this->addNumber(f);
+}
+
+void TFJsonSerializer::addMemberBoolean(TFJsonKey key, bool b) {
+    this->addKey(key);
+    this->addBoolean(b);
+}
+
+void TFJsonSerializer::addMemberNull(TFJsonKey key) {
+    this->addKey(key);
+    this->addNull();
+}
+
+void TFJsonSerializer::addMemberString(TFJsonKey key, const char *c) {
+    this->addKey(key);
+    this->addString(c);
+}
+
+void TFJsonSerializer::addMemberStringVF(TFJsonKey key, const char *fmt, va_list args) {
+    this->addKey(key);
+    this->addStringVF(fmt, args);
+}
+
+void TFJsonSerializer::addMemberStringF(TFJsonKey key, const char *fmt, ...) {
+    va_list args;
+    va_start(args, fmt);
+    this->addMemberStringVF(key, fmt, args);
+    va_end(args);
+}
+
+void TFJsonSerializer::addMemberArray(TFJsonKey key) {
+    this->addKey(key);
+    this->writePlain('[');
+}
+
+void TFJsonSerializer::addMemberObject(TFJsonKey key) {
+    this->addKey(key);
+    this->writePlain('{');
+}
+
+void TFJsonSerializer::addMemberNumberArray(TFJsonKey key, const uint64_t *u, size_t count) {
+    this->addKey(key);
+    this->addNumberArray(u, count);
+}
+
+void TFJsonSerializer::addMemberNumberArray(TFJsonKey key, const int64_t *i, size_t count) {
+    this->addKey(key);
+    this->addNumberArray(i, count);
+}
+
+void TFJsonSerializer::addMemberNumberArray(TFJsonKey key, const uint32_t *u, size_t count) {
+    this->addKey(key);
+    this->addNumberArray(u, count);
+}
+
+void TFJsonSerializer::addMemberNumberArray(TFJsonKey key, const int32_t *i, size_t count) {
+    this->addKey(key);
+    this->addNumberArray(i, count);
+}
+
+void TFJsonSerializer::addMemberNumberArray(TFJsonKey key, const uint16_t *u, size_t count) {
+    this->addKey(key);
+    this->addNumberArray(u, count);
+}
+
+void TFJsonSerializer::addMemberNumberArray(TFJsonKey key, const int16_t *i, size_t count) {
+    this->addKey(key);
+    this->addNumberArray(i, count);
+}
+
+void TFJsonSerializer::addMemberNumberArray(TFJsonKey key, const uint8_t *u, size_t count) {
+    this->addKey(key);
+    this->addNumberArray(u, count);
+}
+
+void TFJsonSerializer::addMemberNumberArray(TFJsonKey key, const int8_t *i, size_t count) {
+    this->addKey(key);
+    this->addNumberArray(i, count);
+}
+
+void TFJsonSerializer::addMemberNumberArray(TFJsonKey key, const double *f, size_t count) {
+    this->addKey(key);
+    this->addNumberArray(f, count);
+}
+
+void TFJsonSerializer::addMemberNumberArray(TFJsonKey key, const float *f, size_t count) {
+    this->addKey(key);
+    this->addNumberArray(f, count);
+}
+
+void TFJsonSerializer::addMemberStringArray(TFJsonKey key, const char *const *c, size_t count) {
+    this->addKey(key);
+    this->addStringArray(c, count);
+}
+
+void TFJsonSerializer::addMemberBase64(TFJsonKey key, const uint8_t *data, size_t len) {
+    this->addKey(key);
+    this->addBase64(data, len);
+}
+
+void TFJsonSerializer::addMemberHex(TFJsonKey key, const uint8_t *data, size_t len) {
+    this->addKey(key);
+    this->addHex(data, len);
+}
+
+bool TFJsonSerializer::addMemberRaw(TFJsonKey key, const char *c, size_t len) {
+    if (len == TFJSON_USE_STRLEN)
+        len = strlen(c);
+
+    // Don't leave a key without value.
+    if (len == 0)
+        return false;
+
+    this->addKey(key);
+    return this->addRaw(c, len);
+}
+
+void TFJsonSerializer::addNumber(uint64_t u, bool enquote) {
+    if (!in_empty_container)
+        this->writePlain(',');
+
+    in_empty_container = false;
+
+    if (enquote)
+        this->writePlain('"');
+
+    this->writeInteger(u, false);
+
+    if (enquote)
+        this->writePlain('"');
+}
+
+void TFJsonSerializer::addNumber(int64_t i) {
+    if (!in_empty_container)
+        this->writePlain(',');
+
+    in_empty_container = false;
+
+    this->writeInteger(i < 0 ? 0 - (uint64_t)i : (uint64_t)i, i < 0);
+}
+
+void TFJsonSerializer::addNumber(uint32_t u) {
+    if (!in_empty_container)
+        this->writePlain(',');
+
+    in_empty_container = false;
+
+    this->writeInteger(u, false);
+}
+
+void TFJsonSerializer::addNumber(int32_t i) {
+    if (!in_empty_container)
+        this->writePlain(',');
+
+    in_empty_container = false;
+
+    this->writeInteger(i < 0 ? 0 - (uint64_t)i : (uint64_t)i, i < 0);
+}
 
 void TFJsonSerializer::addNumber(uint16_t u) {
     this->addNumber(static_cast<uint32_t>(u));
 }
 
-void TFJsonSerializer::addNumber(int16_t i) {
-    this->addNumber(static_cast<int32_t>(i));
+void TFJsonSerializer::addNumber(int16_t i) {
+    this->addNumber(static_cast<int32_t>(i));
+}
+
+void TFJsonSerializer::addNumber(uint8_t u) {
+    this->addNumber(static_cast<uint32_t>(u));
+}
+
+void TFJsonSerializer::addNumber(int8_t i) {
+    this->addNumber(static_cast<int32_t>(i));
+}
+
+void TFJsonSerializer::addNumber(double f) {
+    if (!in_empty_container)
+        this->writePlain(',');
+
+    in_empty_container = false;
+
+    if (isfinite(f)) {
+        char tmp[32];
+        this->writePlain(tmp, tfjson_format_float<double, uint64_t>(tmp, f));
+    }
+    else {
+        WRITE_PLAIN_LITERAL("null");
+    }
+}
+
+void TFJsonSerializer::addNumber(float f) {
+    if (!in_empty_container)
+        this->writePlain(',');
+
+    in_empty_container = false;
+
+    if (isfinite(f)) {
+        char tmp[32];
+        this->writePlain(tmp, tfjson_format_float<float, uint32_t>(tmp, f));
+    }
+    else {
+        WRITE_PLAIN_LITERAL("null");
+    }
+}
+
+void TFJsonSerializer::addBoolean(bool b) {
+    if (!in_empty_container)
+        this->writePlain(',');
+
+    in_empty_container = false;
+
+    if (b)
+        WRITE_PLAIN_LITERAL("true");
+    else
+        WRITE_PLAIN_LITERAL("false");
+}
+
+void TFJsonSerializer::addNull() {
+    if (!in_empty_container)
+        this->writePlain(',');
+
+    in_empty_container = false;
+
+    WRITE_PLAIN_LITERAL("null");
 }
 
-void TFJsonSerializer::addNumber(uint8_t u) {
-    this->addNumber(static_cast<uint32_t>(u));
+void TFJsonSerializer::addString(const char *c, size_t len, bool enquote) {
+    if (!in_empty_container)
+        this->writePlain(',');
+
+    in_empty_container = false;
+
+    if (enquote)
+        this->writePlain('\"');
+
+    this->writeEscaped(c, len);
+
+    if (enquote)
+        this->writePlain('\"');
 }
 
-void TFJsonSerializer::addNumber(int8_t i) {
-    this->addNumber(static_cast<int32_t>(i));
+void TFJsonSerializer::addStringVF(const char *fmt, va_list args) {
+    if (!in_empty_container)
+        this->writePlain(',');
+
+    in_empty_container = false;
+
+    this->writePlain('\"');
+    this->writeEscapedVF(fmt, args);
+    this->writePlain('\"');
 }
 
-void TFJsonSerializer::addNumber(double f) {
+void TFJsonSerializer::addStringF(const char *fmt, ...) {
+    va_list args;
+    va_start(args, fmt);
+    this->addStringVF(fmt, args);
+    va_end(args);
+}
+
+void TFJsonSerializer::addBase64(const uint8_t *data, size_t len) {
     if (!in_empty_container)
         this->writePlain(',');
 
     in_empty_container = false;
 
-    if (isfinite(f))
-        this->writePlainF("%f", f);
-    else
-        WRITE_PLAIN_LITERAL("null");
+    this->writePlain('\"');
+
+    size_t tail_len = len % 3;
+
+    this->writeEncoded(data, len - tail_len, 3, 4, tfjson_base64_encode);
+
+    if (tail_len > 0) {
+        uint8_t tail[3] = {data[len - tail_len], tail_len > 1 ? data[len - 1] : (uint8_t)0, 0};
+        char encoded[4];
+
+        tfjson_base64_encode(encoded, tail, 1);
+        memset(encoded + tail_len + 1, '=', 3 - tail_len);
+
+        this->writePlain(encoded, 4);
+    }
+
+    this->writePlain('\"');
+}
+
+void TFJsonSerializer::addHex(const uint8_t *data, size_t len) {
+    if (!in_empty_container)
+        this->writePlain(',');
+
+    in_empty_container = false;
+
+    this->writePlain('\"');
+    this->writeEncoded(data, len, 1, 2, tfjson_hex_encode);
+    this->writePlain('\"');
+}
+
+void TFJsonSerializer::addArray() {
+    if (!in_empty_container)
+        this->writePlain(',');
+
+    in_empty_container = true;
+
+    this->writePlain('[');
+}
+
+void TFJsonSerializer::addObject() {
+    if (!in_empty_container)
+        this->writePlain(',');
+
+    in_empty_container = true;
+
+    this->writePlain('{');
+}
+
+void TFJsonSerializer::addNumberArray(const uint64_t *u, size_t count) {
+    this->addArray();
+    this->writeNumbers(u, count);
+    this->endArray();
+}
+
+void TFJsonSerializer::addNumberArray(const int64_t *i, size_t count) {
+    this->addArray();
+    this->writeNumbers(i, count);
+    this->endArray();
+}
+
+void TFJsonSerializer::addNumberArray(const uint32_t *u, size_t count) {
+    this->addArray();
+    this->writeNumbers(u, count);
+    this->endArray();
+}
+
+void TFJsonSerializer::addNumberArray(const int32_t *i, size_t count) {
+    this->addArray();
+    this->writeNumbers(i, count);
+    this->endArray();
+}
+
+void TFJsonSerializer::addNumberArray(const uint16_t *u, size_t count) {
+    this->addArray();
+    this->writeNumbers(u, count);
+    this->endArray();
+}
+
+void TFJsonSerializer::addNumberArray(const int16_t *i, size_t count) {
+    this->addArray();
+    this->writeNumbers(i, count);
+    this->endArray();
+}
+
+void TFJsonSerializer::addNumberArray(const uint8_t *u, size_t count) {
+    this->addArray();
+    this->writeNumbers(u, count);
+    this->endArray();
+}
+
+void TFJsonSerializer::addNumberArray(const int8_t *i, size_t count) {
+    this->addArray();
+    this->writeNumbers(i, count);
+    this->endArray();
+}
+
+void TFJsonSerializer::addNumberArray(const double *f, size_t count) {
+    this->addArray();
+    this->writeNumbers(f, count);
+    this->endArray();
+}
+
+void TFJsonSerializer::addNumberArray(const float *f, size_t count) {
+    this->addArray();
+    this->writeNumbers(f, count);
+    this->endArray();
+}
+
+void TFJsonSerializer::addStringArray(const char *const *c, size_t count) {
+    this->addArray();
+
+    for (size_t i = 0; i < count; ++i) {
+        if (i > 0)
+            this->writePlain(',');
+
+        this->writePlain('\"');
+        this->writeEscaped(c[i]);
+        this->writePlain('\"');
+    }
+
+    this->endArray();
+}
+
+bool TFJsonSerializer::addRaw(const char *c, size_t len) {
+    if (len == TFJSON_USE_STRLEN)
+        len = strlen(c);
+
+    // Don't leave a dangling comma.
+    if (len == 0)
+        return false;
+
+    if (!in_empty_container)
+        this->writePlain(',');
+
+    in_empty_container = false;
+
+    if (this->measuring()) {
+        buf_required += len;
+        return true;
+    }
+
+#if TFJSON_GATHER
+    if (this->gatherReferenced(c, len))
+        return true;
+#endif
+
+    this->writePlain(c, len);
+    return true;
+}
+
+void TFJsonSerializer::endArray() {
+    in_empty_container = false;
+
+    this->writePlain(']');
+}
+
+void TFJsonSerializer::endObject() {
+    in_empty_container = false;
+
+    this->writePlain('}');
+}
+
+size_t TFJsonSerializer::end() {
+    // Return required buffer size _without_ the null terminator.
+    // This mirrors the behaviour of snprintf.
+    size_t result = buf_required;
+
+    if (flush_handler) {
+        this->flush();
+        return result;
+    }
+
+#if TFJSON_GATHER
+    if (iov != nullptr)
+        this->gatherPending();
+#endif
+
+    this->writePlain('\0');
+
+    // Referenced strings don't need space in buf.
+    if (buf_size > 0 && result - gathered_len >= buf_size) {
+        buf[buf_size - 1] = '\0';
+#if TFJSON_GATHER
+        iov_count = 0;
+#endif
+    }
+
+    return result;
+}
+
+void TFJsonSerializer::addKey(TFJsonKey key) {
+    if (!in_empty_container)
+        this->writePlain(',');
+
+    in_empty_container = true;
+
+    if (key.escaped) {
+        this->writePlain(key.key, key.len);
+        return;
+    }
+
+    this->writePlain('\"');
+    this->writeEscaped(key.key, key.len);
+    WRITE_PLAIN_LITERAL("\":");
+}
+
+void TFJsonSerializer::writeInteger(uint64_t u, bool negative) {
+    size_t digits = tfjson_u64_len(u);
+    size_t len = digits + (negative ? 1 : 0);
+
+    buf_required += len;
+
+    if (!this->reserve(len)) {
+        this->truncate();
+        return;
+    }
+
+    if (negative)
+        *head = '-';
+
+    tfjson_u64_format(head + len - digits, u, digits);
+    head += len;
+}
+
+// Encodes len bytes (a multiple of block_len) directly into the output buffer, as many blocks at a time as fit.
+void TFJsonSerializer::writeEncoded(const uint8_t *data, size_t len, size_t block_len, size_t encoded_block_len, void (*encode)(char *out, const uint8_t *data, size_t blocks)) {
+    size_t blocks = len / block_len;
+
+    if (this->measuring()) {
+        buf_required += blocks * encoded_block_len;
+        return;
+    }
+
+    while (blocks > 0) {
+        size_t batch = head >= buf + buf_size ? 0 : (size_t)(buf + buf_size - head) / encoded_block_len;
+
+        if (batch == 0) {
+            if (this->reserve(encoded_block_len))
+                continue;
+
+            // Fixed buffer is full. Only account for the rest.
+            buf_required += blocks * encoded_block_len;
+            this->truncate();
+            return;
+        }
+
+        if (batch > blocks)
+            batch = blocks;
+
+        encode(head, data, batch);
+
+        data += batch * block_len;
+        blocks -= batch;
+        head += batch * encoded_block_len;
+        buf_required += batch * encoded_block_len;
+    }
+}
+
+// Writes the comma separated values into an already opened array. Instead of checking the remaining buffer space per value,
+// this formats as many values in one go as are guaranteed to fit.
+template<typename T>
+void TFJsonSerializer::writeNumbers(const T *values, size_t count) {
+    // tfjson_format_float needs 32 bytes of space even though the output is shorter.
+    const size_t max_len = (std::numeric_limits<T>::is_integer ? tfjson_number_max_len<T>() : 32) + 1; // + 1 for the comma
+    size_t i = 0;
+
+    if (this->measuring()) {
+        if (count > 0)
+            buf_required += count - 1;
+
+        for (; i < count; ++i)
+            buf_required += tfjson_number_len(values[i]);
+
+        return;
+    }
+
+    while (i < count) {
+        size_t batch = head >= buf + buf_size ? 0 : (size_t)(buf + buf_size - head) / max_len;
+
+        if (batch == 0) {
+            if (this->reserve(max_len))
+                continue;
+
+            // Fixed buffer is full (or this is a sizing pass). Account for the remaining values one by one.
+            in_empty_container = i == 0;
+
+            for (; i < count; ++i)
+                this->addNumber(values[i]);
+
+            return;
+        }
+
+        if (batch > count - i)
+            batch = count - i;
+
+        char *p = head;
+
+        for (size_t batch_end = i + batch; i < batch_end; ++i) {
+            if (i > 0)
+                *p++ = ',';
+
+            p += tfjson_format_number(p, values[i]);
+        }
+
+        buf_required += (size_t)(p - head);
+        head = p;
+    }
+}
+
+#if TFJSON_GATHER
+void TFJsonSerializer::gatherPending() {
+    if (head == iov_pending)
+        return;
+
+    iov[iov_count].iov_base = iov_pending;
+    iov[iov_count].iov_len = (size_t)(head - iov_pending);
+    ++iov_count;
+
+    iov_pending = head;
+}
+
+// Reference the bytes instead of copying them. Keep one iovec for the pending bytes before and one for the bytes after them.
+bool TFJsonSerializer::gatherReferenced(const char *c, size_t len) {
+    if (iov == nullptr || len < TFJSON_GATHER_MIN_LEN || iov_count + 3 > iov_max)
+        return false;
+
+    this->gatherPending();
+
+    iov[iov_count].iov_base = const_cast<char *>(c);
+    iov[iov_count].iov_len = len;
+    ++iov_count;
+
+    buf_required += len;
+    gathered_len += len;
+    return true;
+}
+#endif
+
+void TFJsonSerializer::writeEscaped(const char *c, size_t len, bool may_reference) {
+    const char *end = c + (len == TFJSON_USE_STRLEN ? strlen(c) : len);
+
+    if (this->measuring()) {
+        buf_required += tfjson_escaped_len(c, end);
+        return;
+    }
+
+#if TFJSON_GATHER
+    if (iov != nullptr && may_reference && (size_t)(end - c) >= TFJSON_GATHER_MIN_LEN && tfjson_find_escape(c, end) == end && this->gatherReferenced(c, (size_t)(end - c)))
+        return;
+#else
+    (void)may_reference;
+#endif
+
+    while (c != end) {
+        const char *clean_end = tfjson_find_escape(c, end);
+
+        if (clean_end != c) {
+            writePlain(c, (size_t)(clean_end - c));
+            c = clean_end;
+
+            if (c == end)
+                break;
+        }
+
+        char escaped[6];
+
+        writePlain(escaped, tfjson_write_escape(escaped, *c));
+
+        ++c;
+    }
 }
 
-void TFJsonSerializer::addNumber(float f) {
-    this->addNumber(static_cast<double>(f));
-}
+// Escapes the len unescaped chars at head, expanding them back to front to escaped_len chars. The buffer must have room for them.
+void TFJsonSerializer::escapeInPlace(size_t len, size_t escaped_len) {
+    const char *src = head + len;
+    char *dst = head + escaped_len;
+
+    // All chars in front of the last escape are already in place.
+    while (src != dst) {
+        char c = *--src;
+
+        if (!tfjson_needs_escape(c)) {
+            *--dst = c;
+            continue;
+        }
 
-void TFJsonSerializer::addBoolean(bool b) {
-    if (!in_empty_container)
-        this->writePlain(',');
+        char escaped[6];
+        size_t escaped_size = tfjson_write_escape(escaped, c);
 
-    in_empty_container = false;
+        dst -= escaped_size;
+        memcpy(dst, escaped, escaped_size);
+    }
 
-    if (b)
-        WRITE_PLAIN_LITERAL("true");
-    else
-        WRITE_PLAIN_LITERAL("false");
+    buf_required += escaped_len;
+    head += escaped_len;
 }
 
-void TFJsonSerializer::addNull() {
-    if (!in_empty_container)
-        this->writePlain(',');
+void TFJsonSerializer::writeEscapedVF(const char *fmt, va_list args) {
+    char scratch[TFJSON_FORMAT_SCRATCH_SIZE];
+    va_list args_in_place;
+    va_list args_heap;
 
-    in_empty_container = false;
+    va_copy(args_in_place, args);
+    va_copy(args_heap, args);
 
-    WRITE_PLAIN_LITERAL("null");
-}
+    int w = vsnprintf(scratch, sizeof(scratch), fmt, args);
+    size_t len = w > 0 ? (size_t)w : 0;
+    bool written = true;
 
-void TFJsonSerializer::addString(const char *c, size_t len, bool enquote) {
-    if (!in_empty_container)
-        this->writePlain(',');
+    if (len >= sizeof(scratch)) {
+        written = false;
 
-    in_empty_container = false;
+        // Too long for the scratch space. Format into the output buffer (+ 1 for vsnprintf's null terminator) and escape in place.
+        if (this->reserve(len + 1)) {
+            vsnprintf(head, len + 1, fmt, args_in_place);
 
-    if (enquote)
-        this->writePlain('\"');
+            size_t escaped_len = tfjson_escaped_len(head, head + len);
 
-    this->writeEscaped(c, len);
+            if (escaped_len <= (size_t)(buf + buf_size - head) || (malloc_size_max > 0 && this->reserve(escaped_len))) {
+                this->escapeInPlace(len, escaped_len);
+                written = true;
+            }
+            else if (!flush_handler) {
+                // Doesn't fit, so the output is truncated anyway. Only account for the required size.
+                buf_required += escaped_len;
+                this->truncate();
+                written = true;
+            }
+        }
 
-    if (enquote)
-        this->writePlain('\"');
-}
+        // No room in the output buffer, i.e. during a sizing pass, if growing failed or if the escaped string has to be split
+        // for the flush handler. Only then use a temporary heap buffer to learn the escaped length.
+        if (!written) {
+            char *tmp = (char *)malloc(len + 1);
 
-void TFJsonSerializer::addStringVF(const char *fmt, va_list args) {
-    if (!in_empty_container)
-        this->writePlain(',');
+            if (tmp == nullptr) {
+                // The escaped length is unknown. Count the longest possible escaping, so that a sizing pass doesn't come up
+                // short, and drop the rest of the output, because the string is missing from it.
+                buf_required += 6 * len;
 
-    in_empty_container = false;
+                if (flush_handler)
+                    this->abortFlush();
+                else
+                    this->truncate();
+            }
+            else {
+                vsnprintf(tmp, len + 1, fmt, args_heap);
+                this->writeEscaped(tmp, len, false);
+                free(tmp);
+            }
+        }
+    }
+    else if (len > 0) {
+        this->writeEscaped(scratch, len, false);
+    }
 
-    this->writePlain('\"');
-    this->writeEscapedVF(fmt, args);
-    this->writePlain('\"');
+    va_end(args_in_place);
+    va_end(args_heap);
 }
 
-void TFJsonSerializer::addStringF(const char *fmt, ...) {
+void TFJsonSerializer::writeEscapedF(const char *fmt, ...) {
     va_list args;
     va_start(args, fmt);
-    this->addStringVF(fmt, args);
+    writeEscapedVF(fmt, args);
     va_end(args);
 }
 
-void TFJsonSerializer::addArray() {
-    if (!in_empty_container)
-        this->writePlain(',');
-
-    in_empty_container = true;
-
-    this->writePlain('[');
+bool TFJsonSerializer::measuring() const {
+    return buf_size == 0 && malloc_size_max == 0 && !flush_handler;
 }
 
-void TFJsonSerializer::addObject() {
-    if (!in_empty_container)
-        this->writePlain(',');
+bool TFJsonSerializer::flush() {
+    size_t len = (size_t)(head - buf);
 
-    in_empty_container = true;
+    if (len == 0)
+        return true;
 
-    this->writePlain('{');
-}
+    head = buf;
 
-void TFJsonSerializer::endArray() {
-    in_empty_container = false;
+    if (!flush_handler(buf, len)) {
+        this->abortFlush();
+        return false;
+    }
 
-    this->writePlain(']');
+    return true;
 }
 
-void TFJsonSerializer::endObject() {
-    in_empty_container = false;
-
-    this->writePlain('}');
+void TFJsonSerializer::abortFlush() {
+    // Behave like a full buffer from now on: Drop all output, but keep counting buf_required.
+    flush_handler = nullptr;
+    head = buf + buf_size;
 }
 
-size_t TFJsonSerializer::end() {
-    // Return required buffer size _without_ the null terminator.
-    // This mirrors the behaviour of snprintf.
-    size_t result = buf_required;
-
-    this->writePlain('\0');
+bool TFJsonSerializer::grow(size_t len) {
+    size_t used = (size_t)(head - buf);
 
-    if (buf_size > 0 && result >= buf_size)
-        buf[buf_size - 1] = '\0';
+    if (len <= malloc_size_max - used) {
+        size_t new_size = buf_size < malloc_size_max / 2 ? buf_size * 2 : malloc_size_max;
 
-    return result;
-}
+        if (new_size < used + len)
+            new_size = used + len;
 
-void TFJsonSerializer::addKey(const char *key) {
-    if (!in_empty_container)
-        this->writePlain(',');
+        char *new_buf = (char *)realloc(buf, new_size);
 
-    in_empty_container = true;
+        if (new_buf != nullptr) {
+            owns_buf = true;
+            buf = new_buf;
+            buf_size = new_size;
+            head = buf + used;
 
-    this->writePlain('\"');
-    this->writeEscaped(key);
-    WRITE_PLAIN_LITERAL("\":");
-}
+            return true;
+        }
+    }
 
-/*
-    All code points may
-    be placed within the quotation marks except for the code points that must be escaped: quotation mark
-    (U+0022), reverse solidus (U+005C), and the control characters U+0000 to U+001F.
-*/
-void TFJsonSerializer::writeEscaped(const char *c, size_t len) {
-    const char *end = c + (len == TFJSON_USE_STRLEN ? strlen(c) : len);
+    malloc_size_max = 0;
+    this->truncate();
 
-    while(c != end) {
-        switch (*c) {
-            case '\\':
-                writePlain('\\');
-                writePlain('\\');
-                break;
-            case '"':
-                writePlain('\\');
-                writePlain('"');
-                break;
-            case '\b':
-                writePlain('\\');
-                writePlain('b');
-                break;
-            case '\f':
-                writePlain('\\');
-                writePlain('f');
-                break;
-            case '\n':
-                writePlain('\\');
-                writePlain('n');
-                break;
-            case '\r':
-                writePlain('\\');
-                writePlain('r');
-                break;
-            case '\t':
-                writePlain('\\');
-                writePlain('t');
-                break;
-            default:
-                if (isctrl(*c)) {
-                    char x = *c;
+    return false;
+}
 
-                    writePlain('\\');
-                    writePlain('u');
-                    writePlain('0');
-                    writePlain('0');
-                    writePlain(x & 0x10 ? '1' : '0');
+bool TFJsonSerializer::reserve(size_t len) {
+    if (len <= buf_size && (size_t)(head - buf) <= (buf_size - len))
+        return true;
 
-                    x &= 0x0F;
+    if (malloc_size_max > 0)
+        return this->grow(len);
 
-                    if (x >= 10)
-                        writePlain('A' + (x - 10));
-                    else
-                        writePlain('0' + (x));
-                }
-                else {
-                    writePlain(*c);
-                }
+    if (!flush_handler || !this->flush())
+        return false;
 
-                break;
-        }
-        ++c;
-    }
+    return len <= buf_size;
 }
 
-void TFJsonSerializer::writeEscapedVF(const char *fmt, va_list args) {
-    char *tmp;
-    int tmp_len = vasprintf(&tmp, fmt, args); // FIXME: don't use vasprintf here, implement this without allocating extra memeory
+// A write didn't fit into the buffer. Behave like a full fixed buffer from now on. Otherwise smaller writes could still succeed
+// and corrupt the payload. The terminator keeps the skipped bytes out of the truncated payload.
+void TFJsonSerializer::truncate() {
+    if (flush_handler)
+        return;
 
-    if (tmp_len > 0) {
-        writeEscaped(tmp, tmp_len);
-    }
-}
+    malloc_size_max = 0;
 
-void TFJsonSerializer::writeEscapedF(const char *fmt, ...) {
-    va_list args;
-    va_start(args, fmt);
-    writeEscapedVF(fmt, args);
-    va_end(args);
+    if (head < buf + buf_size)
+        *head = '\0';
+
+    head = buf + buf_size;
 }
 
 void TFJsonSerializer::writePlain(char c) {
     ++buf_required;
 
-    if (buf_size == 0 || (size_t)(head - buf) > (buf_size - 1))
+    if ((buf_size == 0 || (size_t)(head - buf) > (buf_size - 1)) && !this->reserve(1))
         return;
 
     *head = c;
@@ -589,1214 +4511,2052 @@ void TFJsonSerializer::writePlain(char c) {
 void TFJsonSerializer::writePlain(const char *c, size_t len) {
     buf_required += len;
 
-    if (len > buf_size || (size_t)(head - buf) > (buf_size - len))
-        return;
+    if (len > buf_size || (size_t)(head - buf) > (buf_size - len)) {
+        if (flush_handler && len > buf_size) {
+            // Can't be buffered at all. Pass through to the flush handler.
+            if (this->flush() && !flush_handler(c, len))
+                this->abortFlush();
 
-    memcpy(head, c, len);
-    head += len;
-}
+            return;
+        }
 
-void TFJsonSerializer::writePlainVF(const char *fmt, va_list args) {
-    size_t buf_left = (head >= buf + buf_size) ? 0 : buf_size - (size_t)(head - buf);
-    int w = vsnprintf(head, buf_left, fmt, args);
+        if (!this->reserve(len)) {
+            // Keep the part that fits, as writing char by char would.
+            if (!flush_handler && head < buf + buf_size) {
+                size_t fitting_len = (size_t)(buf + buf_size - head);
 
-    if (w < 0) {
-        // don't move head if vsnprintf fails completely.
-        return;
+                memcpy(head, c, fitting_len);
+                head += fitting_len;
+            }
+
+            return;
+        }
     }
 
-    buf_required += (size_t)w;
+    memcpy(head, c, len);
+    head += len;
+}
 
-    if (buf_size == 0)
-        return;
+TFJsonFragmentCache::TFJsonFragmentCache(size_t slot_count, size_t malloc_size_max) :
+    slots((Slot *)calloc(slot_count, sizeof(Slot))),
+    slot_count(slots != nullptr ? slot_count : 0),
+    malloc_size_max(malloc_size_max) {
+}
 
-    if ((size_t)w >= buf_left) {
-        head = buf + buf_size;
+TFJsonFragmentCache::~TFJsonFragmentCache() {
+    this->clear();
+    free(slots);
+}
 
-        buf[buf_size - 1] = '\0';
-        return;
-    }
+bool TFJsonFragmentCache::addRaw(TFJsonSerializer &json, uint32_t id, uint32_t version, const std::function<void(TFJsonSerializer &)> &build) {
+    size_t len;
+    const char *fragment = this->get(id, version, build, &len);
 
-    head += (size_t)w;
-}
+    if (fragment == nullptr)
+        return false;
 
-void TFJsonSerializer::writePlainF(const char *fmt, ...) {
-    va_list args;
-    va_start(args, fmt);
-    writePlainVF(fmt, args);
-    va_end(args);
+    return json.addRaw(fragment, len);
 }
 
-TFJsonDeserializer::TFJsonDeserializer(size_t nesting_depth_max, size_t malloc_size_max, bool allow_null_in_string) :
-    nesting_depth_max(nesting_depth_max),
-    malloc_size_max(malloc_size_max),
-    allow_null_in_string(allow_null_in_string) {
+bool TFJsonFragmentCache::addMemberRaw(TFJsonSerializer &json, TFJsonKey key, uint32_t id, uint32_t version, const std::function<void(TFJsonSerializer &)> &build) {
+    size_t len;
+    const char *fragment = this->get(id, version, build, &len);
+
+    if (fragment == nullptr)
+        return false;
+
+    return json.addMemberRaw(key, fragment, len);
 }
 
-const char *TFJsonDeserializer::getErrorName(Error error) {
-    switch (error) {
-        case Error::Aborted: return "Aborted";
-        case Error::ExpectingEndOfInput: return "ExpectingEndOfInput";
-        case Error::ExpectingValue: return "ExpectingValue";
-        case Error::ExpectingOpeningCurlyBracket: return "ExpectingOpeningCurlyBracket";
-        case Error::ExpectingClosingCurlyBracket: return "ExpectingClosingCurlyBracket";
-        case Error::ExpectingColon: return "ExpectingColon";
-        case Error::ExpectingOpeningSquareBracket: return "ExpectingOpeningSquareBracket";
-        case Error::ExpectingClosingSquareBracket: return "ExpectingClosingSquareBracket";
-        case Error::ExpectingOpeningQuote: return "ExpectingOpeningQuote";
-        case Error::ExpectingClosingQuote: return "ExpectingClosingQuote";
-        case Error::ExpectingNumber: return "ExpectingNumber";
-        case Error::ExpectingFractionDigits: return "ExpectingFractionDigits";
-        case Error::ExpectingExponentDigits: return "ExpectingExponentDigits";
-        case Error::ExpectingNull: return "ExpectingNull";
-        case Error::ExpectingTrue: return "ExpectingTrue";
-        case Error::ExpectingFalse: return "ExpectingFalse";
-        case Error::InvalidEscapeSequence: return "InvalidEscapeSequence";
-        case Error::UnescapedControlCharacter: return "UnescapedControlCharacter";
-        case Error::ForbiddenNullInString: return "ForbiddenNullInString";
-        case Error::NestingTooDeep: return "NestingTooDeep";
-        case Error::InlineNullByte: return "InlineNullByte";
-        case Error::InvalidUTF8StartByte: return "InvalidUTF8StartByte";
-        case Error::InvalidUTF8ContinuationByte: return "InvalidUTF8ContinuationByte";
-        case Error::BufferTooShort: return "BufferTooShort";
-        case Error::OutOfMemory: return "OutOfMemory";
-        case Error::ElementTooLong: return "ElementTooLong";
-        case Error::RefillFailure: return "RefillFailure";
+TFJsonFragmentCache::Slot *TFJsonFragmentCache::find(uint32_t id) {
+    for (size_t i = 0; i < slot_count; ++i) {
+        if (slots[i].fragment != nullptr && slots[i].id == id)
+            return &slots[i];
     }
-    return "Unknown";
-}
 
-void TFJsonDeserializer::setErrorHandler(std::function<void(Error, char *, size_t)> &&error_handler_) { error_handler = std::move(error_handler_); }
+    return nullptr;
+}
 
-void TFJsonDeserializer::setRefillHandler(std::function<ssize_t(char *, size_t)> &&refill_handler_) { refill_handler = std::move(refill_handler_); }
+const char *TFJsonFragmentCache::get(uint32_t id, uint32_t version, const std::function<void(TFJsonSerializer &)> &build, size_t *len) {
+    Slot *slot = this->find(id);
 
-void TFJsonDeserializer::setBeginHandler(std::function<bool(void)> &&begin_handler_) { begin_handler = std::move(begin_handler_); }
+    if (slot != nullptr && slot->version == version) {
+        slot->last_use = ++use_counter;
 
-void TFJsonDeserializer::setEndHandler(std::function<bool(void)> &&end_handler_) { end_handler = std::move(end_handler_); }
+        if (len != nullptr)
+            *len = slot->len;
 
-void TFJsonDeserializer::setObjectBeginHandler(std::function<bool(void)> &&object_begin_handler_) { object_begin_handler = std::move(object_begin_handler_); }
+        return slot->fragment;
+    }
 
-void TFJsonDeserializer::setObjectEndHandler(std::function<bool(void)> &&object_end_handler_) { object_end_handler = std::move(object_end_handler_); }
+    if (slot_count == 0)
+        return nullptr;
 
-void TFJsonDeserializer::setArrayBeginHandler(std::function<bool(void)> &&array_begin_handler_) { array_begin_handler = std::move(array_begin_handler_); }
+    TFJsonSerializer json{nullptr, 0};
+    json.setGrowable(malloc_size_max);
+    build(json);
 
-void TFJsonDeserializer::setArrayEndHandler(std::function<bool(void)> &&array_end_handler_) { array_end_handler = std::move(array_end_handler_); }
+    size_t fragment_len = json.end();
 
-void TFJsonDeserializer::setMemberHandler(std::function<bool(char *, size_t)> &&member_handler_) { member_handler = std::move(member_handler_); }
+    // If build added nothing, there is no value to splice in.
+    if (fragment_len == 0 || fragment_len >= json.buf_size)
+        return nullptr;
 
-void TFJsonDeserializer::setStringHandler(std::function<bool(char *, size_t)> &&string_handler_) { string_handler = std::move(string_handler_); }
+    // Pick the slot only now: build might have used this cache for nested fragments.
+    slot = this->find(id);
 
-void TFJsonDeserializer::setDoubleHandler(std::function<bool(double)> &&double_handler_) { double_handler = std::move(double_handler_); }
+    if (slot == nullptr) {
+        slot = &slots[0];
 
-void TFJsonDeserializer::setInt64Handler(std::function<bool(int64_t)> &&int64_handler_) { int64_handler = std::move(int64_handler_); }
+        for (size_t i = 0; i < slot_count && slot->fragment != nullptr; ++i) {
+            if (slots[i].fragment == nullptr || (int32_t)(slots[i].last_use - slot->last_use) < 0)
+                slot = &slots[i];
+        }
+    }
 
-void TFJsonDeserializer::setUInt64Handler(std::function<bool(uint64_t)> &&uint64_handler_) { uint64_handler = std::move(uint64_handler_); }
+    free(slot->fragment);
 
-void TFJsonDeserializer::setNumberHandler(std::function<bool(char *, size_t)> &&number_handler_) { number_handler = std::move(number_handler_); }
+    slot->fragment = json.release();
+    slot->len = fragment_len;
+    slot->id = id;
+    slot->version = version;
+    slot->last_use = ++use_counter;
 
-void TFJsonDeserializer::setBooleanHandler(std::function<bool(bool)> &&boolean_handler_) { boolean_handler = std::move(boolean_handler_); }
+    if (len != nullptr)
+        *len = fragment_len;
 
-void TFJsonDeserializer::setNullHandler(std::function<bool(void)> &&null_handler_) { null_handler = std::move(null_handler_); }
+    return slot->fragment;
+}
 
-bool TFJsonDeserializer::parse(char *buf_, size_t buf_len_) {
-    nesting_depth = 0;
-    utf8_count = 0;
-    buf = buf_;
+void TFJsonFragmentCache::invalidate(uint32_t id) {
+    for (size_t i = 0; i < slot_count; ++i) {
+        if (slots[i].fragment != nullptr && slots[i].id == id) {
+            free(slots[i].fragment);
+            slots[i].fragment = nullptr;
+        }
+    }
+}
 
-    if (buf_len_ == TFJSON_USE_STRLEN) {
-        idx_nul = strlen(buf);
-        buf_len = idx_nul + 1;
+void TFJsonFragmentCache::clear() {
+    for (size_t i = 0; i < slot_count; ++i) {
+        free(slots[i].fragment);
+        slots[i].fragment = nullptr;
     }
-    else {
-        idx_nul = buf_len_;
-        buf_len = buf_len_;
+}
+
+static size_t tfjson_template_max_len(TFJsonTemplate::Type type, size_t string_len_max) {
+    switch (type) {
+        case TFJsonTemplate::Type::Uint64:  return tfjson_number_max_len<uint64_t>();
+        case TFJsonTemplate::Type::Int64:   return tfjson_number_max_len<int64_t>();
+        case TFJsonTemplate::Type::Uint32:  return tfjson_number_max_len<uint32_t>();
+        case TFJsonTemplate::Type::Int32:   return tfjson_number_max_len<int32_t>();
+        case TFJsonTemplate::Type::Uint16:  return tfjson_number_max_len<uint16_t>();
+        case TFJsonTemplate::Type::Int16:   return tfjson_number_max_len<int16_t>();
+        case TFJsonTemplate::Type::Uint8:   return tfjson_number_max_len<uint8_t>();
+        case TFJsonTemplate::Type::Int8:    return tfjson_number_max_len<int8_t>();
+        case TFJsonTemplate::Type::Double:  return tfjson_number_max_len<double>();
+        case TFJsonTemplate::Type::Float:   return tfjson_number_max_len<float>();
+        case TFJsonTemplate::Type::Boolean: return 5;
+        case TFJsonTemplate::Type::String:  return string_len_max == TFJSON_USE_STRLEN ? TFJSON_LEN_UNBOUNDED : 2 + 6 * string_len_max;
     }
 
-    idx_cur = -1;
-    idx_okay = -1;
-    idx_done = -1;
+    return TFJSON_LEN_UNBOUNDED;
+}
 
-    debugf("parse(%p, %zu) -> \"%.*s\"\n", buf, buf_len, (int)idx_nul, buf);
+// Converts value to the slot type if it is in its range. Returns false if the value has to be added with its own type.
+static bool tfjson_template_convert(TFJsonTemplate::Value &value, TFJsonTemplate::Type type) {
+    typedef TFJsonTemplate::Type Type;
 
-    if (begin_handler && !begin_handler()) {
-        reportError(Error::Aborted);
-        return false;
-    }
+    if (value.type == type)
+        return true;
 
-    if (!next()) {
-        return false;
+    bool is_signed = value.type == Type::Int64 || value.type == Type::Int32 || value.type == Type::Int16 || value.type == Type::Int8;
+    bool is_unsigned = value.type == Type::Uint64 || value.type == Type::Uint32 || value.type == Type::Uint16 || value.type == Type::Uint8;
+    uint64_t unsigned_max = 0;
+    int64_t signed_min = 0;
+    int64_t signed_max = 0;
+
+    switch (type) {
+        case Type::Double:
+        case Type::Float: {
+            double d;
+
+            if (is_signed)
+                d = (double)value.i;
+            else if (is_unsigned)
+                d = (double)value.u;
+            else if (value.type == Type::Double)
+                d = value.d;
+            else if (value.type == Type::Float)
+                d = value.f;
+            else
+                return false;
+
+            if (type == Type::Double)
+                value.d = d;
+            else
+                value.f = (float)d;
+
+            value.type = type;
+            return true;
+        }
+
+        case Type::Boolean:
+        case Type::String:
+            return false;
+
+        case Type::Uint64: unsigned_max = std::numeric_limits<uint64_t>::max(); break;
+        case Type::Uint32: unsigned_max = std::numeric_limits<uint32_t>::max(); break;
+        case Type::Uint16: unsigned_max = std::numeric_limits<uint16_t>::max(); break;
+        case Type::Uint8:  unsigned_max = std::numeric_limits<uint8_t>::max(); break;
+        case Type::Int64:  signed_min = std::numeric_limits<int64_t>::min(); signed_max = std::numeric_limits<int64_t>::max(); break;
+        case Type::Int32:  signed_min = std::numeric_limits<int32_t>::min(); signed_max = std::numeric_limits<int32_t>::max(); break;
+        case Type::Int16:  signed_min = std::numeric_limits<int16_t>::min(); signed_max = std::numeric_limits<int16_t>::max(); break;
+        case Type::Int8:   signed_min = std::numeric_limits<int8_t>::min(); signed_max = std::numeric_limits<int8_t>::max(); break;
     }
 
-    if (!parseElement()) {
+    if (!is_signed && !is_unsigned)
         return false;
+
+    if (unsigned_max != 0) {
+        if (is_signed && value.i < 0)
+            return false;
+
+        uint64_t u = is_signed ? (uint64_t)value.i : value.u;
+
+        if (u > unsigned_max)
+            return false;
+
+        value.u = u;
     }
+    else {
+        if (is_unsigned ? value.u > (uint64_t)signed_max : (value.i < signed_min || value.i > signed_max))
+            return false;
 
-    if (idx_done + 1 < idx_nul) {
-        reportError(Error::ExpectingEndOfInput);
-        return false;
+        if (is_unsigned)
+            value.i = (int64_t)value.u;
     }
 
-    if (end_handler && !end_handler()) {
-        reportError(Error::Aborted);
-        return false;
-    }
+    value.type = type;
+    return true;
+}
+
+// Escapes c into out, which must have room for 6 * len chars.
+static size_t tfjson_write_escaped(char *out, const char *c, size_t len) {
+    const char *end = c + len;
+    char *start = out;
+
+    while (c != end) {
+        const char *clean_end = tfjson_find_escape(c, end);
+
+        memcpy(out, c, (size_t)(clean_end - c));
+        out += clean_end - c;
+        c = clean_end;
+
+        if (c == end)
+            break;
 
-    debugf("parse(...) -> buf_len: %zu, idx_nul: %zd, idx_cur: %zd, idx_okay: %zd, idx_done: %zd\n", buf_len, idx_nul, idx_cur, idx_okay, idx_done);
+        out += tfjson_write_escape(out, *c);
+        ++c;
+    }
 
-    return true;
+    return (size_t)(out - start);
 }
 
-void TFJsonDeserializer::reportError(Error error) {
-    debugf("reportError(%s, idx_cur: %zd, idx_okay: %zd) -> \"%.*s\"\n", getErrorName(error), idx_cur, idx_okay, (int)(idx_nul - (idx_okay + 1)), buf + idx_okay + 1);
+TFJsonTemplate::TFJsonTemplate(size_t malloc_size_max) : shape(nullptr, 0) {
+    shape.setGrowable(malloc_size_max);
+}
 
-    if (error_handler) {
-        error_handler(error, buf + idx_okay + 1, idx_nul - (idx_okay + 1));
-    }
+TFJsonTemplate::~TFJsonTemplate() {
+    free(slots);
 }
 
-static int count_leading_ones_intrinsic(char value) {
-    uint8_t bits = ~(uint8_t)value;
+void TFJsonTemplate::addSlot(Type type, size_t string_len_max) {
+    assert(constant == nullptr);
 
-    if (bits == 0) {
-        return 8;
+    if (!shape.in_empty_container)
+        shape.writePlain(',');
+
+    shape.in_empty_container = false;
+
+    if (slot_count == slot_capacity) {
+        size_t capacity = slot_capacity == 0 ? 8 : slot_capacity * 2;
+        Slot *grown = (Slot *)realloc(slots, capacity * sizeof(Slot));
+
+        if (grown == nullptr) {
+            slots_failed = true;
+            return;
+        }
+
+        slots = grown;
+        slot_capacity = capacity;
     }
 
-    return __builtin_clz(bits) - 24;
+    slots[slot_count].offset = shape.buf_required;
+    slots[slot_count].max_len = tfjson_template_max_len(type, string_len_max);
+    slots[slot_count].type = type;
+    ++slot_count;
 }
 
-size_t TFJsonDeserializer::shift() {
-    size_t done_len = (size_t)idx_done + 1;
+void TFJsonTemplate::addMemberSlot(TFJsonKey key, Type type, size_t string_len_max) {
+    shape.addKey(key);
+    this->addSlot(type, string_len_max);
+}
 
-    debugf("shift() -> idx_nul: %zd, done_len: %zu\n", idx_nul, done_len);
+bool TFJsonTemplate::compile() {
+    size_t len = shape.end();
 
-    memmove(buf, buf + done_len, idx_nul - done_len);
+    if (slots_failed || len >= shape.buf_size || (len == 0 && slot_count == 0))
+        return false;
 
-    idx_nul -= done_len;
-    idx_cur -= done_len;
-    idx_okay -= done_len;
-    idx_done -= done_len;
+    constant = shape.buf;
+    constant_len = len;
+    max_len = len;
 
-    return done_len;
+    for (size_t i = 0; i < slot_count; ++i)
+        max_len = tfjson_add_len(max_len, slots[i].max_len);
+
+    return true;
 }
 
-bool TFJsonDeserializer::next(size_t *offset) {
-    if (offset != nullptr) {
-        *offset = 0;
-    }
+size_t TFJsonTemplate::maxLength() const {
+    return max_len;
+}
 
-    if (idx_cur + 1 >= idx_nul && refill_handler) {
-        // reached the end of the current input, try to refill. first move remaining
-        // input to the front of the buffer to avoid having to deal with wrapping
-        size_t shift_len = shift();
+void TFJsonTemplate::fillValues(TFJsonSerializer &json, Value *values, size_t count) {
+    assert(constant != nullptr);
 
-        if (offset != nullptr) {
-            *offset = shift_len;
-        }
+    // compile() failed or wasn't called.
+    if (constant == nullptr)
+        return;
 
-        size_t unused_len = buf_len - idx_nul;
+    if (!json.in_empty_container)
+        json.writePlain(',');
 
-        if (unused_len > 0) {
-            ssize_t refilled_len = refill_handler(buf + idx_nul, unused_len);
+    json.in_empty_container = false;
 
-            if (refilled_len < 0) {
-                reportError(Error::RefillFailure);
-                return false;
-            }
+    // Strings are only bounded if they are not longer than declared. Values that don't match their slot are not bounded at all.
+    bool bounded = max_len != TFJSON_LEN_UNBOUNDED && count == slot_count;
 
-            debugf("next() / refilled -> \"%.*s\"\n", (int)refilled_len, buf + idx_nul);
+    if (count > slot_count)
+        count = slot_count;
 
-            idx_nul += refilled_len;
-        }
-        else if (refill_handler(nullptr, 0) > 0) {
-            // the buffer is full with undone input and there is more input. the current
-            // element has to fit into the buffer. if there is more input after the
-            // current element then there has to be at least one char more than the current
-            // element in the buffer for the parser to be able to tell that the current
-            // element has ended
-            reportError(Error::ElementTooLong);
-            return false;
+    for (size_t i = 0; i < count; ++i) {
+        if (values[i].type == Type::String)
+            values[i].len = strlen(values[i].s);
+
+        if (!tfjson_template_convert(values[i], slots[i].type)) {
+            bounded = false;
+            continue;
         }
-    }
 
-    if (idx_cur + 1 >= idx_nul) {
-        idx_cur = idx_nul;
-        cur = '\0';
+        if (values[i].type == Type::String)
+            bounded = bounded && 2 + 6 * values[i].len <= slots[i].max_len;
     }
-    else {
-        ++idx_cur;
-        cur = buf[idx_cur];
 
-        if (cur == '\0') {
-            okay(-1);
+#if TFJSON_GATHER
+    // With gather output, the slow path references long strings instead of copying them.
+    bounded = bounded && json.iov == nullptr;
+#endif
 
-            reportError(Error::InlineNullByte);
-            return false;
+    // Each slot's max_len bounds everything its formatter writes, so the whole payload fits without further checks.
+
+    if (bounded && !json.measuring() && json.reserve(max_len)) {
+        char *head = json.head;
+        size_t offset = 0;
+
+        for (size_t i = 0; i < count; ++i) {
+            const Value &value = values[i];
+
+            memcpy(head, constant + offset, slots[i].offset - offset);
+            head += slots[i].offset - offset;
+            offset = slots[i].offset;
+
+            switch (value.type) {
+                case Type::Uint64:
+                case Type::Uint32:
+                case Type::Uint16:
+                case Type::Uint8:   head += tfjson_format_number(head, value.u); break;
+                case Type::Int64:
+                case Type::Int32:
+                case Type::Int16:
+                case Type::Int8:    head += tfjson_format_number(head, value.i); break;
+                case Type::Double:  head += tfjson_format_number(head, value.d); break;
+                case Type::Float:   head += tfjson_format_number(head, value.f); break;
+
+                case Type::Boolean:
+                    if (value.b) {
+                        memcpy(head, "true", 4);
+                        head += 4;
+                    }
+                    else {
+                        memcpy(head, "false", 5);
+                        head += 5;
+                    }
+
+                    break;
+
+                case Type::String:
+                    *head++ = '"';
+                    head += tfjson_write_escaped(head, value.s, value.len);
+                    *head++ = '"';
+                    break;
+            }
         }
+
+        memcpy(head, constant + offset, constant_len - offset);
+        head += constant_len - offset;
+
+        json.buf_required += (size_t)(head - json.head);
+        json.head = head;
+        return;
     }
 
-    debugf("next() -> idx_cur: %zd, utf8_count: %zu, cur: '%c' [0x%02x]\n", idx_cur, utf8_count, cur, (uint8_t)cur);
+    size_t offset = 0;
 
-    if (utf8_count > 0) {
-        if (((uint8_t)cur & 0xC0) != 0x80) {
-            okay(-1);
+    for (size_t i = 0; i < slot_count; ++i) {
+        json.writePlain(constant + offset, slots[i].offset - offset);
+        offset = slots[i].offset;
 
-            reportError(Error::InvalidUTF8ContinuationByte);
-            return false;
+        // The constant bytes already contain the comma or key.
+        json.in_empty_container = true;
+
+        if (i >= count) {
+            json.addNull();
+            continue;
         }
 
-        --utf8_count;
+        const Value &value = values[i];
+
+        switch (value.type) {
+            case Type::Uint64:
+            case Type::Uint32:
+            case Type::Uint16:
+            case Type::Uint8:   json.addNumber(value.u); break;
+            case Type::Int64:
+            case Type::Int32:
+            case Type::Int16:
+            case Type::Int8:    json.addNumber(value.i); break;
+            case Type::Double:  json.addNumber(value.d); break;
+            case Type::Float:   json.addNumber(value.f); break;
+            case Type::Boolean: json.addBoolean(value.b); break;
+            case Type::String:  json.addString(value.s, value.len); break;
+        }
     }
-    else {
-        utf8_count = count_leading_ones_intrinsic(cur);
 
-        if (utf8_count != 0 && (utf8_count < 2 || utf8_count > 4)) {
-            okay(-1);
+    json.writePlain(constant + offset, constant_len - offset);
+    json.in_empty_container = false;
+}
 
-            reportError(Error::InvalidUTF8StartByte);
-            return false;
-        }
+// FNV-1a
+static uint64_t tfjson_hash(uint64_t h, const void *data, size_t len) {
+    const uint8_t *p = (const uint8_t *)data;
 
-        if (utf8_count > 0) {
-            --utf8_count;
-        }
+    for (size_t i = 0; i < len; ++i) {
+        h ^= p[i];
+        h *= 0x100000001B3ull;
     }
 
-    return true;
+    return h;
 }
 
-void TFJsonDeserializer::okay(ssize_t offset) {
-    idx_okay = idx_cur + offset;
+#define TFJSON_HASH_SEED 0xCBF29CE484222325ull
 
-    debugf("okay(offset: %zd) -> idx_okay: %zd\n", offset, idx_okay);
+// Value hashes start with a type tag, so that e.g. false and 0 differ.
+enum class TFJsonDeltaTag : uint8_t {
+    Number,
+    Boolean,
+    Null,
+    String,
+    Array,
+    Object,
+};
+
+static uint64_t tfjson_hash_tag(TFJsonDeltaTag tag) {
+    return tfjson_hash(TFJSON_HASH_SEED, &tag, sizeof(tag));
 }
 
-void TFJsonDeserializer::done() {
-    idx_done = idx_okay;
+TFJsonDeltaSerializer::TFJsonDeltaSerializer(size_t member_count_max, size_t nesting_depth_max) : nesting_depth_max(nesting_depth_max) {
+    // Keep the load factor <= 0.5 so that probe sequences stay short.
+    size_t entry_count = 1;
+
+    while (entry_count < member_count_max * 2)
+        entry_count *= 2;
 
-    debugf("done() -> idx_done: %zd\n", idx_done);
+    entries = (Entry *)calloc(entry_count, sizeof(Entry));
+    entry_mask = entries != nullptr ? entry_count - 1 : 0;
+    levels = (Level *)malloc((nesting_depth_max + 1) * sizeof(Level));
 }
 
-bool TFJsonDeserializer::enterNesting() {
-    if (nesting_depth >= nesting_depth_max) {
-        reportError(Error::NestingTooDeep);
-        return false;
+TFJsonDeltaSerializer::~TFJsonDeltaSerializer() {
+    free(entries);
+    free(levels);
+}
+
+void TFJsonDeltaSerializer::begin(TFJsonSerializer &json_) {
+    json = &json_;
+    nesting_depth = 0;
+    untracked_depth = 0;
+
+    // Without levels, the patch is emitted like an object past nesting_depth_max.
+    if (levels == nullptr) {
+        json->addObject();
+        untracked_depth = 1;
+        return;
     }
 
-    ++nesting_depth;
+    levels[0].path = TFJSON_HASH_SEED;
+    levels[0].key = TFJsonKey{nullptr, 0};
+    levels[0].opened = false;
+    levels[0].emit_all = false;
+}
 
-    return true;
+void TFJsonDeltaSerializer::addMemberNumber(TFJsonKey key, uint64_t u) { this->addMemberScalar(key, u); }
+void TFJsonDeltaSerializer::addMemberNumber(TFJsonKey key, int64_t i) { this->addMemberScalar(key, i); }
+void TFJsonDeltaSerializer::addMemberNumber(TFJsonKey key, uint32_t u) { this->addMemberScalar(key, u); }
+void TFJsonDeltaSerializer::addMemberNumber(TFJsonKey key, int32_t i) { this->addMemberScalar(key, i); }
+void TFJsonDeltaSerializer::addMemberNumber(TFJsonKey key, uint16_t u) { this->addMemberScalar(key, u); }
+void TFJsonDeltaSerializer::addMemberNumber(TFJsonKey key, int16_t i) { this->addMemberScalar(key, i); }
+void TFJsonDeltaSerializer::addMemberNumber(TFJsonKey key, uint8_t u) { this->addMemberScalar(key, u); }
+void TFJsonDeltaSerializer::addMemberNumber(TFJsonKey key, int8_t i) { this->addMemberScalar(key, i); }
+void TFJsonDeltaSerializer::addMemberNumber(TFJsonKey key, double f) { this->addMemberScalar(key, f); }
+void TFJsonDeltaSerializer::addMemberNumber(TFJsonKey key, float f) { this->addMemberScalar(key, f); }
+
+void TFJsonDeltaSerializer::addMemberBoolean(TFJsonKey key, bool b) {
+    if (this->enterMember(key, tfjson_hash(tfjson_hash_tag(TFJsonDeltaTag::Boolean), &b, sizeof(b))))
+        json->addMemberBoolean(key, b);
 }
 
-void TFJsonDeserializer::leaveNesting() {
-    assert(nesting_depth > 0);
+void TFJsonDeltaSerializer::addMemberNull(TFJsonKey key) {
+    if (this->enterMember(key, tfjson_hash_tag(TFJsonDeltaTag::Null)))
+        json->addMemberNull(key);
+}
 
-    --nesting_depth;
+void TFJsonDeltaSerializer::addMemberString(TFJsonKey key, const char *c) {
+    if (this->enterMember(key, tfjson_hash(tfjson_hash_tag(TFJsonDeltaTag::String), c, strlen(c))))
+        json->addMemberString(key, c);
 }
 
-bool TFJsonDeserializer::isWhitespace() {
-    switch (cur) {
-        case ' ':
-        case '\r':
-        case '\n':
-        case '\t':
+void TFJsonDeltaSerializer::addMemberNumberArray(TFJsonKey key, const uint64_t *u, size_t count) { this->addMemberArrayOf(key, u, count); }
+void TFJsonDeltaSerializer::addMemberNumberArray(TFJsonKey key, const int64_t *i, size_t count) { this->addMemberArrayOf(key, i, count); }
+void TFJsonDeltaSerializer::addMemberNumberArray(TFJsonKey key, const uint32_t *u, size_t count) { this->addMemberArrayOf(key, u, count); }
+void TFJsonDeltaSerializer::addMemberNumberArray(TFJsonKey key, const int32_t *i, size_t count) { this->addMemberArrayOf(key, i, count); }
+void TFJsonDeltaSerializer::addMemberNumberArray(TFJsonKey key, const uint16_t *u, size_t count) { this->addMemberArrayOf(key, u, count); }
+void TFJsonDeltaSerializer::addMemberNumberArray(TFJsonKey key, const int16_t *i, size_t count) { this->addMemberArrayOf(key, i, count); }
+void TFJsonDeltaSerializer::addMemberNumberArray(TFJsonKey key, const uint8_t *u, size_t count) { this->addMemberArrayOf(key, u, count); }
+void TFJsonDeltaSerializer::addMemberNumberArray(TFJsonKey key, const int8_t *i, size_t count) { this->addMemberArrayOf(key, i, count); }
+void TFJsonDeltaSerializer::addMemberNumberArray(TFJsonKey key, const double *f, size_t count) { this->addMemberArrayOf(key, f, count); }
+void TFJsonDeltaSerializer::addMemberNumberArray(TFJsonKey key, const float *f, size_t count) { this->addMemberArrayOf(key, f, count); }
+
+void TFJsonDeltaSerializer::addMemberStringArray(TFJsonKey key, const char *const *c, size_t count) {
+    uint64_t value = tfjson_hash_tag(TFJsonDeltaTag::Array);
+
+    for (size_t i = 0; i < count; ++i) {
+        size_t len = strlen(c[i]);
+
+        // Hash the lengths too, so that moving chars between strings is a change.
+        value = tfjson_hash(value, &len, sizeof(len));
+        value = tfjson_hash(value, c[i], len);
+    }
+
+    if (this->enterMember(key, value))
+        json->addMemberStringArray(key, c, count);
+}
+
+void TFJsonDeltaSerializer::addMemberArray(TFJsonKey key, const std::function<void(TFJsonSerializer &)> &add_elements) {
+    uint64_t value = tfjson_hash_tag(TFJsonDeltaTag::Array);
+    char scratch[64];
+
+    {
+        // Hash the serialized elements chunk by chunk instead of buffering them.
+        TFJsonSerializer sink{scratch, sizeof(scratch)};
+
+        sink.setFlushHandler([&value](const char *c, size_t len) {
+            value = tfjson_hash(value, c, len);
             return true;
+        });
 
-        default:
-            return false;
+        add_elements(sink);
+        sink.end();
     }
+
+    if (!this->enterMember(key, value))
+        return;
+
+    json->addMemberArray(key);
+    add_elements(*json);
+    json->endArray();
 }
 
-bool TFJsonDeserializer::isDigit() {
-    return cur >= '0' && cur <= '9';
+void TFJsonDeltaSerializer::addMemberObject(TFJsonKey key) {
+    if (untracked_depth > 0 || nesting_depth >= nesting_depth_max) {
+        if (untracked_depth == 0)
+            this->openLevels();
+
+        json->addMemberObject(key);
+        ++untracked_depth;
+        return;
+    }
+
+    uint64_t path = this->memberPath(key);
+    Level &parent = levels[nesting_depth];
+    Level &level = levels[++nesting_depth];
+
+    level.path = path;
+    level.key = key;
+    level.opened = false;
+    // Also true if the object replaced a value of another type. The client has to get all members then.
+    level.emit_all = this->changed(level.path, tfjson_hash_tag(TFJsonDeltaTag::Object)) || parent.emit_all;
+
+    // A new object has to show up even if it is empty.
+    if (level.emit_all)
+        this->openLevels();
 }
 
-bool TFJsonDeserializer::isHexDigit() {
-    return isDigit() || (cur >= 'a' && cur <= 'f') || (cur >= 'A' && cur <= 'F');
+void TFJsonDeltaSerializer::endObject() {
+    if (untracked_depth > (levels == nullptr ? 1 : 0)) {
+        json->endObject();
+        --untracked_depth;
+        return;
+    }
+
+    assert(nesting_depth > 0);
+
+    if (levels[nesting_depth].opened)
+        json->endObject();
+
+    --nesting_depth;
 }
 
-bool TFJsonDeserializer::isControl() {
-    return isctrl(cur);
+size_t TFJsonDeltaSerializer::end() {
+    assert(nesting_depth == 0 && untracked_depth == (levels == nullptr ? 1 : 0));
+
+    if (levels == nullptr || levels[0].opened)
+        json->endObject();
+
+    size_t result = json->end();
+
+    json = nullptr;
+
+    return result;
 }
 
-bool TFJsonDeserializer::skipWhitespace() {
-    while (isWhitespace()) {
-        debugf("skipWhitespace(cur: '%c' [0x%02x])\n", cur, (uint8_t)cur);
+void TFJsonDeltaSerializer::reset() {
+    if (entries != nullptr)
+        memset(entries, 0, (entry_mask + 1) * sizeof(Entry));
+}
 
-        okay();
-        done();
+// Hashes the key without the quotes and colon of pre-escaped keys and the length of the key in front of it, so that "a" + "bc"
+// and "ab" + "c" are different paths.
+uint64_t TFJsonDeltaSerializer::memberPath(TFJsonKey key) const {
+    const char *c = key.key;
+    size_t len = key.len == TFJSON_USE_STRLEN ? strlen(c) : key.len;
 
-        if (!next()) {
-            return false;
-        }
+    if (key.escaped) {
+        c += 1;
+        len -= 3;
     }
 
-    return true;
+    uint64_t path = tfjson_hash(levels[nesting_depth].path, &len, sizeof(len));
+
+    return tfjson_hash(path, c, len);
 }
 
-bool TFJsonDeserializer::parseElements() {
-    if (!parseElement()) {
-        return false;
-    }
+// Stores value for path. Returns true if it differs from the previously stored value or if the table is full.
+bool TFJsonDeltaSerializer::changed(uint64_t path, uint64_t value) {
+    if (entries == nullptr)
+        return true;
 
-    while (cur == ',') {
-        okay();
-        done();
+    if (path == 0)
+        path = 1;
 
-        if (!next()) {
-            return false;
+    for (size_t i = 0; i <= entry_mask; ++i) {
+        Entry &entry = entries[(path + i) & entry_mask];
+
+        if (entry.path == 0) {
+            entry.path = path;
+            entry.value = value;
+            return true;
         }
 
-        if (!parseElement()) {
-            return false;
+        if (entry.path == path) {
+            bool result = entry.value != value;
+
+            entry.value = value;
+            return result;
         }
     }
 
     return true;
 }
 
-bool TFJsonDeserializer::parseElement() {
-    if (!skipWhitespace()) {
-        return false;
-    }
-
-    if (!parseValue()) {
-        return false;
-    }
+// Returns true if the member has to be emitted. The enclosing objects are opened then.
+bool TFJsonDeltaSerializer::enterMember(TFJsonKey key, uint64_t value) {
+    // The enclosing objects are already open.
+    if (untracked_depth > 0)
+        return true;
 
-    if (!skipWhitespace()) {
+    if (!this->changed(this->memberPath(key), value) && !levels[nesting_depth].emit_all)
         return false;
-    }
 
+    this->openLevels();
     return true;
 }
 
-bool TFJsonDeserializer::parseValue() {
-    switch (cur) {
-        case '{':
-            return parseObject();
-
-        case '[':
-            return parseArray();
+void TFJsonDeltaSerializer::openLevels() {
+    for (size_t i = 0; i <= nesting_depth; ++i) {
+        if (levels[i].opened)
+            continue;
 
-        case '"':
-            return parseString(false);
+        if (i == 0)
+            json->addObject();
+        else
+            json->addMemberObject(levels[i].key);
 
-        case '-':
-        case '0':
-        case '1':
-        case '2':
-        case '3':
-        case '4':
-        case '5':
-        case '6':
-        case '7':
-        case '8':
-        case '9':
-            return parseNumber();
+        levels[i].opened = true;
+    }
+}
 
-        case 'n':
-            return parseNull();
+template<typename T>
+void TFJsonDeltaSerializer::addMemberScalar(TFJsonKey key, T value) {
+    if (this->enterMember(key, tfjson_hash(tfjson_hash_tag(TFJsonDeltaTag::Number), &value, sizeof(value))))
+        json->addMemberNumber(key, value);
+}
 
-        case 't':
-            return parseTrue();
+template<typename T>
+void TFJsonDeltaSerializer::addMemberArrayOf(TFJsonKey key, const T *values, size_t count) {
+    uint64_t value = tfjson_hash_tag(TFJsonDeltaTag::Array);
 
-        case 'f':
-            return parseFalse();
+    value = tfjson_hash(value, &count, sizeof(count));
+    value = tfjson_hash(value, values, count * sizeof(T));
 
-        default:
-            reportError(Error::ExpectingValue);
-            return false;
-    }
+    if (this->enterMember(key, value))
+        json->addMemberNumberArray(key, values, count);
 }
 
-bool TFJsonDeserializer::parseObject() {
-    if (cur != '{') {
-        reportError(Error::ExpectingOpeningCurlyBracket);
-        return false;
-    }
+// Truncated 128 bit approximations of 5^q for q = -342 ... 308, normalized so that the most significant bit is set.
+// Generated by dividing or multiplying 5^|q| with a power of two: 2^b / 5^-q + 1 for q < 0, 5^q shifted into place otherwise.
+static const uint64_t tfjson_pow5_128[651 * 2] = {
+    0xeef453d6923bd65a, 0x113faa2906a13b3f, 0x9558b4661b6565f8, 0x4ac7ca59a424c507,
+    0xbaaee17fa23ebf76, 0x5d79bcf00d2df649, 0xe95a99df8ace6f53, 0xf4d82c2c107973dc,
+    0x91d8a02bb6c10594, 0x79071b9b8a4be869, 0xb64ec836a47146f9, 0x9748e2826cdee284,
+    0xe3e27a444d8d98b7, 0xfd1b1b2308169b25, 0x8e6d8c6ab0787f72, 0xfe30f0f5e50e20f7,
+    0xb208ef855c969f4f, 0xbdbd2d335e51a935, 0xde8b2b66b3bc4723, 0xad2c788035e61382,
+    0x8b16fb203055ac76, 0x4c3bcb5021afcc31, 0xaddcb9e83c6b1793, 0xdf4abe242a1bbf3d,
+    0xd953e8624b85dd78, 0xd71d6dad34a2af0d, 0x87d4713d6f33aa6b, 0x8672648c40e5ad68,
+    0xa9c98d8ccb009506, 0x680efdaf511f18c2, 0xd43bf0effdc0ba48, 0x0212bd1b2566def2,
+    0x84a57695fe98746d, 0x014bb630f7604b57, 0xa5ced43b7e3e9188, 0x419ea3bd35385e2d,
+    0xcf42894a5dce35ea, 0x52064cac828675b9, 0x818995ce7aa0e1b2, 0x7343efebd1940993,
+    0xa1ebfb4219491a1f, 0x1014ebe6c5f90bf8, 0xca66fa129f9b60a6, 0xd41a26e077774ef6,
+    0xfd00b897478238d0, 0x8920b098955522b4, 0x9e20735e8cb16382, 0x55b46e5f5d5535b0,
+    0xc5a890362fddbc62, 0xeb2189f734aa831d, 0xf712b443bbd52b7b, 0xa5e9ec7501d523e4,
+    0x9a6bb0aa55653b2d, 0x47b233c92125366e, 0xc1069cd4eabe89f8, 0x999ec0bb696e840a,
+    0xf148440a256e2c76, 0xc00670ea43ca250d, 0x96cd2a865764dbca, 0x380406926a5e5728,
+    0xbc807527ed3e12bc, 0xc605083704f5ecf2, 0xeba09271e88d976b, 0xf7864a44c633682e,
+    0x93445b8731587ea3, 0x7ab3ee6afbe0211d, 0xb8157268fdae9e4c, 0x5960ea05bad82964,
+    0xe61acf033d1a45df, 0x6fb92487298e33bd, 0x8fd0c16206306bab, 0xa5d3b6d479f8e056,
+    0xb3c4f1ba87bc8696, 0x8f48a4899877186c, 0xe0b62e2929aba83c, 0x331acdabfe94de87,
+    0x8c71dcd9ba0b4925, 0x9ff0c08b7f1d0b14, 0xaf8e5410288e1b6f, 0x07ecf0ae5ee44dd9,
+    0xdb71e91432b1a24a, 0xc9e82cd9f69d6150, 0x892731ac9faf056e, 0xbe311c083a225cd2,
+    0xab70fe17c79ac6ca, 0x6dbd630a48aaf406, 0xd64d3d9db981787d, 0x092cbbccdad5b108,
+    0x85f0468293f0eb4e, 0x25bbf56008c58ea5, 0xa76c582338ed2621, 0xaf2af2b80af6f24e,
+    0xd1476e2c07286faa, 0x1af5af660db4aee1, 0x82cca4db847945ca, 0x50d98d9fc890ed4d,
+    0xa37fce126597973c, 0xe50ff107bab528a0, 0xcc5fc196fefd7d0c, 0x1e53ed49a96272c8,
+    0xff77b1fcbebcdc4f, 0x25e8e89c13bb0f7a, 0x9faacf3df73609b1, 0x77b191618c54e9ac,
+    0xc795830d75038c1d, 0xd59df5b9ef6a2417, 0xf97ae3d0d2446f25, 0x4b0573286b44ad1d,
+    0x9becce62836ac577, 0x4ee367f9430aec32, 0xc2e801fb244576d5, 0x229c41f793cda73f,
+    0xf3a20279ed56d48a, 0x6b43527578c1110f, 0x9845418c345644d6, 0x830a13896b78aaa9,
+    0xbe5691ef416bd60c, 0x23cc986bc656d553, 0xedec366b11c6cb8f, 0x2cbfbe86b7ec8aa8,
+    0x94b3a202eb1c3f39, 0x7bf7d71432f3d6a9, 0xb9e08a83a5e34f07, 0xdaf5ccd93fb0cc53,
+    0xe858ad248f5c22c9, 0xd1b3400f8f9cff68, 0x91376c36d99995be, 0x23100809b9c21fa1,
+    0xb58547448ffffb2d, 0xabd40a0c2832a78a, 0xe2e69915b3fff9f9, 0x16c90c8f323f516c,
+    0x8dd01fad907ffc3b, 0xae3da7d97f6792e3, 0xb1442798f49ffb4a, 0x99cd11cfdf41779c,
+    0xdd95317f31c7fa1d, 0x40405643d711d583, 0x8a7d3eef7f1cfc52, 0x482835ea666b2572,
+    0xad1c8eab5ee43b66, 0xda3243650005eecf, 0xd863b256369d4a40, 0x90bed43e40076a82,
+    0x873e4f75e2224e68, 0x5a7744a6e804a291, 0xa90de3535aaae202, 0x711515d0a205cb36,
+    0xd3515c2831559a83, 0x0d5a5b44ca873e03, 0x8412d9991ed58091, 0xe858790afe9486c2,
+    0xa5178fff668ae0b6, 0x626e974dbe39a872, 0xce5d73ff402d98e3, 0xfb0a3d212dc8128f,
+    0x80fa687f881c7f8e, 0x7ce66634bc9d0b99, 0xa139029f6a239f72, 0x1c1fffc1ebc44e80,
+    0xc987434744ac874e, 0xa327ffb266b56220, 0xfbe9141915d7a922, 0x4bf1ff9f0062baa8,
+    0x9d71ac8fada6c9b5, 0x6f773fc3603db4a9, 0xc4ce17b399107c22, 0xcb550fb4384d21d3,
+    0xf6019da07f549b2b, 0x7e2a53a146606a48, 0x99c102844f94e0fb, 0x2eda7444cbfc426d,
+    0xc0314325637a1939, 0xfa911155fefb5308, 0xf03d93eebc589f88, 0x793555ab7eba27ca,
+    0x96267c7535b763b5, 0x4bc1558b2f3458de, 0xbbb01b9283253ca2, 0x9eb1aaedfb016f16,
+    0xea9c227723ee8bcb, 0x465e15a979c1cadc, 0x92a1958a7675175f, 0x0bfacd89ec191ec9,
+    0xb749faed14125d36, 0xcef980ec671f667b, 0xe51c79a85916f484, 0x82b7e12780e7401a,
+    0x8f31cc0937ae58d2, 0xd1b2ecb8b0908810, 0xb2fe3f0b8599ef07, 0x861fa7e6dcb4aa15,
+    0xdfbdcece67006ac9, 0x67a791e093e1d49a, 0x8bd6a141006042bd, 0xe0c8bb2c5c6d24e0,
+    0xaecc49914078536d, 0x58fae9f773886e18, 0xda7f5bf590966848, 0xaf39a475506a899e,
+    0x888f99797a5e012d, 0x6d8406c952429603, 0xaab37fd7d8f58178, 0xc8e5087ba6d33b83,
+    0xd5605fcdcf32e1d6, 0xfb1e4a9a90880a64, 0x855c3be0a17fcd26, 0x5cf2eea09a55067f,
+    0xa6b34ad8c9dfc06f, 0xf42faa48c0ea481e, 0xd0601d8efc57b08b, 0xf13b94daf124da26,
+    0x823c12795db6ce57, 0x76c53d08d6b70858, 0xa2cb1717b52481ed, 0x54768c4b0c64ca6e,
+    0xcb7ddcdda26da268, 0xa9942f5dcf7dfd09, 0xfe5d54150b090b02, 0xd3f93b35435d7c4c,
+    0x9efa548d26e5a6e1, 0xc47bc5014a1a6daf, 0xc6b8e9b0709f109a, 0x359ab6419ca1091b,
+    0xf867241c8cc6d4c0, 0xc30163d203c94b62, 0x9b407691d7fc44f8, 0x79e0de63425dcf1d,
+    0xc21094364dfb5636, 0x985915fc12f542e4, 0xf294b943e17a2bc4, 0x3e6f5b7b17b2939d,
+    0x979cf3ca6cec5b5a, 0xa705992ceecf9c42, 0xbd8430bd08277231, 0x50c6ff782a838353,
+    0xece53cec4a314ebd, 0xa4f8bf5635246428, 0x940f4613ae5ed136, 0x871b7795e136be99,
+    0xb913179899f68584, 0x28e2557b59846e3f, 0xe757dd7ec07426e5, 0x331aeada2fe589cf,
+    0x9096ea6f3848984f, 0x3ff0d2c85def7621, 0xb4bca50b065abe63, 0x0fed077a756b53a9,
+    0xe1ebce4dc7f16dfb, 0xd3e8495912c62894, 0x8d3360f09cf6e4bd, 0x64712dd7abbbd95c,
+    0xb080392cc4349dec, 0xbd8d794d96aacfb3, 0xdca04777f541c567, 0xecf0d7a0fc5583a0,
+    0x89e42caaf9491b60, 0xf41686c49db57244, 0xac5d37d5b79b6239, 0x311c2875c522ced5,
+    0xd77485cb25823ac7, 0x7d633293366b828b, 0x86a8d39ef77164bc, 0xae5dff9c02033197,
+    0xa8530886b54dbdeb, 0xd9f57f830283fdfc, 0xd267caa862a12d66, 0xd072df63c324fd7b,
+    0x8380dea93da4bc60, 0x4247cb9e59f71e6d, 0xa46116538d0deb78, 0x52d9be85f074e608,
+    0xcd795be870516656, 0x67902e276c921f8b, 0x806bd9714632dff6, 0x00ba1cd8a3db53b6,
+    0xa086cfcd97bf97f3, 0x80e8a40eccd228a4, 0xc8a883c0fdaf7df0, 0x6122cd128006b2cd,
+    0xfad2a4b13d1b5d6c, 0x796b805720085f81, 0x9cc3a6eec6311a63, 0xcbe3303674053bb0,
+    0xc3f490aa77bd60fc, 0xbedbfc4411068a9c, 0xf4f1b4d515acb93b, 0xee92fb5515482d44,
+    0x991711052d8bf3c5, 0x751bdd152d4d1c4a, 0xbf5cd54678eef0b6, 0xd262d45a78a0635d,
+    0xef340a98172aace4, 0x86fb897116c87c34, 0x9580869f0e7aac0e, 0xd45d35e6ae3d4da0,
+    0xbae0a846d2195712, 0x8974836059cca109, 0xe998d258869facd7, 0x2bd1a438703fc94b,
+    0x91ff83775423cc06, 0x7b6306a34627ddcf, 0xb67f6455292cbf08, 0x1a3bc84c17b1d542,
+    0xe41f3d6a7377eeca, 0x20caba5f1d9e4a93, 0x8e938662882af53e, 0x547eb47b7282ee9c,
+    0xb23867fb2a35b28d, 0xe99e619a4f23aa43, 0xdec681f9f4c31f31, 0x6405fa00e2ec94d4,
+    0x8b3c113c38f9f37e, 0xde83bc408dd3dd04, 0xae0b158b4738705e, 0x9624ab50b148d445,
+    0xd98ddaee19068c76, 0x3badd624dd9b0957, 0x87f8a8d4cfa417c9, 0xe54ca5d70a80e5d6,
+    0xa9f6d30a038d1dbc, 0x5e9fcf4ccd211f4c, 0xd47487cc8470652b, 0x7647c3200069671f,
+    0x84c8d4dfd2c63f3b, 0x29ecd9f40041e073, 0xa5fb0a17c777cf09, 0xf468107100525890,
+    0xcf79cc9db955c2cc, 0x7182148d4066eeb4, 0x81ac1fe293d599bf, 0xc6f14cd848405530,
+    0xa21727db38cb002f, 0xb8ada00e5a506a7c, 0xca9cf1d206fdc03b, 0xa6d90811f0e4851c,
+    0xfd442e4688bd304a, 0x908f4a166d1da663, 0x9e4a9cec15763e2e, 0x9a598e4e043287fe,
+    0xc5dd44271ad3cdba, 0x40eff1e1853f29fd, 0xf7549530e188c128, 0xd12bee59e68ef47c,
+    0x9a94dd3e8cf578b9, 0x82bb74f8301958ce, 0xc13a148e3032d6e7, 0xe36a52363c1faf01,
+    0xf18899b1bc3f8ca1, 0xdc44e6c3cb279ac1, 0x96f5600f15a7b7e5, 0x29ab103a5ef8c0b9,
+    0xbcb2b812db11a5de, 0x7415d448f6b6f0e7, 0xebdf661791d60f56, 0x111b495b3464ad21,
+    0x936b9fcebb25c995, 0xcab10dd900beec34, 0xb84687c269ef3bfb, 0x3d5d514f40eea742,
+    0xe65829b3046b0afa, 0x0cb4a5a3112a5112, 0x8ff71a0fe2c2e6dc, 0x47f0e785eaba72ab,
+    0xb3f4e093db73a093, 0x59ed216765690f56, 0xe0f218b8d25088b8, 0x306869c13ec3532c,
+    0x8c974f7383725573, 0x1e414218c73a13fb, 0xafbd2350644eeacf, 0xe5d1929ef90898fa,
+    0xdbac6c247d62a583, 0xdf45f746b74abf39, 0x894bc396ce5da772, 0x6b8bba8c328eb783,
+    0xab9eb47c81f5114f, 0x066ea92f3f326564, 0xd686619ba27255a2, 0xc80a537b0efefebd,
+    0x8613fd0145877585, 0xbd06742ce95f5f36, 0xa798fc4196e952e7, 0x2c48113823b73704,
+    0xd17f3b51fca3a7a0, 0xf75a15862ca504c5, 0x82ef85133de648c4, 0x9a984d73dbe722fb,
+    0xa3ab66580d5fdaf5, 0xc13e60d0d2e0ebba, 0xcc963fee10b7d1b3, 0x318df905079926a8,
+    0xffbbcfe994e5c61f, 0xfdf17746497f7052, 0x9fd561f1fd0f9bd3, 0xfeb6ea8bedefa633,
+    0xc7caba6e7c5382c8, 0xfe64a52ee96b8fc0, 0xf9bd690a1b68637b, 0x3dfdce7aa3c673b0,
+    0x9c1661a651213e2d, 0x06bea10ca65c084e, 0xc31bfa0fe5698db8, 0x486e494fcff30a62,
+    0xf3e2f893dec3f126, 0x5a89dba3c3efccfa, 0x986ddb5c6b3a76b7, 0xf89629465a75e01c,
+    0xbe89523386091465, 0xf6bbb397f1135823, 0xee2ba6c0678b597f, 0x746aa07ded582e2c,
+    0x94db483840b717ef, 0xa8c2a44eb4571cdc, 0xba121a4650e4ddeb, 0x92f34d62616ce413,
+    0xe896a0d7e51e1566, 0x77b020baf9c81d17, 0x915e2486ef32cd60, 0x0ace1474dc1d122e,
+    0xb5b5ada8aaff80b8, 0x0d819992132456ba, 0xe3231912d5bf60e6, 0x10e1fff697ed6c69,
+    0x8df5efabc5979c8f, 0xca8d3ffa1ef463c1, 0xb1736b96b6fd83b3, 0xbd308ff8a6b17cb2,
+    0xddd0467c64bce4a0, 0xac7cb3f6d05ddbde, 0x8aa22c0dbef60ee4, 0x6bcdf07a423aa96b,
+    0xad4ab7112eb3929d, 0x86c16c98d2c953c6, 0xd89d64d57a607744, 0xe871c7bf077ba8b7,
+    0x87625f056c7c4a8b, 0x11471cd764ad4972, 0xa93af6c6c79b5d2d, 0xd598e40d3dd89bcf,
+    0xd389b47879823479, 0x4aff1d108d4ec2c3, 0x843610cb4bf160cb, 0xcedf722a585139ba,
+    0xa54394fe1eedb8fe, 0xc2974eb4ee658828, 0xce947a3da6a9273e, 0x733d226229feea32,
+    0x811ccc668829b887, 0x0806357d5a3f525f, 0xa163ff802a3426a8, 0xca07c2dcb0cf26f7,
+    0xc9bcff6034c13052, 0xfc89b393dd02f0b5, 0xfc2c3f3841f17c67, 0xbbac2078d443ace2,
+    0x9d9ba7832936edc0, 0xd54b944b84aa4c0d, 0xc5029163f384a931, 0x0a9e795e65d4df11,
+    0xf64335bcf065d37d, 0x4d4617b5ff4a16d5, 0x99ea0196163fa42e, 0x504bced1bf8e4e45,
+    0xc06481fb9bcf8d39, 0xe45ec2862f71e1d6, 0xf07da27a82c37088, 0x5d767327bb4e5a4c,
+    0x964e858c91ba2655, 0x3a6a07f8d510f86f, 0xbbe226efb628afea, 0x890489f70a55368b,
+    0xeadab0aba3b2dbe5, 0x2b45ac74ccea842e, 0x92c8ae6b464fc96f, 0x3b0b8bc90012929d,
+    0xb77ada0617e3bbcb, 0x09ce6ebb40173744, 0xe55990879ddcaabd, 0xcc420a6a101d0515,
+    0x8f57fa54c2a9eab6, 0x9fa946824a12232d, 0xb32df8e9f3546564, 0x47939822dc96abf9,
+    0xdff9772470297ebd, 0x59787e2b93bc56f7, 0x8bfbea76c619ef36, 0x57eb4edb3c55b65a,
+    0xaefae51477a06b03, 0xede622920b6b23f1, 0xdab99e59958885c4, 0xe95fab368e45eced,
+    0x88b402f7fd75539b, 0x11dbcb0218ebb414, 0xaae103b5fcd2a881, 0xd652bdc29f26a119,
+    0xd59944a37c0752a2, 0x4be76d3346f0495f, 0x857fcae62d8493a5, 0x6f70a4400c562ddb,
+    0xa6dfbd9fb8e5b88e, 0xcb4ccd500f6bb952, 0xd097ad07a71f26b2, 0x7e2000a41346a7a7,
+    0x825ecc24c873782f, 0x8ed400668c0c28c8, 0xa2f67f2dfa90563b, 0x728900802f0f32fa,
+    0xcbb41ef979346bca, 0x4f2b40a03ad2ffb9, 0xfea126b7d78186bc, 0xe2f610c84987bfa8,
+    0x9f24b832e6b0f436, 0x0dd9ca7d2df4d7c9, 0xc6ede63fa05d3143, 0x91503d1c79720dbb,
+    0xf8a95fcf88747d94, 0x75a44c6397ce912a, 0x9b69dbe1b548ce7c, 0xc986afbe3ee11aba,
+    0xc24452da229b021b, 0xfbe85badce996168, 0xf2d56790ab41c2a2, 0xfae27299423fb9c3,
+    0x97c560ba6b0919a5, 0xdccd879fc967d41a, 0xbdb6b8e905cb600f, 0x5400e987bbc1c920,
+    0xed246723473e3813, 0x290123e9aab23b68, 0x9436c0760c86e30b, 0xf9a0b6720aaf6521,
+    0xb94470938fa89bce, 0xf808e40e8d5b3e69, 0xe7958cb87392c2c2, 0xb60b1d1230b20e04,
+    0x90bd77f3483bb9b9, 0xb1c6f22b5e6f48c2, 0xb4ecd5f01a4aa828, 0x1e38aeb6360b1af3,
+    0xe2280b6c20dd5232, 0x25c6da63c38de1b0, 0x8d590723948a535f, 0x579c487e5a38ad0e,
+    0xb0af48ec79ace837, 0x2d835a9df0c6d851, 0xdcdb1b2798182244, 0xf8e431456cf88e65,
+    0x8a08f0f8bf0f156b, 0x1b8e9ecb641b58ff, 0xac8b2d36eed2dac5, 0xe272467e3d222f3f,
+    0xd7adf884aa879177, 0x5b0ed81dcc6abb0f, 0x86ccbb52ea94baea, 0x98e947129fc2b4e9,
+    0xa87fea27a539e9a5, 0x3f2398d747b36224, 0xd29fe4b18e88640e, 0x8eec7f0d19a03aad,
+    0x83a3eeeef9153e89, 0x1953cf68300424ac, 0xa48ceaaab75a8e2b, 0x5fa8c3423c052dd7,
+    0xcdb02555653131b6, 0x3792f412cb06794d, 0x808e17555f3ebf11, 0xe2bbd88bbee40bd0,
+    0xa0b19d2ab70e6ed6, 0x5b6aceaeae9d0ec4, 0xc8de047564d20a8b, 0xf245825a5a445275,
+    0xfb158592be068d2e, 0xeed6e2f0f0d56712, 0x9ced737bb6c4183d, 0x55464dd69685606b,
+    0xc428d05aa4751e4c, 0xaa97e14c3c26b886, 0xf53304714d9265df, 0xd53dd99f4b3066a8,
+    0x993fe2c6d07b7fab, 0xe546a8038efe4029, 0xbf8fdb78849a5f96, 0xde98520472bdd033,
+    0xef73d256a5c0f77c, 0x963e66858f6d4440, 0x95a8637627989aad, 0xdde7001379a44aa8,
+    0xbb127c53b17ec159, 0x5560c018580d5d52, 0xe9d71b689dde71af, 0xaab8f01e6e10b4a6,
+    0x9226712162ab070d, 0xcab3961304ca70e8, 0xb6b00d69bb55c8d1, 0x3d607b97c5fd0d22,
+    0xe45c10c42a2b3b05, 0x8cb89a7db77c506a, 0x8eb98a7a9a5b04e3, 0x77f3608e92adb242,
+    0xb267ed1940f1c61c, 0x55f038b237591ed3, 0xdf01e85f912e37a3, 0x6b6c46dec52f6688,
+    0x8b61313bbabce2c6, 0x2323ac4b3b3da015, 0xae397d8aa96c1b77, 0xabec975e0a0d081a,
+    0xd9c7dced53c72255, 0x96e7bd358c904a21, 0x881cea14545c7575, 0x7e50d64177da2e54,
+    0xaa242499697392d2, 0xdde50bd1d5d0b9e9, 0xd4ad2dbfc3d07787, 0x955e4ec64b44e864,
+    0x84ec3c97da624ab4, 0xbd5af13bef0b113e, 0xa6274bbdd0fadd61, 0xecb1ad8aeacdd58e,
+    0xcfb11ead453994ba, 0x67de18eda5814af2, 0x81ceb32c4b43fcf4, 0x80eacf948770ced7,
+    0xa2425ff75e14fc31, 0xa1258379a94d028d, 0xcad2f7f5359a3b3e, 0x096ee45813a04330,
+    0xfd87b5f28300ca0d, 0x8bca9d6e188853fc, 0x9e74d1b791e07e48, 0x775ea264cf55347e,
+    0xc612062576589dda, 0x95364afe032a819e, 0xf79687aed3eec551, 0x3a83ddbd83f52205,
+    0x9abe14cd44753b52, 0xc4926a9672793543, 0xc16d9a0095928a27, 0x75b7053c0f178294,
+    0xf1c90080baf72cb1, 0x5324c68b12dd6339, 0x971da05074da7bee, 0xd3f6fc16ebca5e04,
+    0xbce5086492111aea, 0x88f4bb1ca6bcf585, 0xec1e4a7db69561a5, 0x2b31e9e3d06c32e6,
+    0x9392ee8e921d5d07, 0x3aff322e62439fd0, 0xb877aa3236a4b449, 0x09befeb9fad487c3,
+    0xe69594bec44de15b, 0x4c2ebe687989a9b4, 0x901d7cf73ab0acd9, 0x0f9d37014bf60a11,
+    0xb424dc35095cd80f, 0x538484c19ef38c95, 0xe12e13424bb40e13, 0x2865a5f206b06fba,
+    0x8cbccc096f5088cb, 0xf93f87b7442e45d4, 0xafebff0bcb24aafe, 0xf78f69a51539d749,
+    0xdbe6fecebdedd5be, 0xb573440e5a884d1c, 0x89705f4136b4a597, 0x31680a88f8953031,
+    0xabcc77118461cefc, 0xfdc20d2b36ba7c3e, 0xd6bf94d5e57a42bc, 0x3d32907604691b4d,
+    0x8637bd05af6c69b5, 0xa63f9a49c2c1b110, 0xa7c5ac471b478423, 0x0fcf80dc33721d54,
+    0xd1b71758e219652b, 0xd3c36113404ea4a9, 0x83126e978d4fdf3b, 0x645a1cac083126ea,
+    0xa3d70a3d70a3d70a, 0x3d70a3d70a3d70a4, 0xcccccccccccccccc, 0xcccccccccccccccd,
+    0x8000000000000000, 0x0000000000000000, 0xa000000000000000, 0x0000000000000000,
+    0xc800000000000000, 0x0000000000000000, 0xfa00000000000000, 0x0000000000000000,
+    0x9c40000000000000, 0x0000000000000000, 0xc350000000000000, 0x0000000000000000,
+    0xf424000000000000, 0x0000000000000000, 0x9896800000000000, 0x0000000000000000,
+    0xbebc200000000000, 0x0000000000000000, 0xee6b280000000000, 0x0000000000000000,
+    0x9502f90000000000, 0x0000000000000000, 0xba43b74000000000, 0x0000000000000000,
+    0xe8d4a51000000000, 0x0000000000000000, 0x9184e72a00000000, 0x0000000000000000,
+    0xb5e620f480000000, 0x0000000000000000, 0xe35fa931a0000000, 0x0000000000000000,
+    0x8e1bc9bf04000000, 0x0000000000000000, 0xb1a2bc2ec5000000, 0x0000000000000000,
+    0xde0b6b3a76400000, 0x0000000000000000, 0x8ac7230489e80000, 0x0000000000000000,
+    0xad78ebc5ac620000, 0x0000000000000000, 0xd8d726b7177a8000, 0x0000000000000000,
+    0x878678326eac9000, 0x0000000000000000, 0xa968163f0a57b400, 0x0000000000000000,
+    0xd3c21bcecceda100, 0x0000000000000000, 0x84595161401484a0, 0x0000000000000000,
+    0xa56fa5b99019a5c8, 0x0000000000000000, 0xcecb8f27f4200f3a, 0x0000000000000000,
+    0x813f3978f8940984, 0x4000000000000000, 0xa18f07d736b90be5, 0x5000000000000000,
+    0xc9f2c9cd04674ede, 0xa400000000000000, 0xfc6f7c4045812296, 0x4d00000000000000,
+    0x9dc5ada82b70b59d, 0xf020000000000000, 0xc5371912364ce305, 0x6c28000000000000,
+    0xf684df56c3e01bc6, 0xc732000000000000, 0x9a130b963a6c115c, 0x3c7f400000000000,
+    0xc097ce7bc90715b3, 0x4b9f100000000000, 0xf0bdc21abb48db20, 0x1e86d40000000000,
+    0x96769950b50d88f4, 0x1314448000000000, 0xbc143fa4e250eb31, 0x17d955a000000000,
+    0xeb194f8e1ae525fd, 0x5dcfab0800000000, 0x92efd1b8d0cf37be, 0x5aa1cae500000000,
+    0xb7abc627050305ad, 0xf14a3d9e40000000, 0xe596b7b0c643c719, 0x6d9ccd05d0000000,
+    0x8f7e32ce7bea5c6f, 0xe4820023a2000000, 0xb35dbf821ae4f38b, 0xdda2802c8a800000,
+    0xe0352f62a19e306e, 0xd50b2037ad200000, 0x8c213d9da502de45, 0x4526f422cc340000,
+    0xaf298d050e4395d6, 0x9670b12b7f410000, 0xdaf3f04651d47b4c, 0x3c0cdd765f114000,
+    0x88d8762bf324cd0f, 0xa5880a69fb6ac800, 0xab0e93b6efee0053, 0x8eea0d047a457a00,
+    0xd5d238a4abe98068, 0x72a4904598d6d880, 0x85a36366eb71f041, 0x47a6da2b7f864750,
+    0xa70c3c40a64e6c51, 0x999090b65f67d924, 0xd0cf4b50cfe20765, 0xfff4b4e3f741cf6d,
+    0x82818f1281ed449f, 0xbff8f10e7a8921a4, 0xa321f2d7226895c7, 0xaff72d52192b6a0d,
+    0xcbea6f8ceb02bb39, 0x9bf4f8a69f764490, 0xfee50b7025c36a08, 0x02f236d04753d5b4,
+    0x9f4f2726179a2245, 0x01d762422c946590, 0xc722f0ef9d80aad6, 0x424d3ad2b7b97ef5,
+    0xf8ebad2b84e0d58b, 0xd2e0898765a7deb2, 0x9b934c3b330c8577, 0x63cc55f49f88eb2f,
+    0xc2781f49ffcfa6d5, 0x3cbf6b71c76b25fb, 0xf316271c7fc3908a, 0x8bef464e3945ef7a,
+    0x97edd871cfda3a56, 0x97758bf0e3cbb5ac, 0xbde94e8e43d0c8ec, 0x3d52eeed1cbea317,
+    0xed63a231d4c4fb27, 0x4ca7aaa863ee4bdd, 0x945e455f24fb1cf8, 0x8fe8caa93e74ef6a,
+    0xb975d6b6ee39e436, 0xb3e2fd538e122b44, 0xe7d34c64a9c85d44, 0x60dbbca87196b616,
+    0x90e40fbeea1d3a4a, 0xbc8955e946fe31cd, 0xb51d13aea4a488dd, 0x6babab6398bdbe41,
+    0xe264589a4dcdab14, 0xc696963c7eed2dd1, 0x8d7eb76070a08aec, 0xfc1e1de5cf543ca2,
+    0xb0de65388cc8ada8, 0x3b25a55f43294bcb, 0xdd15fe86affad912, 0x49ef0eb713f39ebe,
+    0x8a2dbf142dfcc7ab, 0x6e3569326c784337, 0xacb92ed9397bf996, 0x49c2c37f07965404,
+    0xd7e77a8f87daf7fb, 0xdc33745ec97be906, 0x86f0ac99b4e8dafd, 0x69a028bb3ded71a3,
+    0xa8acd7c0222311bc, 0xc40832ea0d68ce0c, 0xd2d80db02aabd62b, 0xf50a3fa490c30190,
+    0x83c7088e1aab65db, 0x792667c6da79e0fa, 0xa4b8cab1a1563f52, 0x577001b891185938,
+    0xcde6fd5e09abcf26, 0xed4c0226b55e6f86, 0x80b05e5ac60b6178, 0x544f8158315b05b4,
+    0xa0dc75f1778e39d6, 0x696361ae3db1c721, 0xc913936dd571c84c, 0x03bc3a19cd1e38e9,
+    0xfb5878494ace3a5f, 0x04ab48a04065c723, 0x9d174b2dcec0e47b, 0x62eb0d64283f9c76,
+    0xc45d1df942711d9a, 0x3ba5d0bd324f8394, 0xf5746577930d6500, 0xca8f44ec7ee36479,
+    0x9968bf6abbe85f20, 0x7e998b13cf4e1ecb, 0xbfc2ef456ae276e8, 0x9e3fedd8c321a67e,
+    0xefb3ab16c59b14a2, 0xc5cfe94ef3ea101e, 0x95d04aee3b80ece5, 0xbba1f1d158724a12,
+    0xbb445da9ca61281f, 0x2a8a6e45ae8edc97, 0xea1575143cf97226, 0xf52d09d71a3293bd,
+    0x924d692ca61be758, 0x593c2626705f9c56, 0xb6e0c377cfa2e12e, 0x6f8b2fb00c77836c,
+    0xe498f455c38b997a, 0x0b6dfb9c0f956447, 0x8edf98b59a373fec, 0x4724bd4189bd5eac,
+    0xb2977ee300c50fe7, 0x58edec91ec2cb657, 0xdf3d5e9bc0f653e1, 0x2f2967b66737e3ed,
+    0x8b865b215899f46c, 0xbd79e0d20082ee74, 0xae67f1e9aec07187, 0xecd8590680a3aa11,
+    0xda01ee641a708de9, 0xe80e6f4820cc9495, 0x884134fe908658b2, 0x3109058d147fdcdd,
+    0xaa51823e34a7eede, 0xbd4b46f0599fd415, 0xd4e5e2cdc1d1ea96, 0x6c9e18ac7007c91a,
+    0x850fadc09923329e, 0x03e2cf6bc604ddb0, 0xa6539930bf6bff45, 0x84db8346b786151c,
+    0xcfe87f7cef46ff16, 0xe612641865679a63, 0x81f14fae158c5f6e, 0x4fcb7e8f3f60c07e,
+    0xa26da3999aef7749, 0xe3be5e330f38f09d, 0xcb090c8001ab551c, 0x5cadf5bfd3072cc5,
+    0xfdcb4fa002162a63, 0x73d9732fc7c8f7f6, 0x9e9f11c4014dda7e, 0x2867e7fddcdd9afa,
+    0xc646d63501a1511d, 0xb281e1fd541501b8, 0xf7d88bc24209a565, 0x1f225a7ca91a4226,
+    0x9ae757596946075f, 0x3375788de9b06958, 0xc1a12d2fc3978937, 0x0052d6b1641c83ae,
+    0xf209787bb47d6b84, 0xc0678c5dbd23a49a, 0x9745eb4d50ce6332, 0xf840b7ba963646e0,
+    0xbd176620a501fbff, 0xb650e5a93bc3d898, 0xec5d3fa8ce427aff, 0xa3e51f138ab4cebe,
+    0x93ba47c980e98cdf, 0xc66f336c36b10137, 0xb8a8d9bbe123f017, 0xb80b0047445d4184,
+    0xe6d3102ad96cec1d, 0xa60dc059157491e5, 0x9043ea1ac7e41392, 0x87c89837ad68db2f,
+    0xb454e4a179dd1877, 0x29babe4598c311fb, 0xe16a1dc9d8545e94, 0xf4296dd6fef3d67a,
+    0x8ce2529e2734bb1d, 0x1899e4a65f58660c, 0xb01ae745b101e9e4, 0x5ec05dcff72e7f8f,
+    0xdc21a1171d42645d, 0x76707543f4fa1f73, 0x899504ae72497eba, 0x6a06494a791c53a8,
+    0xabfa45da0edbde69, 0x0487db9d17636892, 0xd6f8d7509292d603, 0x45a9d2845d3c42b6,
+    0x865b86925b9bc5c2, 0x0b8a2392ba45a9b2, 0xa7f26836f282b732, 0x8e6cac7768d7141e,
+    0xd1ef0244af2364ff, 0x3207d795430cd926, 0x8335616aed761f1f, 0x7f44e6bd49e807b8,
+    0xa402b9c5a8d3a6e7, 0x5f16206c9c6209a6, 0xcd036837130890a1, 0x36dba887c37a8c0f,
+    0x802221226be55a64, 0xc2494954da2c9789, 0xa02aa96b06deb0fd, 0xf2db9baa10b7bd6c,
+    0xc83553c5c8965d3d, 0x6f92829494e5acc7, 0xfa42a8b73abbf48c, 0xcb772339ba1f17f9,
+    0x9c69a97284b578d7, 0xff2a760414536efb, 0xc38413cf25e2d70d, 0xfef5138519684aba,
+    0xf46518c2ef5b8cd1, 0x7eb258665fc25d69, 0x98bf2f79d5993802, 0xef2f773ffbd97a61,
+    0xbeeefb584aff8603, 0xaafb550ffacfd8fa, 0xeeaaba2e5dbf6784, 0x95ba2a53f983cf38,
+    0x952ab45cfa97a0b2, 0xdd945a747bf26183, 0xba756174393d88df, 0x94f971119aeef9e4,
+    0xe912b9d1478ceb17, 0x7a37cd5601aab85d, 0x91abb422ccb812ee, 0xac62e055c10ab33a,
+    0xb616a12b7fe617aa, 0x577b986b314d6009, 0xe39c49765fdf9d94, 0xed5a7e85fda0b80b,
+    0x8e41ade9fbebc27d, 0x14588f13be847307, 0xb1d219647ae6b31c, 0x596eb2d8ae258fc8,
+    0xde469fbd99a05fe3, 0x6fca5f8ed9aef3bb, 0x8aec23d680043bee, 0x25de7bb9480d5854,
+    0xada72ccc20054ae9, 0xaf561aa79a10ae6a, 0xd910f7ff28069da4, 0x1b2ba1518094da04,
+    0x87aa9aff79042286, 0x90fb44d2f05d0842, 0xa99541bf57452b28, 0x353a1607ac744a53,
+    0xd3fa922f2d1675f2, 0x42889b8997915ce8, 0x847c9b5d7c2e09b7, 0x69956135febada11,
+    0xa59bc234db398c25, 0x43fab9837e699095, 0xcf02b2c21207ef2e, 0x94f967e45e03f4bb,
+    0x8161afb94b44f57d, 0x1d1be0eebac278f5, 0xa1ba1ba79e1632dc, 0x6462d92a69731732,
+    0xca28a291859bbf93, 0x7d7b8f7503cfdcfe, 0xfcb2cb35e702af78, 0x5cda735244c3d43e,
+    0x9defbf01b061adab, 0x3a0888136afa64a7, 0xc56baec21c7a1916, 0x088aaa1845b8fdd0,
+    0xf6c69a72a3989f5b, 0x8aad549e57273d45, 0x9a3c2087a63f6399, 0x36ac54e2f678864b,
+    0xc0cb28a98fcf3c7f, 0x84576a1bb416a7dd, 0xf0fdf2d3f3c30b9f, 0x656d44a2a11c51d5,
+    0x969eb7c47859e743, 0x9f644ae5a4b1b325, 0xbc4665b596706114, 0x873d5d9f0dde1fee,
+    0xeb57ff22fc0c7959, 0xa90cb506d155a7ea, 0x9316ff75dd87cbd8, 0x09a7f12442d588f2,
+    0xb7dcbf5354e9bece, 0x0c11ed6d538aeb2f, 0xe5d3ef282a242e81, 0x8f1668c8a86da5fa,
+    0x8fa475791a569d10, 0xf96e017d694487bc, 0xb38d92d760ec4455, 0x37c981dcc395a9ac,
+    0xe070f78d3927556a, 0x85bbe253f47b1417, 0x8c469ab843b89562, 0x93956d7478ccec8e,
+    0xaf58416654a6babb, 0x387ac8d1970027b2, 0xdb2e51bfe9d0696a, 0x06997b05fcc0319e,
+    0x88fcf317f22241e2, 0x441fece3bdf81f03, 0xab3c2fddeeaad25a, 0xd527e81cad7626c3,
+    0xd60b3bd56a5586f1, 0x8a71e223d8d3b074, 0x85c7056562757456, 0xf6872d5667844e49,
+    0xa738c6bebb12d16c, 0xb428f8ac016561db, 0xd106f86e69d785c7, 0xe13336d701beba52,
+    0x82a45b450226b39c, 0xecc0024661173473, 0xa34d721642b06084, 0x27f002d7f95d0190,
+    0xcc20ce9bd35c78a5, 0x31ec038df7b441f4, 0xff290242c83396ce, 0x7e67047175a15271,
+    0x9f79a169bd203e41, 0x0f0062c6e984d386, 0xc75809c42c684dd1, 0x52c07b78a3e60868,
+    0xf92e0c3537826145, 0xa7709a56ccdf8a82, 0x9bbcc7a142b17ccb, 0x88a66076400bb691,
+    0xc2abf989935ddbfe, 0x6acff893d00ea435, 0xf356f7ebf83552fe, 0x0583f6b8c4124d43,
+    0x98165af37b2153de, 0xc3727a337a8b704a, 0xbe1bf1b059e9a8d6, 0x744f18c0592e4c5c,
+    0xeda2ee1c7064130c, 0x1162def06f79df73, 0x9485d4d1c63e8be7, 0x8addcb5645ac2ba8,
+    0xb9a74a0637ce2ee1, 0x6d953e2bd7173692, 0xe8111c87c5c1ba99, 0xc8fa8db6ccdd0437,
+    0x910ab1d4db9914a0, 0x1d9c9892400a22a2, 0xb54d5e4a127f59c8, 0x2503beb6d00cab4b,
+    0xe2a0b5dc971f303a, 0x2e44ae64840fd61d, 0x8da471a9de737e24, 0x5ceaecfed289e5d2,
+    0xb10d8e1456105dad, 0x7425a83e872c5f47, 0xdd50f1996b947518, 0xd12f124e28f77719,
+    0x8a5296ffe33cc92f, 0x82bd6b70d99aaa6f, 0xace73cbfdc0bfb7b, 0x636cc64d1001550b,
+    0xd8210befd30efa5a, 0x3c47f7e05401aa4e, 0x8714a775e3e95c78, 0x65acfaec34810a71,
+    0xa8d9d1535ce3b396, 0x7f1839a741a14d0d, 0xd31045a8341ca07c, 0x1ede48111209a050,
+    0x83ea2b892091e44d, 0x934aed0aab460432, 0xa4e4b66b68b65d60, 0xf81da84d5617853f,
+    0xce1de40642e3f4b9, 0x36251260ab9d668e, 0x80d2ae83e9ce78f3, 0xc1d72b7c6b426019,
+    0xa1075a24e4421730, 0xb24cf65b8612f81f, 0xc94930ae1d529cfc, 0xdee033f26797b627,
+    0xfb9b7cd9a4a7443c, 0x169840ef017da3b1, 0x9d412e0806e88aa5, 0x8e1f289560ee864e,
+    0xc491798a08a2ad4e, 0xf1a6f2bab92a27e2, 0xf5b5d7ec8acb58a2, 0xae10af696774b1db,
+    0x9991a6f3d6bf1765, 0xacca6da1e0a8ef29, 0xbff610b0cc6edd3f, 0x17fd090a58d32af3,
+    0xeff394dcff8a948e, 0xddfc4b4cef07f5b0, 0x95f83d0a1fb69cd9, 0x4abdaf101564f98e,
+    0xbb764c4ca7a4440f, 0x9d6d1ad41abe37f1, 0xea53df5fd18d5513, 0x84c86189216dc5ed,
+    0x92746b9be2f8552c, 0x32fd3cf5b4e49bb4, 0xb7118682dbb66a77, 0x3fbc8c33221dc2a1,
+    0xe4d5e82392a40515, 0x0fabaf3feaa5334a, 0x8f05b1163ba6832d, 0x29cb4d87f2a7400e,
+    0xb2c71d5bca9023f8, 0x743e20e9ef511012, 0xdf78e4b2bd342cf6, 0x914da9246b255416,
+    0x8bab8eefb6409c1a, 0x1ad089b6c2f7548e, 0xae9672aba3d0c320, 0xa184ac2473b529b1,
+    0xda3c0f568cc4f3e8, 0xc9e5d72d90a2741e, 0x8865899617fb1871, 0x7e2fa67c7a658892,
+    0xaa7eebfb9df9de8d, 0xddbb901b98feeab7, 0xd51ea6fa85785631, 0x552a74227f3ea565,
+    0x8533285c936b35de, 0xd53a88958f87275f, 0xa67ff273b8460356, 0x8a892abaf368f137,
+    0xd01fef10a657842c, 0x2d2b7569b0432d85, 0x8213f56a67f6b29b, 0x9c3b29620e29fc73,
+    0xa298f2c501f45f42, 0x8349f3ba91b47b8f, 0xcb3f2f7642717713, 0x241c70a936219a73,
+    0xfe0efb53d30dd4d7, 0xed238cd383aa0110, 0x9ec95d1463e8a506, 0xf4363804324a40aa,
+    0xc67bb4597ce2ce48, 0xb143c6053edcd0d5, 0xf81aa16fdc1b81da, 0xdd94b7868e94050a,
+    0x9b10a4e5e9913128, 0xca7cf2b4191c8326, 0xc1d4ce1f63f57d72, 0xfd1c2f611f63a3f0,
+    0xf24a01a73cf2dccf, 0xbc633b39673c8cec, 0x976e41088617ca01, 0xd5be0503e085d813,
+    0xbd49d14aa79dbc82, 0x4b2d8644d8a74e18, 0xec9c459d51852ba2, 0xddf8e7d60ed1219e,
+    0x93e1ab8252f33b45, 0xcabb90e5c942b503, 0xb8da1662e7b00a17, 0x3d6a751f3b936243,
+    0xe7109bfba19c0c9d, 0x0cc512670a783ad4, 0x906a617d450187e2, 0x27fb2b80668b24c5,
+    0xb484f9dc9641e9da, 0xb1f9f660802dedf6, 0xe1a63853bbd26451, 0x5e7873f8a0396973,
+    0x8d07e33455637eb2, 0xdb0b487b6423e1e8, 0xb049dc016abc5e5f, 0x91ce1a9a3d2cda62,
+    0xdc5c5301c56b75f7, 0x7641a140cc7810fb, 0x89b9b3e11b6329ba, 0xa9e904c87fcb0a9d,
+    0xac2820d9623bf429, 0x546345fa9fbdcd44, 0xd732290fbacaf133, 0xa97c177947ad4095,
+    0x867f59a9d4bed6c0, 0x49ed8eabcccc485d, 0xa81f301449ee8c70, 0x5c68f256bfff5a74,
+    0xd226fc195c6a2f8c, 0x73832eec6fff3111, 0x83585d8fd9c25db7, 0xc831fd53c5ff7eab,
+    0xa42e74f3d032f525, 0xba3e7ca8b77f5e55, 0xcd3a1230c43fb26f, 0x28ce1bd2e55f35eb,
+    0x80444b5e7aa7cf85, 0x7980d163cf5b81b3, 0xa0555e361951c366, 0xd7e105bcc332621f,
+    0xc86ab5c39fa63440, 0x8dd9472bf3fefaa7, 0xfa856334878fc150, 0xb14f98f6f0feb951,
+    0x9c935e00d4b9d8d2, 0x6ed1bf9a569f33d3, 0xc3b8358109e84f07, 0x0a862f80ec4700c8,
+    0xf4a642e14c6262c8, 0xcd27bb612758c0fa, 0x98e7e9cccfbd7dbd, 0x8038d51cb897789c,
+    0xbf21e44003acdd2c, 0xe0470a63e6bd56c3, 0xeeea5d5004981478, 0x1858ccfce06cac74,
+    0x95527a5202df0ccb, 0x0f37801e0c43ebc8, 0xbaa718e68396cffd, 0xd30560258f54e6ba,
+    0xe950df20247c83fd, 0x47c6b82ef32a2069, 0x91d28b7416cdd27e, 0x4cdc331d57fa5441,
+    0xb6472e511c81471d, 0xe0133fe4adf8e952, 0xe3d8f9e563a198e5, 0x58180fddd97723a6,
+    0x8e679c2f5e44ff8f, 0x570f09eaa7ea7648
+};
 
-    okay();
-    done();
+static const double tfjson_pow10_exact[23] = {
+    1e0, 1e1, 1e2, 1e3, 1e4, 1e5, 1e6, 1e7, 1e8, 1e9, 1e10, 1e11,
+    1e12, 1e13, 1e14, 1e15, 1e16, 1e17, 1e18, 1e19, 1e20, 1e21, 1e22,
+};
 
-    if (!enterNesting()) {
-        return false;
-    }
+#if defined(__SIZEOF_INT128__)
+// __extension__ keeps -Wpedantic quiet about the non-standard type.
+__extension__ typedef unsigned __int128 tfjson_u128;
+#endif
 
-    if (object_begin_handler && !object_begin_handler()) {
-        reportError(Error::Aborted);
-        return false;
-    }
+// Returns the low half of the 128 bit product x * y and stores the high half in high.
+static uint64_t tfjson_mul_128(uint64_t x, uint64_t y, uint64_t *high) {
+#if defined(__SIZEOF_INT128__)
+    tfjson_u128 product = (tfjson_u128)x * y;
 
-    if (!next()) {
-        return false;
-    }
+    *high = (uint64_t)(product >> 64);
 
-    if (!skipWhitespace()) {
-        return false;
-    }
+    return (uint64_t)product;
+#else
+    uint64_t x_lo = x & 0xFFFFFFFFu;
+    uint64_t x_hi = x >> 32;
+    uint64_t y_lo = y & 0xFFFFFFFFu;
+    uint64_t y_hi = y >> 32;
 
-    if (cur == '}') {
-        okay();
-        done();
+    uint64_t p0 = x_lo * y_lo;
+    uint64_t p1 = x_lo * y_hi;
+    uint64_t p2 = x_hi * y_lo;
+    uint64_t p3 = x_hi * y_hi;
 
-        if (object_end_handler && !object_end_handler()) {
-            reportError(Error::Aborted);
-            return false;
-        }
+    uint64_t middle = (p0 >> 32) + (p1 & 0xFFFFFFFFu) + (p2 & 0xFFFFFFFFu);
 
-        leaveNesting();
+    *high = p3 + (p1 >> 32) + (p2 >> 32) + (middle >> 32);
 
-        if (!next()) {
-            return false;
-        }
+    return (middle << 32) | (p0 & 0xFFFFFFFFu);
+#endif
+}
 
-        return true;
-    }
+// IEEE 754 double as biased binary exponent and mantissa without the hidden bit.
+struct tfjson_binary64 {
+    uint64_t mantissa;
+    int32_t power2;
 
-    if (!parseMembers()) {
-        return false;
+    bool operator!=(const tfjson_binary64 &other) const { return mantissa != other.mantissa || power2 != other.power2; }
+};
+
+// Eisel-Lemire: Rounds w * 10^q to the nearest double, with w != 0. Multiplying the normalized w with the 128 bit
+// approximation of 5^q is always precise enough to round correctly, see Mushtak and Lemire, "Fast number parsing without fallback".
+static tfjson_binary64 tfjson_eisel_lemire(int64_t q, uint64_t w) {
+    if (q < -342) {
+        return {0, 0};
     }
 
-    if (cur != '}') {
-        reportError(Error::ExpectingClosingCurlyBracket);
-        return false;
+    if (q > 308) {
+        return {0, 0x7FF};
     }
 
-    okay();
-    done();
+    int lz = __builtin_clzll(w);
 
-    if (object_end_handler && !object_end_handler()) {
-        reportError(Error::Aborted);
-        return false;
-    }
+    w <<= lz;
 
-    leaveNesting();
+    size_t index = 2 * (size_t)(q + 342);
+    uint64_t high;
+    uint64_t low = tfjson_mul_128(w, tfjson_pow5_128[index], &high);
 
-    if (!next()) {
-        return false;
-    }
+    // 55 bits are needed: 53 for the mantissa, one to find the leading bit and one to round.
+    const uint64_t precision_mask = UINT64_MAX >> 55;
 
-    return true;
-}
+    if ((high & precision_mask) == precision_mask) {
+        uint64_t second_high;
 
-bool TFJsonDeserializer::parseMembers() {
-    if (!parseMember()) {
-        return false;
-    }
+        tfjson_mul_128(w, tfjson_pow5_128[index + 1], &second_high);
 
-    while (cur == ',') {
-        okay();
-        done();
+        low += second_high;
 
-        if (!next()) {
-            return false;
+        if (second_high > low) {
+            ++high;
         }
+    }
 
-        if (!parseMember()) {
-            return false;
+    int upper_bit = (int)(high >> 63);
+    int shift = upper_bit + 64 - 52 - 3;
+
+    tfjson_binary64 answer;
+
+    // ((152170 + 65536) * q) >> 16 is floor(q * log2(10)) for q in [-342, 308].
+    answer.mantissa = high >> shift;
+    answer.power2 = (int32_t)((((152170 + 65536) * q) >> 16) + 63 + upper_bit - lz + 1023);
+
+    if (answer.power2 <= 0) {
+        // subnormal
+        if (-answer.power2 + 1 >= 64) {
+            return {0, 0};
         }
-    }
 
-    return true;
-}
+        answer.mantissa >>= -answer.power2 + 1;
+        answer.mantissa += answer.mantissa & 1;
+        answer.mantissa >>= 1;
+        answer.power2 = answer.mantissa < (1ull << 52) ? 0 : 1;
 
-bool TFJsonDeserializer::parseMember() {
-    if (!skipWhitespace()) {
-        return false;
+        return answer;
     }
 
-    if (!parseString(true)) {
-        return false;
+    // The product is exact for small q. If it is exactly halfway between two doubles, round to even instead of up.
+    if (low <= 1 && q >= -4 && q <= 23 && (answer.mantissa & 3) == 1 && (answer.mantissa << shift) == high) {
+        answer.mantissa &= ~(uint64_t)1;
     }
 
-    if (!skipWhitespace()) {
-        return false;
-    }
+    answer.mantissa += answer.mantissa & 1;
+    answer.mantissa >>= 1;
 
-    if (cur != ':') {
-        reportError(Error::ExpectingColon);
-        return false;
+    if (answer.mantissa >= (2ull << 52)) {
+        answer.mantissa = 1ull << 52;
+        ++answer.power2;
     }
 
-    okay();
-    done();
+    answer.mantissa &= ~(1ull << 52);
 
-    if (!next()) {
-        return false;
+    if (answer.power2 >= 0x7FF) {
+        return {0, 0x7FF};
     }
 
-    return parseElement();
+    return answer;
 }
 
-bool TFJsonDeserializer::parseArray() {
-    if (cur != '[') {
-        reportError(Error::ExpectingOpeningSquareBracket);
-        return false;
+// Decimal with a fixed number of digits for the rare numbers that Eisel-Lemire can't round alone: More than 19 significant
+// digits that are close to halfway between two doubles. Simple decimal conversion as in Wuffs by Nigel Tao: The decimal is
+// shifted by powers of two into [1/2, 1) and then by the mantissa width. Digits past tfjson_decimal_digits_max only
+// set truncated, which is enough to round correctly.
+static const uint32_t tfjson_decimal_digits_max = 768;
+static const int32_t tfjson_decimal_point_range = 2047;
+
+struct tfjson_decimal {
+    uint32_t num_digits;
+    int32_t decimal_point; // value is 0.digits * 10^decimal_point
+    bool truncated;
+    uint8_t digits[tfjson_decimal_digits_max];
+};
+
+// Number of decimal digits that a left shift by shift adds, depending on whether the digits are less than those of 5^shift.
+// Entries are num_new_digits << 11 | offset of the digits of 5^shift in tfjson_left_shift_pow5_digits.
+static const uint16_t tfjson_left_shift_digits[65] = {
+    0x0000, 0x0800, 0x0801, 0x0803, 0x1006, 0x1009, 0x100D, 0x1812,
+    0x1817, 0x181D, 0x2024, 0x202B, 0x2033, 0x203C, 0x2846, 0x2850,
+    0x285B, 0x3067, 0x3073, 0x3080, 0x388E, 0x389C, 0x38AB, 0x38BB,
+    0x40CC, 0x40DD, 0x40EF, 0x4902, 0x4915, 0x4929, 0x513E, 0x5153,
+    0x5169, 0x5180, 0x5998, 0x59B0, 0x59C9, 0x61E3, 0x61FD, 0x6218,
+    0x6A34, 0x6A50, 0x6A6D, 0x6A8B, 0x72AA, 0x72C9, 0x72E9, 0x7B0A,
+    0x7B2B, 0x7B4D, 0x8370, 0x8393, 0x83B7, 0x83DC, 0x8C02, 0x8C28,
+    0x8C4F, 0x9477, 0x949F, 0x94C8, 0x9CF2, 0x051C, 0x051C, 0x051C,
+    0x051C
+};
+
+static const uint8_t tfjson_left_shift_pow5_digits[0x051C] = {
+    5, 2, 5, 1, 2, 5, 6, 2, 5, 3, 1, 2, 5, 1, 5, 6, 2, 5, 7, 8, 1, 2, 5, 3, 9, 0, 6, 2, 5, 1, 9, 5,
+    3, 1, 2, 5, 9, 7, 6, 5, 6, 2, 5, 4, 8, 8, 2, 8, 1, 2, 5, 2, 4, 4, 1, 4, 0, 6, 2, 5, 1, 2, 2, 0,
+    7, 0, 3, 1, 2, 5, 6, 1, 0, 3, 5, 1, 5, 6, 2, 5, 3, 0, 5, 1, 7, 5, 7, 8, 1, 2, 5, 1, 5, 2, 5, 8,
+    7, 8, 9, 0, 6, 2, 5, 7, 6, 2, 9, 3, 9, 4, 5, 3, 1, 2, 5, 3, 8, 1, 4, 6, 9, 7, 2, 6, 5, 6, 2, 5,
+    1, 9, 0, 7, 3, 4, 8, 6, 3, 2, 8, 1, 2, 5, 9, 5, 3, 6, 7, 4, 3, 1, 6, 4, 0, 6, 2, 5, 4, 7, 6, 8,
+    3, 7, 1, 5, 8, 2, 0, 3, 1, 2, 5, 2, 3, 8, 4, 1, 8, 5, 7, 9, 1, 0, 1, 5, 6, 2, 5, 1, 1, 9, 2, 0,
+    9, 2, 8, 9, 5, 5, 0, 7, 8, 1, 2, 5, 5, 9, 6, 0, 4, 6, 4, 4, 7, 7, 5, 3, 9, 0, 6, 2, 5, 2, 9, 8,
+    0, 2, 3, 2, 2, 3, 8, 7, 6, 9, 5, 3, 1, 2, 5, 1, 4, 9, 0, 1, 1, 6, 1, 1, 9, 3, 8, 4, 7, 6, 5, 6,
+    2, 5, 7, 4, 5, 0, 5, 8, 0, 5, 9, 6, 9, 2, 3, 8, 2, 8, 1, 2, 5, 3, 7, 2, 5, 2, 9, 0, 2, 9, 8, 4,
+    6, 1, 9, 1, 4, 0, 6, 2, 5, 1, 8, 6, 2, 6, 4, 5, 1, 4, 9, 2, 3, 0, 9, 5, 7, 0, 3, 1, 2, 5, 9, 3,
+    1, 3, 2, 2, 5, 7, 4, 6, 1, 5, 4, 7, 8, 5, 1, 5, 6, 2, 5, 4, 6, 5, 6, 6, 1, 2, 8, 7, 3, 0, 7, 7,
+    3, 9, 2, 5, 7, 8, 1, 2, 5, 2, 3, 2, 8, 3, 0, 6, 4, 3, 6, 5, 3, 8, 6, 9, 6, 2, 8, 9, 0, 6, 2, 5,
+    1, 1, 6, 4, 1, 5, 3, 2, 1, 8, 2, 6, 9, 3, 4, 8, 1, 4, 4, 5, 3, 1, 2, 5, 5, 8, 2, 0, 7, 6, 6, 0,
+    9, 1, 3, 4, 6, 7, 4, 0, 7, 2, 2, 6, 5, 6, 2, 5, 2, 9, 1, 0, 3, 8, 3, 0, 4, 5, 6, 7, 3, 3, 7, 0,
+    3, 6, 1, 3, 2, 8, 1, 2, 5, 1, 4, 5, 5, 1, 9, 1, 5, 2, 2, 8, 3, 6, 6, 8, 5, 1, 8, 0, 6, 6, 4, 0,
+    6, 2, 5, 7, 2, 7, 5, 9, 5, 7, 6, 1, 4, 1, 8, 3, 4, 2, 5, 9, 0, 3, 3, 2, 0, 3, 1, 2, 5, 3, 6, 3,
+    7, 9, 7, 8, 8, 0, 7, 0, 9, 1, 7, 1, 2, 9, 5, 1, 6, 6, 0, 1, 5, 6, 2, 5, 1, 8, 1, 8, 9, 8, 9, 4,
+    0, 3, 5, 4, 5, 8, 5, 6, 4, 7, 5, 8, 3, 0, 0, 7, 8, 1, 2, 5, 9, 0, 9, 4, 9, 4, 7, 0, 1, 7, 7, 2,
+    9, 2, 8, 2, 3, 7, 9, 1, 5, 0, 3, 9, 0, 6, 2, 5, 4, 5, 4, 7, 4, 7, 3, 5, 0, 8, 8, 6, 4, 6, 4, 1,
+    1, 8, 9, 5, 7, 5, 1, 9, 5, 3, 1, 2, 5, 2, 2, 7, 3, 7, 3, 6, 7, 5, 4, 4, 3, 2, 3, 2, 0, 5, 9, 4,
+    7, 8, 7, 5, 9, 7, 6, 5, 6, 2, 5, 1, 1, 3, 6, 8, 6, 8, 3, 7, 7, 2, 1, 6, 1, 6, 0, 2, 9, 7, 3, 9,
+    3, 7, 9, 8, 8, 2, 8, 1, 2, 5, 5, 6, 8, 4, 3, 4, 1, 8, 8, 6, 0, 8, 0, 8, 0, 1, 4, 8, 6, 9, 6, 8,
+    9, 9, 4, 1, 4, 0, 6, 2, 5, 2, 8, 4, 2, 1, 7, 0, 9, 4, 3, 0, 4, 0, 4, 0, 0, 7, 4, 3, 4, 8, 4, 4,
+    9, 7, 0, 7, 0, 3, 1, 2, 5, 1, 4, 2, 1, 0, 8, 5, 4, 7, 1, 5, 2, 0, 2, 0, 0, 3, 7, 1, 7, 4, 2, 2,
+    4, 8, 5, 3, 5, 1, 5, 6, 2, 5, 7, 1, 0, 5, 4, 2, 7, 3, 5, 7, 6, 0, 1, 0, 0, 1, 8, 5, 8, 7, 1, 1,
+    2, 4, 2, 6, 7, 5, 7, 8, 1, 2, 5, 3, 5, 5, 2, 7, 1, 3, 6, 7, 8, 8, 0, 0, 5, 0, 0, 9, 2, 9, 3, 5,
+    5, 6, 2, 1, 3, 3, 7, 8, 9, 0, 6, 2, 5, 1, 7, 7, 6, 3, 5, 6, 8, 3, 9, 4, 0, 0, 2, 5, 0, 4, 6, 4,
+    6, 7, 7, 8, 1, 0, 6, 6, 8, 9, 4, 5, 3, 1, 2, 5, 8, 8, 8, 1, 7, 8, 4, 1, 9, 7, 0, 0, 1, 2, 5, 2,
+    3, 2, 3, 3, 8, 9, 0, 5, 3, 3, 4, 4, 7, 2, 6, 5, 6, 2, 5, 4, 4, 4, 0, 8, 9, 2, 0, 9, 8, 5, 0, 0,
+    6, 2, 6, 1, 6, 1, 6, 9, 4, 5, 2, 6, 6, 7, 2, 3, 6, 3, 2, 8, 1, 2, 5, 2, 2, 2, 0, 4, 4, 6, 0, 4,
+    9, 2, 5, 0, 3, 1, 3, 0, 8, 0, 8, 4, 7, 2, 6, 3, 3, 3, 6, 1, 8, 1, 6, 4, 0, 6, 2, 5, 1, 1, 1, 0,
+    2, 2, 3, 0, 2, 4, 6, 2, 5, 1, 5, 6, 5, 4, 0, 4, 2, 3, 6, 3, 1, 6, 6, 8, 0, 9, 0, 8, 2, 0, 3, 1,
+    2, 5, 5, 5, 5, 1, 1, 1, 5, 1, 2, 3, 1, 2, 5, 7, 8, 2, 7, 0, 2, 1, 1, 8, 1, 5, 8, 3, 4, 0, 4, 5,
+    4, 1, 0, 1, 5, 6, 2, 5, 2, 7, 7, 5, 5, 5, 7, 5, 6, 1, 5, 6, 2, 8, 9, 1, 3, 5, 1, 0, 5, 9, 0, 7,
+    9, 1, 7, 0, 2, 2, 7, 0, 5, 0, 7, 8, 1, 2, 5, 1, 3, 8, 7, 7, 7, 8, 7, 8, 0, 7, 8, 1, 4, 4, 5, 6,
+    7, 5, 5, 2, 9, 5, 3, 9, 5, 8, 5, 1, 1, 3, 5, 2, 5, 3, 9, 0, 6, 2, 5, 6, 9, 3, 8, 8, 9, 3, 9, 0,
+    3, 9, 0, 7, 2, 2, 8, 3, 7, 7, 6, 4, 7, 6, 9, 7, 9, 2, 5, 5, 6, 7, 6, 2, 6, 9, 5, 3, 1, 2, 5, 3,
+    4, 6, 9, 4, 4, 6, 9, 5, 1, 9, 5, 3, 6, 1, 4, 1, 8, 8, 8, 2, 3, 8, 4, 8, 9, 6, 2, 7, 8, 3, 8, 1,
+    3, 4, 7, 6, 5, 6, 2, 5, 1, 7, 3, 4, 7, 2, 3, 4, 7, 5, 9, 7, 6, 8, 0, 7, 0, 9, 4, 4, 1, 1, 9, 2,
+    4, 4, 8, 1, 3, 9, 1, 9, 0, 6, 7, 3, 8, 2, 8, 1, 2, 5, 8, 6, 7, 3, 6, 1, 7, 3, 7, 9, 8, 8, 4, 0,
+    3, 5, 4, 7, 2, 0, 5, 9, 6, 2, 2, 4, 0, 6, 9, 5, 9, 5, 3, 3, 6, 9, 1, 4, 0, 6, 2, 5
+};
+
+static void tfjson_decimal_trim(tfjson_decimal *d) {
+    while (d->num_digits > 0 && d->digits[d->num_digits - 1] == 0) {
+        --d->num_digits;
     }
+}
 
-    okay();
-    done();
+static uint32_t tfjson_decimal_left_shift_digits(const tfjson_decimal *d, uint32_t shift) {
+    uint32_t a = tfjson_left_shift_digits[shift];
+    uint32_t b = tfjson_left_shift_digits[shift + 1];
+    uint32_t num_new_digits = a >> 11;
+    const uint8_t *pow5 = &tfjson_left_shift_pow5_digits[a & 0x7FF];
+    uint32_t pow5_len = (b & 0x7FF) - (a & 0x7FF);
 
-    if (!enterNesting()) {
-        return false;
+    for (uint32_t i = 0; i < pow5_len; ++i) {
+        if (i >= d->num_digits || d->digits[i] < pow5[i]) {
+            return num_new_digits - 1;
+        }
+
+        if (d->digits[i] > pow5[i]) {
+            return num_new_digits;
+        }
     }
 
-    if (array_begin_handler && !array_begin_handler()) {
-        reportError(Error::Aborted);
-        return false;
+    return num_new_digits;
+}
+
+// Multiplies d by 2^shift, shift <= 60.
+static void tfjson_decimal_left_shift(tfjson_decimal *d, uint32_t shift) {
+    if (d->num_digits == 0) {
+        return;
     }
 
-    if (!next()) {
-        return false;
+    uint32_t num_new_digits = tfjson_decimal_left_shift_digits(d, shift);
+    int32_t read_index = (int32_t)d->num_digits - 1;
+    uint32_t write_index = d->num_digits - 1 + num_new_digits;
+    uint64_t n = 0;
+
+    while (read_index >= 0 || n > 0) {
+        if (read_index >= 0) {
+            n += (uint64_t)d->digits[read_index--] << shift;
+        }
+
+        uint64_t quotient = n / 10;
+        uint64_t remainder = n - 10 * quotient;
+
+        if (write_index < tfjson_decimal_digits_max) {
+            d->digits[write_index] = (uint8_t)remainder;
+        }
+        else if (remainder > 0) {
+            d->truncated = true;
+        }
+
+        n = quotient;
+        --write_index;
     }
 
-    if (!skipWhitespace()) {
-        return false;
+    d->num_digits += num_new_digits;
+
+    if (d->num_digits > tfjson_decimal_digits_max) {
+        d->num_digits = tfjson_decimal_digits_max;
     }
 
-    if (cur == ']') {
-        okay();
-        done();
+    d->decimal_point += (int32_t)num_new_digits;
 
-        if (array_end_handler && !array_end_handler()) {
-            reportError(Error::Aborted);
-            return false;
-        }
+    tfjson_decimal_trim(d);
+}
 
-        leaveNesting();
+// Divides d by 2^shift, shift <= 60.
+static void tfjson_decimal_right_shift(tfjson_decimal *d, uint32_t shift) {
+    uint32_t read_index = 0;
+    uint32_t write_index = 0;
+    uint64_t n = 0;
 
-        if (!next()) {
-            return false;
+    while ((n >> shift) == 0) {
+        if (read_index < d->num_digits) {
+            n = 10 * n + d->digits[read_index++];
+        }
+        else if (n == 0) {
+            return;
         }
+        else {
+            while ((n >> shift) == 0) {
+                n = 10 * n;
+                ++read_index;
+            }
 
-        return true;
+            break;
+        }
     }
 
-    if (!parseElements()) {
-        return false;
-    }
+    d->decimal_point -= (int32_t)read_index - 1;
 
-    if (cur != ']') {
-        reportError(Error::ExpectingClosingSquareBracket);
-        return false;
+    if (d->decimal_point < -tfjson_decimal_point_range) {
+        d->num_digits = 0;
+        d->decimal_point = 0;
+        d->truncated = false;
+        return;
     }
 
-    okay();
-    done();
+    uint64_t mask = (1ull << shift) - 1;
 
-    if (array_end_handler && !array_end_handler()) {
-        reportError(Error::Aborted);
-        return false;
+    while (read_index < d->num_digits) {
+        uint8_t new_digit = (uint8_t)(n >> shift);
+
+        n = 10 * (n & mask) + d->digits[read_index++];
+        d->digits[write_index++] = new_digit;
     }
 
-    leaveNesting();
+    while (n > 0) {
+        uint8_t new_digit = (uint8_t)(n >> shift);
 
-    if (!next()) {
-        return false;
+        n = 10 * (n & mask);
+
+        if (write_index < tfjson_decimal_digits_max) {
+            d->digits[write_index++] = new_digit;
+        }
+        else if (new_digit > 0) {
+            d->truncated = true;
+        }
     }
 
-    return true;
+    d->num_digits = write_index;
+
+    tfjson_decimal_trim(d);
 }
 
-bool TFJsonDeserializer::parseString(bool report_as_member) {
-    if (cur != '"') {
-        reportError(Error::ExpectingOpeningQuote);
-        return false;
+// Integer part of d, rounded half to even.
+static uint64_t tfjson_decimal_round(const tfjson_decimal *d) {
+    if (d->num_digits == 0 || d->decimal_point < 0) {
+        return 0;
     }
 
-    okay();
-    done();
+    if (d->decimal_point > 18) {
+        return UINT64_MAX;
+    }
 
-    if (!next()) {
-        return false;
+    uint32_t point = (uint32_t)d->decimal_point;
+    uint64_t n = 0;
+
+    for (uint32_t i = 0; i < point; ++i) {
+        n = 10 * n + (i < d->num_digits ? d->digits[i] : 0);
     }
 
-    char *str = buf + idx_cur;
-    char *end = str;
-    size_t offset;
+    bool round_up = false;
 
-    while (cur != '"') {
-        if (cur == '\0') {
-            reportError(Error::ExpectingClosingQuote);
-            return false;
-        }
+    if (point < d->num_digits) {
+        round_up = d->digits[point] >= 5;
 
-        if (cur != '\\') {
-            if (isControl()) {
-                reportError(Error::UnescapedControlCharacter);
-                return false;
-            }
+        if (d->digits[point] == 5 && point + 1 == d->num_digits) {
+            round_up = d->truncated || (point > 0 && (d->digits[point - 1] & 1) != 0);
+        }
+    }
 
-            *end++ = cur;
+    return round_up ? n + 1 : n;
+}
 
-            okay();
+static void tfjson_decimal_parse(tfjson_decimal *d, const char *c, const char *end) {
+    d->num_digits = 0;
+    d->decimal_point = 0;
+    d->truncated = false;
 
-            if (!next(&offset)) {
-                return false;
-            }
+    if (c < end && *c == '-') {
+        ++c;
+    }
 
-            str -= offset;
-            end -= offset;
+    while (c < end && *c == '0') {
+        ++c;
+    }
 
-            continue;
-        }
+    uint32_t num_digits = 0; // including those that don't fit
 
-        if (!next(&offset)) {
-            return false;
+    while (c < end && *c >= '0' && *c <= '9') {
+        if (num_digits < tfjson_decimal_digits_max) {
+            d->digits[num_digits] = (uint8_t)(*c - '0');
         }
 
-        str -= offset;
-        end -= offset;
-
-        char unescaped = '\0';
+        ++num_digits;
+        ++c;
+    }
 
-        switch (cur) {
-            case '"':
-                unescaped = '"';
-                break;
+    if (c < end && *c == '.') {
+        ++c;
 
-            case '\\':
-                unescaped = '\\';
-                break;
+        const char *fraction = c;
 
-            case '/':
-                unescaped = '/';
-                break;
+        if (num_digits == 0) {
+            while (c < end && *c == '0') {
+                ++c;
+            }
+        }
 
-            case 'b':
-                unescaped = '\b';
-                break;
+        while (c < end && *c >= '0' && *c <= '9') {
+            if (num_digits < tfjson_decimal_digits_max) {
+                d->digits[num_digits] = (uint8_t)(*c - '0');
+            }
 
-            case 'f':
-                unescaped = '\f';
-                break;
+            ++num_digits;
+            ++c;
+        }
 
-            case 'n':
-                unescaped = '\n';
-                break;
+        d->decimal_point = (int32_t)(fraction - c);
+    }
 
-            case 'r':
-                unescaped = '\r';
-                break;
+    if (num_digits > 0) {
+        // Trailing zeros are not significant.
+        uint32_t trailing_zeros = 0;
 
-            case 't':
-                unescaped = '\t';
-                break;
+        for (const char *last = c - 1; *last == '0' || *last == '.'; --last) {
+            if (*last == '0') {
+                ++trailing_zeros;
+            }
         }
 
-        if (unescaped != '\0') {
-            *end++ = unescaped;
+        d->decimal_point += (int32_t)num_digits;
+        num_digits -= trailing_zeros;
+    }
 
-            okay();
+    d->num_digits = num_digits;
 
-            if (!next(&offset)) {
-                return false;
-            }
+    if (d->num_digits > tfjson_decimal_digits_max) {
+        d->truncated = true;
+        d->num_digits = tfjson_decimal_digits_max;
+    }
 
-            str -= offset;
-            end -= offset;
+    if (c < end && (*c == 'e' || *c == 'E')) {
+        ++c;
 
-            continue;
+        bool negative = false;
+
+        if (c < end && (*c == '-' || *c == '+')) {
+            negative = *c == '-';
+            ++c;
         }
 
-        if (cur == 'u') {
-            if (!next(&offset)) {
-                return false;
-            }
+        int32_t exponent = 0;
 
-            str -= offset;
-            end -= offset;
+        while (c < end && *c >= '0' && *c <= '9') {
+            if (exponent < 0x10000) {
+                exponent = 10 * exponent + (*c - '0');
+            }
 
-            char hex[5] = {0};
+            ++c;
+        }
 
-            for (int i = 0; i < 4; ++i) {
-                if (!isHexDigit()) {
-                    reportError(Error::InvalidEscapeSequence);
-                    return false;
-                }
+        d->decimal_point += negative ? -exponent : exponent;
+    }
+}
 
-                hex[i] = cur;
+// Rounds the number from c up to end to the nearest double by exact decimal arithmetic.
+static tfjson_binary64 tfjson_decimal_to_binary64(const char *c, const char *end) {
+    tfjson_decimal d;
 
-                if (!next(&offset)) {
-                    return false;
-                }
+    tfjson_decimal_parse(&d, c, end);
 
-                str -= offset;
-                end -= offset;
-            }
+    if (d.num_digits == 0 || d.decimal_point < -324) {
+        return {0, 0};
+    }
 
-            // Four hex digits can't encode a value > UINT32_MAX.
-            uint32_t code_point = (uint32_t) strtoul(hex, nullptr, 16);
+    if (d.decimal_point >= 310) {
+        return {0, 0x7FF};
+    }
 
-            if (!allow_null_in_string && code_point == 0) {
-                reportError(Error::ForbiddenNullInString);
-                return false;
-            }
+    // Shifts for 10^n with n < 19 that keep the decimal in range.
+    static const uint8_t powers[19] = {0, 3, 6, 9, 13, 16, 19, 23, 26, 29, 33, 36, 39, 43, 46, 49, 53, 56, 59};
+    const uint32_t shift_max = 60;
+    int32_t exp2 = 0;
 
-            if (code_point <= 0x7F) {
-                *end++ = (char)code_point;
-            }
-            else if (code_point <= 0x07FF) {
-                *end++ = (char)(((code_point >> 6) & 0x1F) | 0xC0);
-                *end++ = (char)(((code_point >> 0) & 0x3F) | 0x80);
-            }
-            else if (code_point <= 0xFFFF) {
-                *end++ = (char)(((code_point >> 12) & 0x0F) | 0xE0);
-                *end++ = (char)(((code_point >>  6) & 0x3F) | 0x80);
-                *end++ = (char)(((code_point >>  0) & 0x3F) | 0x80);
-            }
-            else if (code_point <= 0x10FFFF) {
-                *end++ = (char)(((code_point >> 18) & 0x07) | 0xF0);
-                *end++ = (char)(((code_point >> 12) & 0x3F) | 0x80);
-                *end++ = (char)(((code_point >>  6) & 0x3F) | 0x80);
-                *end++ = (char)(((code_point >>  0) & 0x3F) | 0x80);
-            }
-            else {
-                reportError(Error::InvalidEscapeSequence);
-                return false;
-            }
+    while (d.decimal_point > 0) {
+        uint32_t n = (uint32_t)d.decimal_point;
+        uint32_t shift = n < 19 ? powers[n] : shift_max;
 
-            okay();
+        tfjson_decimal_right_shift(&d, shift);
 
-            continue;
+        if (d.decimal_point < -tfjson_decimal_point_range) {
+            return {0, 0};
         }
 
-        reportError(Error::InvalidEscapeSequence);
-        return false;
+        exp2 += (int32_t)shift;
     }
 
-    okay();
-
-    size_t str_len = end - str;
+    // Shift left towards [1/2, 1).
+    while (d.decimal_point <= 0) {
+        uint32_t shift;
 
-    debugf("parseString(report_as_member: %s) -> \"%.*s\"\n", report_as_member ? "true" : "false", (int)str_len, str);
+        if (d.decimal_point == 0) {
+            if (d.digits[0] >= 5) {
+                break;
+            }
 
-    if (report_as_member) {
-        if (member_handler && !member_handler(str, str_len)) {
-            reportError(Error::Aborted);
-            return false;
+            shift = d.digits[0] < 2 ? 2 : 1;
         }
-    }
-    else {
-        if (string_handler && !string_handler(str, str_len)) {
-            reportError(Error::Aborted);
-            return false;
+        else {
+            uint32_t n = (uint32_t)-d.decimal_point;
+
+            shift = n < 19 ? powers[n] : shift_max;
         }
-    }
 
-    done();
+        tfjson_decimal_left_shift(&d, shift);
 
-    if (!next()) {
-        return false;
+        if (d.decimal_point > tfjson_decimal_point_range) {
+            return {0, 0x7FF};
+        }
+
+        exp2 -= (int32_t)shift;
     }
 
-    return true;
-}
+    // The mantissa of a double is in [1, 2).
+    --exp2;
 
-bool TFJsonDeserializer::parseNumber() {
-    char *number = buf + idx_cur;
-    size_t offset;
+    while (-1022 > exp2) {
+        uint32_t n = (uint32_t)(-1022 - exp2);
 
-    if (cur == '-') {
-        if (!next(&offset)) {
-            return false;
+        if (n > shift_max) {
+            n = shift_max;
         }
 
-        number -= offset;
-    }
+        tfjson_decimal_right_shift(&d, n);
 
-    if (!isDigit()) {
-        reportError(Error::ExpectingNumber);
-        return false;
+        exp2 += (int32_t)n;
     }
 
-    char first_digit = cur;
-
-    if (!next(&offset)) {
-        return false;
+    if (exp2 + 1023 >= 0x7FF) {
+        return {0, 0x7FF};
     }
 
-    number -= offset;
+    tfjson_decimal_left_shift(&d, 53);
 
-    if (first_digit != '0') {
-        while (isDigit()) {
-            if (!next(&offset)) {
-                return false;
-            }
+    uint64_t mantissa = tfjson_decimal_round(&d);
 
-            number -= offset;
+    if (mantissa >= (1ull << 53)) {
+        // rounding overflowed
+        tfjson_decimal_right_shift(&d, 1);
+        exp2 += 1;
+        mantissa = tfjson_decimal_round(&d);
+
+        if (exp2 + 1023 >= 0x7FF) {
+            return {0, 0x7FF};
         }
     }
 
-    bool has_fraction_or_exponent = false;
-
-    if (cur == '.') {
-        if (!next(&offset)) {
-            return false;
-        }
+    tfjson_binary64 answer;
 
-        number -= offset;
+    answer.power2 = exp2 + 1023;
 
-        has_fraction_or_exponent = true;
+    if (mantissa < (1ull << 52)) {
+        --answer.power2;
+    }
 
-        if (!isDigit()) {
-            okay(-1);
+    answer.mantissa = mantissa & ((1ull << 52) - 1);
 
-            reportError(Error::ExpectingFractionDigits);
-            return false;
-        }
+    return answer;
+}
 
-        while (isDigit()) {
-            if (!next(&offset)) {
-                return false;
-            }
+bool tfjson_parse_double(const char *c, size_t len, double *result) {
+    const char *end = c + len;
+    const char *begin = c;
+    bool negative = false;
 
-            number -= offset;
-        }
+    if (c < end && *c == '-') {
+        negative = true;
+        ++c;
     }
 
-    if (cur == 'e' || cur == 'E') {
-        if (!next(&offset)) {
-            return false;
-        }
-
-        number -= offset;
-        has_fraction_or_exponent = true;
-
-        if (cur == '-' || cur == '+') {
-            if (!next(&offset)) {
-                return false;
-            }
+    // Significand w of up to 19 digits and decimal exponent q: The number is w * 10^q.
+    const char *integer = c;
+    uint64_t w = 0;
 
-            number -= offset;
-        }
+    while (c < end && *c >= '0' && *c <= '9') {
+        w = 10 * w + (uint64_t)(*c - '0');
+        ++c;
+    }
 
-        if (!isDigit()) {
-            okay(-1);
+    const char *integer_end = c;
+    const char *fraction = nullptr;
+    const char *fraction_end = nullptr;
+    int64_t digit_count = integer_end - integer;
+    int64_t q = 0;
 
-            reportError(Error::ExpectingExponentDigits);
-            return false;
-        }
+    if (c < end && *c == '.') {
+        ++c;
 
-        while (isDigit()) {
-            if (!next(&offset)) {
-                return false;
-            }
+        fraction = c;
 
-            number -= offset;
+        while (c < end && *c >= '0' && *c <= '9') {
+            w = 10 * w + (uint64_t)(*c - '0');
+            ++c;
         }
+
+        fraction_end = c;
+        q = fraction - fraction_end;
+        digit_count += fraction_end - fraction;
     }
 
-    size_t number_len = buf + idx_cur - number;
-    char *number_buf = nullptr;
+    int64_t exponent = 0;
 
-    debugf("parseNumber() -> \"%.*s\"\n", (int)number_len, number);
+    if (c < end && (*c == 'e' || *c == 'E')) {
+        ++c;
 
-    if (number + number_len >= buf + buf_len) {
-        // if number + number_len == buf + buf_len then there is no space
-        // for temporarily nul-terminating the number to parse it
-        offset = shift();
+        bool exponent_negative = false;
 
-        if (offset > 0) {
-            number -= offset;
-        }
-        else if (number_len + 1 > malloc_size_max) {
-            reportError(Error::BufferTooShort);
-            return false;
+        if (c < end && (*c == '-' || *c == '+')) {
+            exponent_negative = *c == '-';
+            ++c;
         }
-        else {
-            number_buf = strndup(number, number_len);
 
-            if (number_buf == nullptr) {
-                reportError(Error::OutOfMemory);
-                return false;
+        while (c < end && *c >= '0' && *c <= '9') {
+            if (exponent < 0x10000) {
+                exponent = 10 * exponent + (*c - '0');
             }
 
-            number = number_buf;
+            ++c;
+        }
+
+        if (exponent_negative) {
+            exponent = -exponent;
         }
     }
 
-    if (has_fraction_or_exponent) {
-        if (double_handler) {
-            char backup = number[number_len];
+    q += exponent;
 
-            number[number_len] = '\0';
-            errno = 0;
+    bool too_many_digits = false;
 
-            double result = strtod(number, nullptr);
+    if (digit_count > 19) {
+        // Leading zeros are not significant.
+        for (const char *p = integer; p < end && (*p == '0' || *p == '.'); ++p) {
+            if (*p == '0') {
+                --digit_count;
+            }
+        }
 
-            number[number_len] = backup;
+        if (digit_count > 19) {
+            // Keep the first 19 significant digits and remember that there are more.
+            const uint64_t nineteen_digits_min = 1000000000000000000ull;
+            const char *p = integer;
 
-            okay(-1);
+            too_many_digits = true;
+            w = 0;
 
-            if (errno != 0) {
-                debugf("parseNumber() -> \"%.*s\", errno: %d\n", (int)number_len, number, errno);
+            while (w < nineteen_digits_min && p < integer_end) {
+                w = 10 * w + (uint64_t)(*p - '0');
+                ++p;
+            }
 
-                if (number_handler && !number_handler(number, number_len)) {
-                    free(number_buf);
-                    reportError(Error::Aborted);
-                    return false;
-                }
+            if (w >= nineteen_digits_min) {
+                q = (integer_end - p) + exponent;
             }
             else {
-                debugf("parseNumber() -> \"%.*s\" = %f\n", (int)number_len, number, result);
+                p = fraction;
 
-                if (!double_handler(result)) {
-                    free(number_buf);
-                    reportError(Error::Aborted);
-                    return false;
+                while (w < nineteen_digits_min && p < fraction_end) {
+                    w = 10 * w + (uint64_t)(*p - '0');
+                    ++p;
                 }
-            }
-        }
-        else if (number_handler) {
-            if (!number_handler(number, number_len)) {
-                free(number_buf);
-                reportError(Error::Aborted);
-                return false;
+
+                q = (fraction - p) + exponent;
             }
         }
     }
-    else if (*number == '-') {
-        if (int64_handler) {
-            char backup = number[number_len];
-
-            number[number_len] = '\0';
-            errno = 0;
 
-            int64_t result = strtoll(number, nullptr, 10);
+    tfjson_binary64 binary;
 
-            number[number_len] = backup;
+#if FLT_EVAL_METHOD == 0
+    // Both w and 10^|q| are exact doubles, so a single multiplication or division rounds correctly.
+    if (!too_many_digits && q >= -22 && q <= 22 && w <= (1ull << 53)) {
+        double value = (double)w;
 
-            okay(-1);
+        value = q < 0 ? value / tfjson_pow10_exact[-q] : value * tfjson_pow10_exact[q];
+        *result = negative ? -value : value;
 
-            if (errno != 0) {
-                debugf("parseNumber() -> \"%.*s\", errno: %d\n", (int)number_len, number, errno);
+        return true;
+    }
+#endif
 
-                if (number_handler && !number_handler(number, number_len)) {
-                    free(number_buf);
-                    reportError(Error::Aborted);
-                    return false;
-                }
-            }
-            else {
-                debugf("parseNumber() -> \"%.*s\" = %" PRIi64 "\n", (int)number_len, number, result);
+    if (w == 0) {
+        binary = {0, 0};
+    }
+    else {
+        binary = tfjson_eisel_lemire(q, w);
 
-                if (!int64_handler(result)) {
-                    free(number_buf);
-                    reportError(Error::Aborted);
-                    return false;
-                }
-            }
-        }
-        else if (number_handler) {
-            if (!number_handler(number, number_len)) {
-                free(number_buf);
-                reportError(Error::Aborted);
-                return false;
-            }
+        // The truncated digits lie between w and w + 1. If both round to the same double, so does the number.
+        if (too_many_digits && binary != tfjson_eisel_lemire(q, w + 1)) {
+            binary = tfjson_decimal_to_binary64(begin, end);
         }
     }
-    else {
-        if (uint64_handler) {
-            char backup = number[number_len];
 
-            number[number_len] = '\0';
-            errno = 0;
+    uint64_t bits = binary.mantissa | ((uint64_t)binary.power2 << 52) | ((uint64_t)negative << 63);
 
-            uint64_t result = strtoull(number, nullptr, 10);
+    memcpy(result, &bits, sizeof(bits));
 
-            number[number_len] = backup;
+    // Like strtod reporting ERANGE: Overflow to infinity, subnormal results and non-zero numbers that round to zero.
+    return binary.power2 != 0x7FF && (binary.power2 != 0 || (w == 0 && !too_many_digits));
+}
 
-            okay(-1);
+// Bit i of each mask is set if char i of a 64 byte block is of the kind.
+struct tfjson_block_masks {
+    uint64_t quote;
+    uint64_t backslash;
+    uint64_t op;
+    uint64_t whitespace;
+    uint64_t control;
+};
 
-            if (errno != 0) {
-                debugf("parseNumber() -> \"%.*s\", errno: %d\n", (int)number_len, number, errno);
+static void tfjson_classify_block(const char *block, tfjson_block_masks *masks) {
+#if defined(__SSE2__)
+    const __m128i quote = _mm_set1_epi8('"');
+    const __m128i backslash = _mm_set1_epi8('\\');
+    const __m128i lower = _mm_set1_epi8(0x20);
+    const __m128i curly_open = _mm_set1_epi8('{');
+    const __m128i curly_close = _mm_set1_epi8('}');
+    const __m128i colon = _mm_set1_epi8(':');
+    const __m128i comma = _mm_set1_epi8(',');
+    const __m128i space = _mm_set1_epi8(' ');
+    const __m128i tab = _mm_set1_epi8('\t');
+    const __m128i newline = _mm_set1_epi8('\n');
+    const __m128i carriage_return = _mm_set1_epi8('\r');
+    const __m128i control_max = _mm_set1_epi8(0x1F);
+
+    *masks = tfjson_block_masks();
+
+    for (int i = 0; i < 4; ++i) {
+        __m128i x = _mm_loadu_si128((const __m128i *)(block + i * 16));
+        // [ and ] are { and } with bit 5 cleared
+        __m128i x_lower = _mm_or_si128(x, lower);
+        __m128i op = _mm_or_si128(_mm_or_si128(_mm_cmpeq_epi8(x_lower, curly_open), _mm_cmpeq_epi8(x_lower, curly_close)),
+                                  _mm_or_si128(_mm_cmpeq_epi8(x, colon), _mm_cmpeq_epi8(x, comma)));
+        __m128i whitespace = _mm_or_si128(_mm_or_si128(_mm_cmpeq_epi8(x, space), _mm_cmpeq_epi8(x, tab)),
+                                          _mm_or_si128(_mm_cmpeq_epi8(x, newline), _mm_cmpeq_epi8(x, carriage_return)));
+
+        masks->quote |= (uint64_t)(uint16_t)_mm_movemask_epi8(_mm_cmpeq_epi8(x, quote)) << (i * 16);
+        masks->backslash |= (uint64_t)(uint16_t)_mm_movemask_epi8(_mm_cmpeq_epi8(x, backslash)) << (i * 16);
+        masks->op |= (uint64_t)(uint16_t)_mm_movemask_epi8(op) << (i * 16);
+        masks->whitespace |= (uint64_t)(uint16_t)_mm_movemask_epi8(whitespace) << (i * 16);
+        // x <= 0x1F (unsigned) if max(x, 0x1F) == 0x1F
+        masks->control |= (uint64_t)(uint16_t)_mm_movemask_epi8(_mm_cmpeq_epi8(_mm_max_epu8(x, control_max), control_max)) << (i * 16);
+    }
+#elif defined(__ARM_NEON) && defined(__aarch64__)
+    const uint8x16_t lower = vdupq_n_u8(0x20);
+    const uint8x16_t weights = {1, 2, 4, 8, 16, 32, 64, 128, 1, 2, 4, 8, 16, 32, 64, 128};
 
-                if (number_handler && !number_handler(number, number_len)) {
-                    free(number_buf);
-                    reportError(Error::Aborted);
-                    return false;
-                }
-            }
-            else {
-                debugf("parseNumber() -> \"%.*s\" = %" PRIu64 "\n", (int)number_len, number, result);
+    // Emulates movemask: Weight each lane by its bit, then add up pairs of lanes until each half is one byte.
+    auto movemask = [&weights](uint8x16_t x) -> uint64_t {
+        uint8x16_t sum = vandq_u8(x, weights);
 
-                if (!uint64_handler(result)) {
-                    free(number_buf);
-                    reportError(Error::Aborted);
-                    return false;
-                }
-            }
+        sum = vpaddq_u8(sum, sum);
+        sum = vpaddq_u8(sum, sum);
+        sum = vpaddq_u8(sum, sum);
+
+        return vgetq_lane_u16(vreinterpretq_u16_u8(sum), 0);
+    };
+
+    *masks = tfjson_block_masks();
+
+    for (int i = 0; i < 4; ++i) {
+        uint8x16_t x = vld1q_u8((const uint8_t *)block + i * 16);
+        uint8x16_t x_lower = vorrq_u8(x, lower);
+        uint8x16_t op = vorrq_u8(vorrq_u8(vceqq_u8(x_lower, vdupq_n_u8('{')), vceqq_u8(x_lower, vdupq_n_u8('}'))),
+                                 vorrq_u8(vceqq_u8(x, vdupq_n_u8(':')), vceqq_u8(x, vdupq_n_u8(','))));
+        uint8x16_t whitespace = vorrq_u8(vorrq_u8(vceqq_u8(x, vdupq_n_u8(' ')), vceqq_u8(x, vdupq_n_u8('\t'))),
+                                         vorrq_u8(vceqq_u8(x, vdupq_n_u8('\n')), vceqq_u8(x, vdupq_n_u8('\r'))));
+
+        masks->quote |= movemask(vceqq_u8(x, vdupq_n_u8('"'))) << (i * 16);
+        masks->backslash |= movemask(vceqq_u8(x, vdupq_n_u8('\\'))) << (i * 16);
+        masks->op |= movemask(op) << (i * 16);
+        masks->whitespace |= movemask(whitespace) << (i * 16);
+        masks->control |= movemask(vcltq_u8(x, lower)) << (i * 16);
+    }
+#else
+    *masks = tfjson_block_masks();
+
+    for (int i = 0; i < 64; ++i) {
+        uint64_t bit = 1ull << i;
+
+        if (tfjson_is_control(block[i])) {
+            masks->control |= bit;
         }
-        else if (number_handler) {
-            if (!number_handler(number, number_len)) {
-                free(number_buf);
-                reportError(Error::Aborted);
-                return false;
-            }
+
+        switch (block[i]) {
+            case '"':
+                masks->quote |= bit;
+                break;
+
+            case '\\':
+                masks->backslash |= bit;
+                break;
+
+            case '{':
+            case '}':
+            case '[':
+            case ']':
+            case ':':
+            case ',':
+                masks->op |= bit;
+                break;
+
+            case ' ':
+            case '\t':
+            case '\n':
+            case '\r':
+                masks->whitespace |= bit;
+                break;
+
+            default:
+                break;
         }
     }
+#endif
+}
 
-    free(number_buf);
-    done();
+// Returns the chars escaped by a backslash: the ones after odd-length runs of backslashes. escaped_carry is set if the next
+// block starts with an escaped char. See "Parsing Gigabytes of JSON per Second" by Geoff Langdale and Daniel Lemire.
+static uint64_t tfjson_find_escaped(uint64_t backslash, uint64_t *escaped_carry) {
+    const uint64_t even_bits = 0x5555555555555555ull;
 
-    return true;
+    // An escaped backslash doesn't start a run.
+    backslash &= ~*escaped_carry;
+
+    uint64_t follows_escape = (backslash << 1) | *escaped_carry;
+    uint64_t odd_starts = backslash & ~even_bits & ~follows_escape;
+    uint64_t even_ends;
+
+    // Adding the run starts to the runs carries each start to the char after its run.
+    *escaped_carry = __builtin_add_overflow(odd_starts, backslash, &even_ends) ? 1 : 0;
+
+    return (even_bits ^ (even_ends << 1)) & follows_escape;
 }
 
-bool TFJsonDeserializer::parseNull() {
-    if (cur != 'n') {
-        reportError(Error::ExpectingNull);
-        return false;
-    }
+// Sets each bit to the parity of the bits up to it.
+static uint64_t tfjson_prefix_xor(uint64_t x) {
+    x ^= x << 1;
+    x ^= x << 2;
+    x ^= x << 4;
+    x ^= x << 8;
+    x ^= x << 16;
+    x ^= x << 32;
 
-    if (!next()) {
-        return false;
-    }
+    return x;
+}
 
-    if (cur != 'u') {
-        reportError(Error::ExpectingNull);
-        return false;
-    }
+size_t tfjson_index_structurals(const char *buf, size_t len, uint32_t *index, size_t index_max) {
+    uint64_t escaped_carry = 0;
+    uint64_t in_string_carry = 0; // all bits set if the previous block ended inside of a string
+    uint64_t scalar_carry = 0;    // set if the previous block ended with a scalar char
+    uint64_t dirty_carry = 0;     // set if the previous block ended inside of a string with backslashes or control chars
+    size_t index_len = 0;
 
-    if (!next()) {
-        return false;
-    }
+    char padded[64];
 
-    if (cur != 'l') {
-        reportError(Error::ExpectingNull);
-        return false;
-    }
+    for (size_t block_start = 0; block_start < len; block_start += 64) {
+        const char *block = buf + block_start;
 
-    if (!next()) {
-        return false;
-    }
+        if (len - block_start < 64) {
+            // Pad the last block with whitespace, that is never indexed.
+            memset(padded, ' ', sizeof(padded));
+            memcpy(padded, block, len - block_start);
+            block = padded;
+        }
 
-    if (cur != 'l') {
-        reportError(Error::ExpectingNull);
-        return false;
-    }
+        tfjson_block_masks masks;
 
-    okay();
+        tfjson_classify_block(block, &masks);
 
-    if (null_handler && !null_handler()) {
-        reportError(Error::Aborted);
-        return false;
-    }
+        uint64_t quote = masks.quote & ~tfjson_find_escaped(masks.backslash, &escaped_carry);
+        // Includes the opening quotes, but not the closing ones
+        uint64_t in_string = tfjson_prefix_xor(quote) ^ in_string_carry;
 
-    done();
+        in_string_carry = (uint64_t)((int64_t)in_string >> 63);
 
-    if (!next()) {
-        return false;
-    }
+        // Adding a set bit to the run of bits of a string's content carries to the closing quote after it.
+        uint64_t content = in_string & ~quote;
+        uint64_t dirty_content;
+        uint64_t dirty_carry_in = dirty_carry;
 
-    return true;
-}
+        dirty_carry = __builtin_add_overflow(content, (masks.backslash | masks.control) & content, &dirty_content) ? 1 : 0;
+        dirty_carry |= __builtin_add_overflow(dirty_content, dirty_carry_in, &dirty_content) ? 1 : 0;
 
-bool TFJsonDeserializer::parseTrue() {
-    if (cur != 't') {
-        reportError(Error::ExpectingTrue);
-        return false;
-    }
+        uint64_t closing_quote = quote & ~in_string;
+        uint64_t dirty_closing_quote = dirty_content & closing_quote;
 
-    if (!next()) {
-        return false;
-    }
+        // Everything else is part of a scalar value. Its first char starts a value, unless it is a closing quote.
+        uint64_t scalar = ~(masks.op | masks.whitespace);
+        uint64_t nonquote_scalar = scalar & ~quote;
+        uint64_t follows_scalar = (nonquote_scalar << 1) | scalar_carry;
 
-    if (cur != 'r') {
-        reportError(Error::ExpectingTrue);
-        return false;
-    }
+        scalar_carry = nonquote_scalar >> 63;
 
-    if (!next()) {
-        return false;
-    }
+        uint64_t structurals = ((masks.op | (scalar & ~follows_scalar)) & ~(in_string ^ quote)) | closing_quote;
 
-    if (cur != 'u') {
-        reportError(Error::ExpectingTrue);
-        return false;
-    }
+        if (len - block_start < 64) {
+            structurals &= (1ull << (len - block_start)) - 1;
+        }
 
-    if (!next()) {
-        return false;
-    }
+        size_t count = (size_t)__builtin_popcountll(structurals);
 
-    if (cur != 'e') {
-        reportError(Error::ExpectingTrue);
-        return false;
-    }
+        if (count > index_max - index_len) {
+            return SIZE_MAX;
+        }
 
-    okay();
+        uint32_t *entry = index + index_len;
+        uint32_t *entry_end = entry + count;
 
-    if (boolean_handler && !boolean_handler(true)) {
-        reportError(Error::Aborted);
-        return false;
-    }
+        // Write eight entries at a time if there is room for the excess, to avoid a branch per entry. Bit 63 stands in for
+        // the missing bits: It is the next set bit if all others are cleared already.
+        if (index_max - index_len >= 64) {
+            while (entry < entry_end) {
+                for (int i = 0; i < 8; ++i) {
+                    int bit = __builtin_ctzll(structurals | (1ull << 63));
 
-    done();
+                    entry[i] = (uint32_t)(block_start + bit) | ((uint32_t)(dirty_closing_quote >> bit) << 31);
+                    structurals &= structurals - 1;
+                }
 
-    if (!next()) {
-        return false;
+                entry += 8;
+            }
+        }
+        else {
+            while (structurals != 0) {
+                int bit = __builtin_ctzll(structurals);
+
+                *entry++ = (uint32_t)(block_start + bit) | ((uint32_t)(dirty_closing_quote >> bit) << 31);
+                structurals &= structurals - 1;
+            }
+        }
+
+        index_len += count;
     }
 
-    return true;
+    return index_len;
 }
 
-bool TFJsonDeserializer::parseFalse() {
-    if (cur != 'f') {
-        reportError(Error::ExpectingFalse);
-        return false;
-    }
+TFJsonDeserializer::TFJsonDeserializer(size_t nesting_depth_max, size_t malloc_size_max, bool allow_null_in_string, uint32_t *nesting_stack) :
+    TFJsonParser(nesting_depth_max, malloc_size_max, allow_null_in_string, nesting_stack) {
+}
 
-    if (!next()) {
-        return false;
+const char *TFJsonParserBase::getErrorName(Error error) {
+    switch (error) {
+        case Error::Aborted: return "Aborted";
+        case Error::ExpectingEndOfInput: return "ExpectingEndOfInput";
+        case Error::ExpectingValue: return "ExpectingValue";
+        case Error::ExpectingOpeningCurlyBracket: return "ExpectingOpeningCurlyBracket";
+        case Error::ExpectingClosingCurlyBracket: return "ExpectingClosingCurlyBracket";
+        case Error::ExpectingColon: return "ExpectingColon";
+        case Error::ExpectingOpeningSquareBracket: return "ExpectingOpeningSquareBracket";
+        case Error::ExpectingClosingSquareBracket: return "ExpectingClosingSquareBracket";
+        case Error::ExpectingOpeningQuote: return "ExpectingOpeningQuote";
+        case Error::ExpectingClosingQuote: return "ExpectingClosingQuote";
+        case Error::ExpectingNumber: return "ExpectingNumber";
+        case Error::ExpectingFractionDigits: return "ExpectingFractionDigits";
+        case Error::ExpectingExponentDigits: return "ExpectingExponentDigits";
+        case Error::ExpectingNull: return "ExpectingNull";
+        case Error::ExpectingTrue: return "ExpectingTrue";
+        case Error::ExpectingFalse: return "ExpectingFalse";
+        case Error::InvalidEscapeSequence: return "InvalidEscapeSequence";
+        case Error::UnescapedControlCharacter: return "UnescapedControlCharacter";
+        case Error::ForbiddenNullInString: return "ForbiddenNullInString";
+        case Error::NestingTooDeep: return "NestingTooDeep";
+        case Error::InlineNullByte: return "InlineNullByte";
+        case Error::InvalidUTF8StartByte: return "InvalidUTF8StartByte";
+        case Error::InvalidUTF8ContinuationByte: return "InvalidUTF8ContinuationByte";
+        case Error::BufferTooShort: return "BufferTooShort";
+        case Error::OutOfMemory: return "OutOfMemory";
+        case Error::ElementTooLong: return "ElementTooLong";
+        case Error::RefillFailure: return "RefillFailure";
     }
+    return "Unknown";
+}
 
-    if (cur != 'a') {
-        reportError(Error::ExpectingFalse);
-        return false;
-    }
+void TFJsonDeserializer::setErrorHandler(std::function<void(Error, char *, size_t)> &&error_handler_) { error_handler = std::move(error_handler_); }
 
-    if (!next()) {
-        return false;
-    }
+void TFJsonDeserializer::setRefillHandler(std::function<ssize_t(char *, size_t)> &&refill_handler_) { refill_handler = std::move(refill_handler_); }
 
-    if (cur != 'l') {
-        reportError(Error::ExpectingFalse);
-        return false;
-    }
+void TFJsonDeserializer::setBeginHandler(std::function<bool(void)> &&begin_handler_) { begin_handler = std::move(begin_handler_); }
 
-    if (!next()) {
-        return false;
-    }
+void TFJsonDeserializer::setEndHandler(std::function<bool(void)> &&end_handler_) { end_handler = std::move(end_handler_); }
 
-    if (cur != 's') {
-        reportError(Error::ExpectingFalse);
-        return false;
-    }
+void TFJsonDeserializer::setObjectBeginHandler(std::function<bool(void)> &&object_begin_handler_) { object_begin_handler = std::move(object_begin_handler_); }
 
-    if (!next()) {
-        return false;
-    }
+void TFJsonDeserializer::setObjectEndHandler(std::function<bool(void)> &&object_end_handler_) { object_end_handler = std::move(object_end_handler_); }
 
-    if (cur != 'e') {
-        reportError(Error::ExpectingFalse);
-        return false;
-    }
+void TFJsonDeserializer::setArrayBeginHandler(std::function<bool(void)> &&array_begin_handler_) { array_begin_handler = std::move(array_begin_handler_); }
 
-    okay();
+void TFJsonDeserializer::setArrayEndHandler(std::function<bool(void)> &&array_end_handler_) { array_end_handler = std::move(array_end_handler_); }
 
-    if (boolean_handler && !boolean_handler(false)) {
-        reportError(Error::Aborted);
-        return false;
-    }
+void TFJsonDeserializer::setMemberHandler(std::function<bool(char *, size_t)> &&member_handler_) { member_handler = std::move(member_handler_); }
 
-    done();
+void TFJsonDeserializer::setStringHandler(std::function<bool(char *, size_t)> &&string_handler_) { string_handler = std::move(string_handler_); }
 
-    if (!next()) {
-        return false;
-    }
+void TFJsonDeserializer::setDoubleHandler(std::function<bool(double)> &&double_handler_) { double_handler = std::move(double_handler_); }
 
-    return true;
-}
+void TFJsonDeserializer::setInt64Handler(std::function<bool(int64_t)> &&int64_handler_) { int64_handler = std::move(int64_handler_); }
+
+void TFJsonDeserializer::setUInt64Handler(std::function<bool(uint64_t)> &&uint64_handler_) { uint64_handler = std::move(uint64_handler_); }
+
+void TFJsonDeserializer::setNumberHandler(std::function<bool(char *, size_t)> &&number_handler_) { number_handler = std::move(number_handler_); }
+
+void TFJsonDeserializer::setBooleanHandler(std::function<bool(bool)> &&boolean_handler_) { boolean_handler = std::move(boolean_handler_); }
+
+void TFJsonDeserializer::setNullHandler(std::function<bool(void)> &&null_handler_) { null_handler = std::move(null_handler_); }
 
 #endif
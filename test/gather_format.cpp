@@ -0,0 +1,82 @@
+// Formatted strings with gather output: They are formatted into temporary memory, so they have to be copied into buf instead
+// of being referenced by iov.
+// Build and run from this directory:
+//     g++ -std=gnu++11 -O1 -g -fsanitize=address,undefined -I../src gather_format.cpp -o gather_format && ./gather_format
+
+#define TFJSON_IMPLEMENTATION
+#include "TFJson.h"
+
+#include <stdio.h>
+#include <string>
+#include <sys/uio.h>
+
+static std::string gathered(const struct iovec *iov, size_t iov_count) {
+    std::string result;
+
+    for (size_t i = 0; i < iov_count; ++i)
+        result.append((const char *)iov[i].iov_base, iov[i].iov_len);
+
+    return result;
+}
+
+// Overwrites the stack memory the formatted string was in.
+[[gnu::noinline]] static void clobber_stack() {
+    volatile char noise[4096];
+
+    for (size_t i = 0; i < sizeof(noise); ++i)
+        noise[i] = 'x';
+}
+
+// If fits is false, buf can't hold the copied formatted string, so the payload has to be dropped.
+static bool check(const char *name, size_t len, size_t buf_size, bool fits) {
+    // Clean chars only, so that the formatted string could be referenced.
+    std::string clean(len, 'a');
+    std::string expected;
+
+    {
+        std::string buf(len * 2 + 64, '\0');
+        TFJsonSerializer json(&buf[0], buf.size());
+
+        json.addObject();
+        json.addMemberStringF("msg", "%s-%d", clean.c_str(), 42);
+        json.addMemberString("ref", clean.c_str());
+        json.endObject();
+        json.end();
+
+        expected = buf.c_str();
+    }
+
+    std::string buf(buf_size, '\0');
+    struct iovec iov[16];
+    TFJsonSerializer json(&buf[0], buf.size());
+
+    json.setGatherOutput(iov, sizeof(iov) / sizeof(iov[0]));
+    json.addObject();
+    json.addMemberStringF("msg", "%s-%d", clean.c_str(), 42);
+    clobber_stack();
+    json.addMemberString("ref", clean.c_str());
+    json.endObject();
+
+    size_t required = json.end();
+    std::string result = gathered(iov, json.iov_count);
+
+    bool ok = required == expected.size() && (fits ? result == expected : json.iov_count == 0);
+
+    printf("%s: %s\n", name, ok ? "ok" : "FAILED");
+
+    if (!ok)
+        printf("    expected %s\n    got      %s\n", expected.c_str(), result.c_str());
+
+    return ok;
+}
+
+int main() {
+    bool ok = true;
+
+    ok &= check("short formatted string", 20, 64, true);
+    ok &= check("formatted string in the stack scratch", 78, 256, true);
+    ok &= check("formatted string in buf", 200, 512, true);
+    ok &= check("formatted string in a temporary heap buffer", 200, 64, false);
+
+    return ok ? 0 : 1;
+}